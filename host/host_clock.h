@@ -0,0 +1,41 @@
+#include <stdint.h>
+
+#ifndef HOST_CLOCK_H
+#define HOST_CLOCK_H
+
+/*
+ * Simulated time for the host build. The FreeRTOS tick and the NimBLE time both count milliseconds since boot, the
+ * RTC behind gettimeofday keeps running through a simulated deep sleep and can drift against real time.
+ */
+
+/* Moves the clock on, running the NimBLE callouts and FreeRTOS timers that come due on the way in order. */
+void
+host_clock_advance_ms(uint32_t ms);
+
+uint32_t
+host_clock_ms();
+
+/* Deep sleeps for the given time on the RTC and boots again, which restarts the tick and disarms every callout and
+ * timer. */
+void
+host_clock_deep_sleep_us(int64_t rtc_us);
+
+/* Parts per million the RTC runs fast (positive) or slow against real time. */
+void
+host_clock_set_rtc_drift_ppm(int32_t ppm);
+
+int64_t
+host_clock_rtc_us();
+
+/* Real time since the simulation started, what a perfect clock would read. */
+int64_t
+host_clock_real_us();
+
+void
+host_clock_reset();
+
+/* Log messages at this level or more severe are printed, ESP_LOG_NONE by default. */
+void
+host_log_set_level(int level);
+
+#endif //HOST_CLOCK_H
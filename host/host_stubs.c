@@ -0,0 +1,587 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs_flash.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+#include "mesh_misc.h"
+#include "host_clock.h"
+
+/*
+ * What the mesh modules built on the host need from ESP-IDF, FreeRTOS and NimBLE. Radio calls default to failing
+ * with BLE_HS_ENOTSUP, simulations that exercise them provide their own.
+ */
+
+struct host_timer {
+    TimerCallbackFunction_t *callback;
+    void *timer_id;
+    TickType_t period;
+    bool auto_reload;
+    bool active;
+    TickType_t expires_at;
+    struct host_timer *next;
+};
+
+static uint32_t clock_ms;
+static int64_t clock_real_us;
+static int64_t clock_rtc_us;
+static int32_t clock_rtc_drift_ppm;
+static int log_level = ESP_LOG_NONE;
+
+/* Every callout and timer ever set up, whether armed or not. */
+static struct ble_npl_callout *callouts;
+static struct host_timer *timers;
+static struct ble_npl_eventq dflt_eventq;
+
+static void
+hc_step_ms(uint32_t ms) {
+    clock_ms += ms;
+    clock_real_us += (int64_t) ms * 1000;
+    clock_rtc_us += (int64_t) ms * (1000000 + clock_rtc_drift_ppm) / 1000;
+}
+
+static bool
+hc_due_before(uint32_t expires_at, uint32_t until_ms, bool found, uint32_t best_ms) {
+    return (int32_t) (expires_at - until_ms) <= 0 && (!found || (int32_t) (expires_at - best_ms) < 0);
+}
+
+/**
+ * Finds the callout or timer that comes due first, no later than the given tick.
+ */
+static bool
+hc_next_due(uint32_t until_ms, struct ble_npl_callout **out_co, struct host_timer **out_timer) {
+    struct ble_npl_callout *co;
+    struct host_timer *timer;
+    uint32_t best_ms = 0;
+    bool found = false;
+
+    *out_co = NULL;
+    *out_timer = NULL;
+    for (co = callouts; co != NULL; co = co->next) {
+        if (co->active && hc_due_before(co->expires_at, until_ms, found, best_ms)) {
+            best_ms = co->expires_at;
+            *out_co = co;
+            found = true;
+        }
+    }
+    for (timer = timers; timer != NULL; timer = timer->next) {
+        if (timer->active && hc_due_before(timer->expires_at, until_ms, found, best_ms)) {
+            best_ms = timer->expires_at;
+            *out_co = NULL;
+            *out_timer = timer;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void
+host_clock_advance_ms(uint32_t ms) {
+    struct ble_npl_callout *co;
+    struct host_timer *timer;
+    uint32_t until_ms = clock_ms + ms;
+
+    while (hc_next_due(until_ms, &co, &timer)) {
+        if (co != NULL) {
+            hc_step_ms(co->expires_at - clock_ms);
+            co->active = false;
+            co->ev.fn(&co->ev);
+        } else {
+            hc_step_ms(timer->expires_at - clock_ms);
+            if (timer->auto_reload) {
+                timer->expires_at += timer->period;
+            } else {
+                timer->active = false;
+            }
+            timer->callback(timer);
+        }
+    }
+    hc_step_ms(until_ms - clock_ms);
+}
+
+/* Nothing stays armed through a reboot. */
+static void
+hc_disarm_all() {
+    struct ble_npl_callout *co;
+    struct host_timer *timer;
+
+    for (co = callouts; co != NULL; co = co->next) {
+        co->active = false;
+    }
+    for (timer = timers; timer != NULL; timer = timer->next) {
+        timer->active = false;
+    }
+}
+
+uint32_t
+host_clock_ms() {
+    return clock_ms;
+}
+
+void
+host_clock_deep_sleep_us(int64_t rtc_us) {
+    clock_real_us += rtc_us * 1000000 / (1000000 + clock_rtc_drift_ppm);
+    clock_rtc_us += rtc_us;
+    clock_ms = 0;
+    hc_disarm_all();
+}
+
+void
+host_clock_set_rtc_drift_ppm(int32_t ppm) {
+    clock_rtc_drift_ppm = ppm;
+}
+
+int64_t
+host_clock_rtc_us() {
+    return clock_rtc_us;
+}
+
+int64_t
+host_clock_real_us() {
+    return clock_real_us;
+}
+
+void
+host_clock_reset() {
+    clock_ms = 0;
+    clock_real_us = 0;
+    clock_rtc_us = 0;
+    clock_rtc_drift_ppm = 0;
+    hc_disarm_all();
+}
+
+void
+host_log_set_level(int level) {
+    log_level = level;
+}
+
+void
+esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    va_list args;
+
+    if (level > log_level) {
+        return;
+    }
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+TickType_t
+xTaskGetTickCount(void) {
+    return clock_ms;
+}
+
+ble_npl_time_t
+ble_npl_time_get(void) {
+    return clock_ms;
+}
+
+struct ble_npl_eventq *
+nimble_port_get_dflt_eventq(void) {
+    return &dflt_eventq;
+}
+
+void
+ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq, ble_npl_event_fn *ev_cb, void *ev_arg) {
+    struct ble_npl_callout *known;
+
+    co->ev.fn = ev_cb;
+    co->ev.arg = ev_arg;
+    co->active = false;
+
+    for (known = callouts; known != NULL; known = known->next) {
+        if (known == co) {
+            return;
+        }
+    }
+    co->next = callouts;
+    callouts = co;
+}
+
+int
+ble_npl_callout_reset(struct ble_npl_callout *co, ble_npl_time_t ticks) {
+    co->expires_at = clock_ms + ticks;
+    co->active = true;
+    return 0;
+}
+
+void
+ble_npl_callout_stop(struct ble_npl_callout *co) {
+    co->active = false;
+}
+
+bool
+ble_npl_callout_is_active(struct ble_npl_callout *co) {
+    return co->active;
+}
+
+TimerHandle_t
+xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload, void *timer_id,
+             TimerCallbackFunction_t *callback) {
+    struct host_timer *timer;
+
+    timer = calloc(1, sizeof *timer);
+    if (timer == NULL) {
+        return NULL;
+    }
+
+    timer->callback = callback;
+    timer->timer_id = timer_id;
+    timer->period = period;
+    timer->auto_reload = auto_reload;
+    timer->next = timers;
+    timers = timer;
+    return timer;
+}
+
+BaseType_t
+xTimerStart(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    timer->expires_at = clock_ms + timer->period;
+    timer->active = true;
+    return pdPASS;
+}
+
+BaseType_t
+xTimerStop(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    timer->active = false;
+    return pdPASS;
+}
+
+BaseType_t
+xTimerIsTimerActive(TimerHandle_t timer) {
+    return timer->active;
+}
+
+uint32_t
+esp_random(void) {
+    return rand();
+}
+
+const char *
+esp_err_to_name(esp_err_t code) {
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+esp_err_t
+nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+}
+
+esp_err_t
+nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+}
+
+esp_err_t
+nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+}
+
+esp_err_t
+nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+}
+
+esp_err_t
+nvs_commit(nvs_handle_t handle) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+}
+
+void
+nvs_close(nvs_handle_t handle) {
+}
+
+/* Linked with --wrap=gettimeofday, the RTC is what gettimeofday reads on the target. */
+int
+__wrap_gettimeofday(struct timeval *tv, void *tz) {
+    tv->tv_sec = clock_rtc_us / 1000000;
+    tv->tv_usec = clock_rtc_us % 1000000;
+    return 0;
+}
+
+void
+mesh_print_bytes(const uint8_t *bytes, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        esp_log_write(ESP_LOG_DEBUG, "mn", "%s0x%02x", i != 0 ? ":" : "", bytes[i]);
+    }
+}
+
+char *
+mesh_addr_str(const void *addr) {
+    static char addr_buf[18];
+    const uint8_t *u8p;
+
+    u8p = addr;
+    sprintf(addr_buf, "%02x:%02x:%02x:%02x:%02x:%02x", u8p[5], u8p[4], u8p[3], u8p[2], u8p[1], u8p[0]);
+    return addr_buf;
+}
+
+void
+mesh_print_addr(const uint8_t *val) {
+    esp_log_write(ESP_LOG_DEBUG, "mn", "%s", mesh_addr_str(val));
+}
+
+void
+mesh_print_ble_addr(const ble_addr_t *addr) {
+    mesh_print_addr(addr->val);
+}
+
+void
+mesh_print_uuid(const ble_uuid_t *uuid) {
+    if (uuid->type == BLE_UUID_TYPE_16) {
+        esp_log_write(ESP_LOG_DEBUG, "mn", "0x%04x ", ((const ble_uuid16_t *) uuid)->value);
+    }
+}
+
+int
+os_mempool_init(struct os_mempool *mp, uint16_t blocks, uint32_t block_size, void *membuf, const char *name) {
+    uint8_t *block;
+    int i;
+
+    mp->blocks = blocks;
+    mp->block_size = block_size;
+    mp->free_list = NULL;
+    if (membuf == NULL || block_size < sizeof(void *)) {
+        return 0;
+    }
+
+    for (i = blocks - 1; i >= 0; i--) {
+        block = (uint8_t *) membuf + i * block_size;
+        *(void **) block = mp->free_list;
+        mp->free_list = block;
+    }
+    return 0;
+}
+
+void *
+os_memblock_get(struct os_mempool *mp) {
+    void *block;
+
+    block = mp->free_list;
+    if (block != NULL) {
+        mp->free_list = *(void **) block;
+    }
+    return block;
+}
+
+int
+os_memblock_put(struct os_mempool *mp, void *block_addr) {
+    *(void **) block_addr = mp->free_list;
+    mp->free_list = block_addr;
+    return 0;
+}
+
+int
+os_mbuf_pool_init(struct os_mbuf_pool *omp, struct os_mempool *mp, uint16_t buf_len, uint16_t nbufs) {
+    omp->pool = mp;
+    return 0;
+}
+
+struct os_mbuf *
+os_msys_get_pkthdr(uint16_t dsize, uint16_t user_hdr_len) {
+    return calloc(1, sizeof(struct os_mbuf));
+}
+
+struct os_mbuf *
+os_mbuf_get_pkthdr(struct os_mbuf_pool *omp, uint8_t pkthdr_len) {
+    return os_msys_get_pkthdr(0, pkthdr_len);
+}
+
+int
+os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len) {
+    uint8_t *grown;
+
+    if (om->om_len + len > om->om_cap) {
+        grown = realloc(om->om_data, om->om_len + len);
+        if (grown == NULL) {
+            return BLE_HS_ENOMEM;
+        }
+        om->om_data = grown;
+        om->om_cap = om->om_len + len;
+    }
+
+    memcpy(om->om_data + om->om_len, data, len);
+    om->om_len += len;
+    return 0;
+}
+
+int
+os_mbuf_free_chain(struct os_mbuf *om) {
+    if (om != NULL) {
+        free(om->om_data);
+        free(om);
+    }
+    return 0;
+}
+
+int
+ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len) {
+    uint16_t len;
+
+    len = om->om_len < max_len ? om->om_len : max_len;
+    memcpy(flat, om->om_data, len);
+    *out_copy_len = len;
+    return len < om->om_len ? BLE_HS_EMSGSIZE : 0;
+}
+
+struct os_mbuf *
+ble_hs_mbuf_from_flat(const void *buf, uint16_t len) {
+    struct os_mbuf *om;
+
+    om = os_msys_get_pkthdr(len, 0);
+    if (om != NULL && os_mbuf_append(om, buf, len) != 0) {
+        os_mbuf_free_chain(om);
+        om = NULL;
+    }
+    return om;
+}
+
+char *
+ble_uuid_to_str(const ble_uuid_t *uuid, char *dst) {
+    snprintf(dst, BLE_UUID_STR_LEN, "0x%04x", uuid->type == BLE_UUID_TYPE_16 ? ((const ble_uuid16_t *) uuid)->value : 0);
+    return dst;
+}
+
+void
+ble_svc_gap_init(void) {
+}
+
+void
+ble_svc_gatt_init(void) {
+}
+
+int
+ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs) {
+    return 0;
+}
+
+int
+ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs) {
+    return 0;
+}
+
+__attribute__((weak)) int
+ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type) {
+    *out_addr_type = BLE_ADDR_PUBLIC;
+    return 0;
+}
+
+__attribute__((weak)) int
+ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc) {
+    return BLE_HS_ENOTCONN;
+}
+
+__attribute__((weak)) int
+ble_gap_conn_rssi(uint16_t conn_handle, int8_t *out_rssi) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params *params) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gap_wl_set(const ble_addr_t *addrs, uint8_t white_list_count) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_disc_all_svcs(uint16_t conn_handle, ble_gatt_disc_svc_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_disc_svc_by_uuid(uint16_t conn_handle, const ble_uuid_t *uuid, ble_gatt_disc_svc_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_disc_all_chrs(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle,
+                        ble_gatt_chr_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_disc_all_dscs(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle,
+                        ble_gatt_dsc_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t data_len,
+                     ble_gatt_attr_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_write_long(uint16_t conn_handle, uint16_t attr_handle, uint16_t offset, struct os_mbuf *txom,
+                     ble_gatt_attr_fn *cb, void *cb_arg) {
+    os_mbuf_free_chain(txom);
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om) {
+    os_mbuf_free_chain(om);
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_l2cap_connect(uint16_t conn_handle, uint16_t psm, uint16_t mtu, struct os_mbuf *sdu_rx,
+                  ble_l2cap_event_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_l2cap_disconnect(struct ble_l2cap_chan *chan) {
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_l2cap_send(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_tx) {
+    os_mbuf_free_chain(sdu_tx);
+    return BLE_HS_ENOTSUP;
+}
+
+__attribute__((weak)) int
+ble_l2cap_recv_ready(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_rx) {
+    return BLE_HS_ENOTSUP;
+}
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host/ble_hs.h"
+#include "host/ble_l2cap.h"
+#include "mesh_coc.h"
+#include "mesh_transport.h"
+#include "host_clock.h"
+
+/*
+ * Time to move a burst of packets to a node over the data channel against GATT writes. The channel side runs the
+ * real framing and credit handling in mesh_coc.c over a model of the stack: SDUs are cut into K-frames of one link
+ * layer PDU each, every K-frame takes a credit, and the receiver hands back an SDU's credits once it has taken it.
+ * A GATT write carries one packet and needs its response before the next one, a connection interval per packet.
+ */
+
+#define SIM_ITVL_MS 15
+#define SIM_BURST 64
+
+/* K-frame payload that fits one 251 octet link layer PDU, and the credits the receiver starts with. */
+#define SIM_MPS 247
+#define SIM_INITIAL_CREDITS ((COC_MTU + 2 + SIM_MPS - 1) / SIM_MPS)
+#define SIM_LL_FIFO_SIZE 64
+
+#define SIM_SENDER_HANDLE 1
+#define SIM_RECEIVER_HANDLE 2
+
+struct ble_l2cap_chan {
+    ble_l2cap_event_fn *cb;
+    uint16_t conn_handle;
+    uint16_t credits;
+    struct os_mbuf *sdu_rx;
+};
+
+/* The central's end opens the channel and sends, the peripheral's end accepts it. */
+static struct ble_l2cap_chan chan_tx;
+static struct ble_l2cap_chan chan_rx;
+static ble_l2cap_event_fn *server_cb;
+
+/* SDU the stack is cutting into K-frames, and the K-frames waiting for the link. */
+static struct os_mbuf *stack_sdu;
+static uint16_t stack_frames_left;
+static bool stack_stalled;
+/* Each entry is a K-frame, the last one of an SDU carries the SDU to the receiver. */
+static struct os_mbuf *ll_fifo[SIM_LL_FIFO_SIZE];
+static int ll_head;
+static int ll_count;
+static uint16_t credits_returning;
+
+/* Error the stack fails the next send with. Like NimBLE it frees the SDU unless it rejected it as BLE_HS_EBADDATA. */
+static int stack_fail_rc;
+
+/* One write may be outstanding on the GATT path. */
+static bool gatt_pending;
+static uint8_t gatt_data[DATA_PACKET_MAX_SIZE];
+static uint16_t gatt_len;
+
+static int pdus_per_event;
+static int sim_sdus;
+static int sim_kframes;
+static int received;
+static int received_bad;
+static int done_count;
+
+int
+ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc) {
+    memset(out_desc, 0, sizeof *out_desc);
+    out_desc->conn_handle = handle;
+    out_desc->role = handle == SIM_SENDER_HANDLE ? BLE_GAP_ROLE_MASTER : BLE_GAP_ROLE_SLAVE;
+    return 0;
+}
+
+int
+ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn *cb, void *cb_arg) {
+    server_cb = cb;
+    return 0;
+}
+
+int
+ble_l2cap_connect(uint16_t conn_handle, uint16_t psm, uint16_t mtu, struct os_mbuf *sdu_rx,
+                  ble_l2cap_event_fn *cb, void *cb_arg) {
+    chan_tx.cb = cb;
+    chan_tx.conn_handle = conn_handle;
+    chan_tx.sdu_rx = sdu_rx;
+    return 0;
+}
+
+int
+ble_l2cap_recv_ready(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_rx) {
+    os_mbuf_free_chain(chan->sdu_rx);
+    chan->sdu_rx = sdu_rx;
+    return 0;
+}
+
+int
+ble_l2cap_disconnect(struct ble_l2cap_chan *chan) {
+    return 0;
+}
+
+static void
+sim_emit(struct ble_l2cap_chan *chan, struct ble_l2cap_event *event) {
+    chan->cb(event, NULL);
+}
+
+/* Hands K-frames of the SDU in the stack to the link while there are credits for them. */
+static void
+sim_stack_queue_frames() {
+    struct ble_l2cap_event event;
+
+    while (stack_sdu != NULL && chan_tx.credits > 0 && ll_count < SIM_LL_FIFO_SIZE) {
+        chan_tx.credits--;
+        stack_frames_left--;
+        ll_fifo[(ll_head + ll_count) % SIM_LL_FIFO_SIZE] = stack_frames_left == 0 ? stack_sdu : NULL;
+        ll_count++;
+        sim_kframes++;
+
+        if (stack_frames_left == 0) {
+            stack_sdu = NULL;
+            if (stack_stalled) {
+                stack_stalled = false;
+                memset(&event, 0, sizeof event);
+                event.type = BLE_L2CAP_EVENT_COC_TX_UNSTALLED;
+                event.tx_unstalled.conn_handle = chan_tx.conn_handle;
+                event.tx_unstalled.chan = &chan_tx;
+                sim_emit(&chan_tx, &event);
+            }
+        }
+    }
+}
+
+int
+ble_l2cap_send(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_tx) {
+    int rc;
+
+    if (stack_sdu != NULL) {
+        return BLE_HS_EBUSY;
+    }
+
+    if (stack_fail_rc != 0) {
+        rc = stack_fail_rc;
+        stack_fail_rc = 0;
+        if (rc != BLE_HS_EBADDATA) {
+            os_mbuf_free_chain(sdu_tx);
+        }
+        return rc;
+    }
+
+    sim_sdus++;
+    stack_sdu = sdu_tx;
+    // The first K-frame also carries the SDU length.
+    stack_frames_left = (OS_MBUF_PKTLEN(sdu_tx) + 2 + SIM_MPS - 1) / SIM_MPS;
+    sim_stack_queue_frames();
+    if (stack_sdu != NULL) {
+        stack_stalled = true;
+        return BLE_HS_ESTALLED;
+    }
+    return 0;
+}
+
+/* The last K-frame of an SDU has gone over the air, the receiver gets the whole SDU in its buffer. */
+static void
+sim_deliver_sdu(struct os_mbuf *sdu) {
+    struct ble_l2cap_event event;
+    struct os_mbuf *sdu_rx;
+    uint16_t frames;
+
+    frames = (OS_MBUF_PKTLEN(sdu) + 2 + SIM_MPS - 1) / SIM_MPS;
+    sdu_rx = chan_rx.sdu_rx;
+    chan_rx.sdu_rx = NULL;
+    os_mbuf_append(sdu_rx, sdu->om_data, sdu->om_len);
+    os_mbuf_free_chain(sdu);
+
+    memset(&event, 0, sizeof event);
+    event.type = BLE_L2CAP_EVENT_COC_DATA_RECEIVED;
+    event.receive.conn_handle = chan_rx.conn_handle;
+    event.receive.chan = &chan_rx;
+    event.receive.sdu_rx = sdu_rx;
+    sim_emit(&chan_rx, &event);
+
+    credits_returning += frames;
+}
+
+int
+ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t data_len,
+                     ble_gatt_attr_fn *cb, void *cb_arg) {
+    if (gatt_pending) {
+        return BLE_HS_EBUSY;
+    }
+
+    gatt_pending = true;
+    memcpy(gatt_data, data, data_len);
+    gatt_len = data_len;
+    return 0;
+}
+
+/* Packets carry their sequence number in every byte so torn or reordered frames show up. */
+static void
+sim_receive(uint16_t conn_handle, uint8_t *packed_data, uint16_t packed_len) {
+    int i;
+
+    for (i = 0; i < packed_len; i++) {
+        if (packed_data[i] != (uint8_t) received) {
+            received_bad++;
+            break;
+        }
+    }
+    received++;
+}
+
+static void
+sim_done(uint16_t conn_handle, int status) {
+    done_count++;
+}
+
+static void
+sim_open_channel(struct mesh_peer *peer) {
+    struct ble_l2cap_event event;
+
+    memset(&chan_tx, 0, sizeof chan_tx);
+    memset(&chan_rx, 0, sizeof chan_rx);
+    stack_sdu = NULL;
+    stack_stalled = false;
+    ll_head = 0;
+    ll_count = 0;
+    credits_returning = 0;
+
+    mesh_coc_connect(peer);
+    chan_tx.credits = SIM_INITIAL_CREDITS;
+
+    chan_rx.cb = server_cb;
+    chan_rx.conn_handle = SIM_RECEIVER_HANDLE;
+    memset(&event, 0, sizeof event);
+    event.type = BLE_L2CAP_EVENT_COC_ACCEPT;
+    event.accept.conn_handle = SIM_RECEIVER_HANDLE;
+    event.accept.chan = &chan_rx;
+    sim_emit(&chan_rx, &event);
+
+    memset(&event, 0, sizeof event);
+    event.type = BLE_L2CAP_EVENT_COC_CONNECTED;
+    event.connect.conn_handle = SIM_SENDER_HANDLE;
+    event.connect.chan = &chan_tx;
+    sim_emit(&chan_tx, &event);
+}
+
+static void
+sim_close_channel() {
+    struct ble_l2cap_event event;
+
+    memset(&event, 0, sizeof event);
+    event.type = BLE_L2CAP_EVENT_COC_DISCONNECTED;
+    event.disconnect.conn_handle = SIM_SENDER_HANDLE;
+    event.disconnect.chan = &chan_tx;
+    sim_emit(&chan_tx, &event);
+
+    os_mbuf_free_chain(chan_tx.sdu_rx);
+    os_mbuf_free_chain(chan_rx.sdu_rx);
+    os_mbuf_free_chain(stack_sdu);
+    stack_sdu = NULL;
+}
+
+static void
+sim_reset(int per_event) {
+    pdus_per_event = per_event;
+    sim_sdus = 0;
+    sim_kframes = 0;
+    received = 0;
+    received_bad = 0;
+    done_count = 0;
+    gatt_pending = false;
+    host_clock_reset();
+}
+
+/**
+ * Runs connection events until the burst has arrived, offering the transport packets whenever it takes them.
+ *
+ * @return milliseconds until the last packet arrived.
+ */
+static int
+sim_burst(struct mesh_peer *peer, const struct mesh_transport *transport, uint16_t packed_len) {
+    uint8_t packed[DATA_PACKET_MAX_SIZE];
+    struct os_mbuf *sdu;
+    int offered = 0;
+    int sent;
+    int i;
+
+    while (received < SIM_BURST && host_clock_ms() < 60000) {
+        for (; offered < SIM_BURST; offered++) {
+            memset(packed, offered, packed_len);
+            if (transport->send(peer, packed, packed_len) != 0) {
+                break;
+            }
+        }
+
+        host_clock_advance_ms(SIM_ITVL_MS);
+
+        if (transport == &mesh_transport_gatt_write) {
+            if (gatt_pending) {
+                gatt_pending = false;
+                mesh_transport_received(SIM_RECEIVER_HANDLE, gatt_data, gatt_len);
+                mesh_transport_done(SIM_SENDER_HANDLE, 0);
+            }
+            continue;
+        }
+
+        for (sent = 0; sent < pdus_per_event && ll_count > 0; sent++) {
+            sdu = ll_fifo[ll_head];
+            ll_head = (ll_head + 1) % SIM_LL_FIFO_SIZE;
+            ll_count--;
+            if (sdu != NULL) {
+                sim_deliver_sdu(sdu);
+            }
+        }
+
+        // Credits the receiver handed back come in with the next event.
+        chan_tx.credits += credits_returning;
+        credits_returning = 0;
+        sim_stack_queue_frames();
+    }
+
+    for (i = 0; i < ll_count; i++) {
+        os_mbuf_free_chain(ll_fifo[(ll_head + i) % SIM_LL_FIFO_SIZE]);
+    }
+    ll_count = 0;
+    return received == SIM_BURST ? (int) host_clock_ms() : -1;
+}
+
+int
+main() {
+    static const ble_addr_t addr = {0, {1, 2, 3, 4, 5, 6}};
+    static const uint16_t packed_lens[] = {DATA_PACKET_MIN_SIZE, 24, DATA_PACKET_MAX_SIZE};
+    static const int pdus[] = {1, 4};
+    uint8_t packed[DATA_PACKET_MAX_SIZE];
+    struct mesh_peer *peer;
+    int gatt_ms, coc_ms;
+    int fail_rc;
+    int failures = 0;
+    int i, j;
+
+    mesh_transport_set_handlers(sim_receive, sim_done);
+    mesh_peer_init(2);
+    mesh_peer_add(SIM_SENDER_HANDLE, &addr);
+    peer = mesh_peer_find(SIM_SENDER_HANDLE);
+    peer->role = MESH_PEER_ROLE_NODE;
+    peer->mtu = 247;
+    mesh_coc_init();
+
+    printf("burst of %d packets, %d ms interval, %d initial credits\n", SIM_BURST, SIM_ITVL_MS, SIM_INITIAL_CREDITS);
+    printf("%4s %8s | %8s | %8s %5s %7s | %s\n", "len", "pdu/evt", "gatt ms", "coc ms", "sdus", "kframes", "speedup");
+
+    for (i = 0; i < sizeof packed_lens / sizeof packed_lens[0]; i++) {
+        for (j = 0; j < sizeof pdus / sizeof pdus[0]; j++) {
+            sim_reset(pdus[j]);
+            gatt_ms = sim_burst(peer, &mesh_transport_gatt_write, packed_lens[i]);
+            if (done_count != SIM_BURST || received_bad != 0) {
+                gatt_ms = -1;
+            }
+
+            sim_reset(pdus[j]);
+            sim_open_channel(peer);
+            coc_ms = sim_burst(peer, &mesh_transport_coc, packed_lens[i]);
+            if (received_bad != 0 || peer->coc_stalled || peer->coc_tx_queue != NULL) {
+                coc_ms = -1;
+            }
+            sim_close_channel();
+
+            printf("%4d %8d | %8d | %8d %5d %7d | %5.1fx\n", packed_lens[i], pdus[j], gatt_ms, coc_ms, sim_sdus,
+                   sim_kframes, coc_ms > 0 ? (double) gatt_ms / coc_ms : 0);
+
+            // Every packet has to arrive intact and in order, and the channel has to beat one write per interval.
+            if (gatt_ms < 0 || coc_ms < 0 || coc_ms >= gatt_ms) {
+                printf("FAIL\n");
+                failures++;
+            }
+        }
+    }
+
+    // A packet in an SDU the stack fails is reported back so it can go over GATT instead, and nothing is left queued.
+    sim_reset(1);
+    sim_open_channel(peer);
+    memset(packed, 0, sizeof packed);
+    for (i = 0; i < 2; i++) {
+        fail_rc = i == 0 ? BLE_HS_EBADDATA : BLE_HS_ENOMEM;
+        stack_fail_rc = fail_rc;
+        if (mesh_transport_coc.send(peer, packed, DATA_PACKET_MIN_SIZE) != fail_rc || peer->coc_tx_queue != NULL) {
+            printf("FAIL: send error %d\n", fail_rc);
+            failures++;
+        }
+    }
+    sim_close_channel();
+
+    return failures != 0;
+}
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+#include "host/ble_hs.h"
+#include "mesh_peer.h"
+#include "mesh_sensor_constants.h"
+#include "host_clock.h"
+
+/*
+ * Connect to ready latency of a new link with full discovery (mesh_peer_disc_all) against discovery of the mesh
+ * service only (mesh_peer_disc_mesh_svc). The peer is a GATT server with the attribute table of a node or the hub,
+ * every ATT request costs a connection interval for its response, and a response carries as many entries as fit in
+ * the MTU, the way the ATT discovery procedures pack them for 16 bit UUIDs.
+ */
+
+#define SIM_CONN_HANDLE 1
+
+#define SIM_ATTR_SVC 0
+#define SIM_ATTR_CHR 1
+#define SIM_ATTR_VAL 2
+#define SIM_ATTR_DSC 3
+
+struct sim_attr {
+    uint16_t handle;
+    uint8_t type;
+    uint16_t uuid;
+    uint16_t end_handle;
+    uint8_t properties;
+};
+
+/* GAP and GATT services as NimBLE registers them, followed by the mesh service. The last service ends at 0xffff. */
+static const struct sim_attr node_attrs[] = {
+        {1, SIM_ATTR_SVC, 0x1800, 5},
+        {2, SIM_ATTR_CHR, 0x2a00, 0, 0x02},
+        {3, SIM_ATTR_VAL, 0x2a00},
+        {4, SIM_ATTR_CHR, 0x2a01, 0, 0x02},
+        {5, SIM_ATTR_VAL, 0x2a01},
+        {6, SIM_ATTR_SVC, 0x1801, 9},
+        {7, SIM_ATTR_CHR, 0x2a05, 0, 0x20},
+        {8, SIM_ATTR_VAL, 0x2a05},
+        {9, SIM_ATTR_DSC, 0x2902},
+        {10, SIM_ATTR_SVC, GATT_SVR_SVC_DATA_UUID, 0xffff},
+        {11, SIM_ATTR_CHR, GATT_CHR_W_DATA_UUID, 0, 0x08},
+        {12, SIM_ATTR_VAL, GATT_CHR_W_DATA_UUID},
+        {13, SIM_ATTR_CHR, GATT_CHR_R_DATA_UUID, 0, 0x10},
+        {14, SIM_ATTR_VAL, GATT_CHR_R_DATA_UUID},
+        {15, SIM_ATTR_DSC, 0x2902},
+};
+
+/* The hub's services, without a mesh service. */
+static const struct sim_attr hub_attrs[] = {
+        {1, SIM_ATTR_SVC, 0x1800, 5},
+        {2, SIM_ATTR_CHR, 0x2a00, 0, 0x02},
+        {3, SIM_ATTR_VAL, 0x2a00},
+        {4, SIM_ATTR_CHR, 0x2a01, 0, 0x02},
+        {5, SIM_ATTR_VAL, 0x2a01},
+        {6, SIM_ATTR_SVC, 0x1801, 9},
+        {7, SIM_ATTR_CHR, 0x2a05, 0, 0x20},
+        {8, SIM_ATTR_VAL, 0x2a05},
+        {9, SIM_ATTR_DSC, 0x2902},
+        {10, SIM_ATTR_SVC, 0x180a, 0xffff},
+        {11, SIM_ATTR_CHR, 0x2a29, 0, 0x02},
+        {12, SIM_ATTR_VAL, 0x2a29},
+        {13, SIM_ATTR_CHR, 0x2a24, 0, 0x02},
+        {14, SIM_ATTR_VAL, 0x2a24},
+};
+
+#define SIM_PROC_NONE 0
+#define SIM_PROC_SVCS 1
+#define SIM_PROC_SVC_BY_UUID 2
+#define SIM_PROC_CHRS 3
+#define SIM_PROC_DSCS 4
+
+/* The one procedure in progress, GATT runs them one at a time on a connection. */
+struct sim_proc {
+    uint8_t type;
+    uint16_t start_handle;
+    uint16_t end_handle;
+    uint16_t uuid;
+    ble_gatt_disc_svc_fn *svc_cb;
+    ble_gatt_chr_fn *chr_cb;
+    ble_gatt_dsc_fn *dsc_cb;
+    void *cb_arg;
+};
+
+static struct sim_proc sim_proc;
+
+static const struct sim_attr *server_attrs;
+static int server_attr_count;
+static uint16_t sim_mtu;
+static uint32_t sim_itvl_ms;
+static int sim_requests;
+static bool sim_ready;
+static int sim_ready_status;
+
+static void
+sim_round_trip() {
+    sim_requests++;
+    host_clock_advance_ms(sim_itvl_ms);
+}
+
+static void
+sim_uuid16(ble_uuid_any_t *out, uint16_t value) {
+    memset(out, 0, sizeof *out);
+    out->u16.u.type = BLE_UUID_TYPE_16;
+    out->u16.value = value;
+}
+
+static int
+sim_proc_start(uint8_t type, uint16_t start_handle, uint16_t end_handle, void *cb_arg) {
+    if (sim_proc.type != SIM_PROC_NONE) {
+        return BLE_HS_EBUSY;
+    }
+
+    memset(&sim_proc, 0, sizeof sim_proc);
+    sim_proc.type = type;
+    sim_proc.start_handle = start_handle;
+    sim_proc.end_handle = end_handle;
+    sim_proc.cb_arg = cb_arg;
+    return 0;
+}
+
+int
+ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn *cb, void *cb_arg) {
+    struct ble_gatt_error error = {0};
+
+    sim_round_trip();
+    cb(conn_handle, &error, sim_mtu, cb_arg);
+    return 0;
+}
+
+int
+ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time) {
+    return 0;
+}
+
+int
+ble_gattc_disc_all_svcs(uint16_t conn_handle, ble_gatt_disc_svc_fn *cb, void *cb_arg) {
+    int rc;
+
+    rc = sim_proc_start(SIM_PROC_SVCS, 1, 0xffff, cb_arg);
+    sim_proc.svc_cb = cb;
+    return rc;
+}
+
+int
+ble_gattc_disc_svc_by_uuid(uint16_t conn_handle, const ble_uuid_t *uuid, ble_gatt_disc_svc_fn *cb, void *cb_arg) {
+    int rc;
+
+    rc = sim_proc_start(SIM_PROC_SVC_BY_UUID, 1, 0xffff, cb_arg);
+    sim_proc.uuid = ((const ble_uuid16_t *) uuid)->value;
+    sim_proc.svc_cb = cb;
+    return rc;
+}
+
+int
+ble_gattc_disc_all_chrs(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle,
+                        ble_gatt_chr_fn *cb, void *cb_arg) {
+    int rc;
+
+    rc = sim_proc_start(SIM_PROC_CHRS, start_handle, end_handle, cb_arg);
+    sim_proc.chr_cb = cb;
+    return rc;
+}
+
+int
+ble_gattc_disc_all_dscs(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle,
+                        ble_gatt_dsc_fn *cb, void *cb_arg) {
+    int rc;
+
+    rc = sim_proc_start(SIM_PROC_DSCS, start_handle + 1, end_handle, cb_arg);
+    // The characteristic value handle goes back with every descriptor.
+    sim_proc.dsc_cb = cb;
+    sim_proc.uuid = start_handle;
+    return rc;
+}
+
+static bool
+sim_attr_matches(const struct sim_attr *attr, uint8_t proc_type, uint16_t uuid) {
+    switch (proc_type) {
+        case SIM_PROC_SVCS:
+            return attr->type == SIM_ATTR_SVC;
+        case SIM_PROC_SVC_BY_UUID:
+            return attr->type == SIM_ATTR_SVC && attr->uuid == uuid;
+        case SIM_PROC_CHRS:
+            return attr->type == SIM_ATTR_CHR;
+        default:
+            return true;
+    }
+}
+
+/* Entries of one response: Read By Group Type, Find By Type Value, Read By Type and Find Information. */
+static int
+sim_entries_per_rsp(uint8_t proc_type) {
+    switch (proc_type) {
+        case SIM_PROC_SVCS:
+            return (sim_mtu - 2) / 6;
+        case SIM_PROC_SVC_BY_UUID:
+            return (sim_mtu - 1) / 4;
+        case SIM_PROC_CHRS:
+            return (sim_mtu - 2) / 7;
+        default:
+            return (sim_mtu - 2) / 4;
+    }
+}
+
+static void
+sim_report(const struct sim_attr *attr) {
+    struct ble_gatt_error error = {0};
+    struct ble_gatt_svc svc;
+    struct ble_gatt_chr chr;
+    struct ble_gatt_dsc dsc;
+
+    switch (sim_proc.type) {
+        case SIM_PROC_SVCS:
+        case SIM_PROC_SVC_BY_UUID:
+            svc.start_handle = attr->handle;
+            svc.end_handle = attr->end_handle;
+            sim_uuid16(&svc.uuid, attr->uuid);
+            sim_proc.svc_cb(SIM_CONN_HANDLE, &error, &svc, sim_proc.cb_arg);
+            break;
+        case SIM_PROC_CHRS:
+            chr.def_handle = attr->handle;
+            chr.val_handle = attr->handle + 1;
+            chr.properties = attr->properties;
+            sim_uuid16(&chr.uuid, attr->uuid);
+            sim_proc.chr_cb(SIM_CONN_HANDLE, &error, &chr, sim_proc.cb_arg);
+            break;
+        default:
+            dsc.handle = attr->handle;
+            sim_uuid16(&dsc.uuid, attr->uuid);
+            sim_proc.dsc_cb(SIM_CONN_HANDLE, &error, sim_proc.uuid, &dsc, sim_proc.cb_arg);
+            break;
+    }
+}
+
+/* Reports the procedure done, after which the callback is free to start the next one. */
+static void
+sim_done() {
+    struct ble_gatt_error error = {BLE_HS_EDONE, 0};
+    struct sim_proc done;
+
+    done = sim_proc;
+    sim_proc.type = SIM_PROC_NONE;
+
+    switch (done.type) {
+        case SIM_PROC_SVCS:
+        case SIM_PROC_SVC_BY_UUID:
+            done.svc_cb(SIM_CONN_HANDLE, &error, NULL, done.cb_arg);
+            break;
+        case SIM_PROC_CHRS:
+            done.chr_cb(SIM_CONN_HANDLE, &error, NULL, done.cb_arg);
+            break;
+        default:
+            done.dsc_cb(SIM_CONN_HANDLE, &error, done.uuid, NULL, done.cb_arg);
+            break;
+    }
+}
+
+/**
+ * Runs the procedure in progress request by request until the server runs out of attributes in its range, then
+ * reports it done, which is where peer discovery starts its next procedure.
+ */
+static void
+sim_run_proc() {
+    const struct sim_attr *attr;
+    uint16_t cursor;
+    uint16_t last_end;
+    int found;
+    int i;
+
+    cursor = sim_proc.start_handle;
+    for (;;) {
+        sim_round_trip();
+
+        found = 0;
+        last_end = 0;
+        for (i = 0; i < server_attr_count && found < sim_entries_per_rsp(sim_proc.type); i++) {
+            attr = &server_attrs[i];
+            if (attr->handle < cursor || attr->handle > sim_proc.end_handle ||
+                !sim_attr_matches(attr, sim_proc.type, sim_proc.uuid)) {
+                continue;
+            }
+            sim_report(attr);
+            found++;
+            last_end = attr->type == SIM_ATTR_SVC ? attr->end_handle : attr->handle;
+        }
+
+        // Attribute not found, or the response reached the end of the range, ends the procedure.
+        if (found == 0 || last_end >= sim_proc.end_handle) {
+            break;
+        }
+        cursor = last_end + 1;
+    }
+
+    sim_done();
+}
+
+static void
+sim_disc_done(const struct mesh_peer *peer, int status, void *arg) {
+    sim_ready = true;
+    sim_ready_status = status;
+}
+
+/**
+ * Connects to a server with the attributes, negotiates the link and discovers it.
+ *
+ * @return milliseconds from connection to the peer being ready to take packets, -1 if discovery failed.
+ */
+static int
+sim_connect(const struct sim_attr *attrs, int attr_count, bool targeted, uint8_t *out_role) {
+    static const ble_addr_t addr = {0, {1, 2, 3, 4, 5, 6}};
+    struct mesh_peer *peer;
+    int rc;
+
+    server_attrs = attrs;
+    server_attr_count = attr_count;
+    sim_proc.type = SIM_PROC_NONE;
+    sim_ready = false;
+    sim_requests = 0;
+    host_clock_reset();
+
+    mesh_peer_init(1);
+    mesh_peer_add(SIM_CONN_HANDLE, &addr);
+    mesh_peer_negotiate_link(SIM_CONN_HANDLE);
+
+    if (targeted) {
+        rc = mesh_peer_disc_mesh_svc(SIM_CONN_HANDLE, sim_disc_done, NULL);
+    } else {
+        rc = mesh_peer_disc_all(SIM_CONN_HANDLE, sim_disc_done, NULL);
+    }
+    if (rc != 0) {
+        return -1;
+    }
+
+    while (sim_proc.type != SIM_PROC_NONE) {
+        sim_run_proc();
+    }
+
+    peer = mesh_peer_find(SIM_CONN_HANDLE);
+    *out_role = peer->role;
+    if (!sim_ready || sim_ready_status != 0) {
+        return -1;
+    }
+    return (int) host_clock_ms();
+}
+
+int
+main() {
+    static const uint16_t mtus[] = {BLE_ATT_MTU_DFLT, 247};
+    static const uint32_t itvls_ms[] = {15, 50};
+    int full_ms, full_requests;
+    int targeted_ms, targeted_requests;
+    uint8_t full_role, targeted_role;
+    int failures = 0;
+    int server;
+    int i, j;
+
+    printf("%-5s %4s %5s | %13s %13s | %s\n", "peer", "mtu", "itvl", "full ms (req)", "mesh ms (req)", "saved");
+
+    for (server = 0; server < 2; server++) {
+        for (i = 0; i < sizeof mtus / sizeof mtus[0]; i++) {
+            for (j = 0; j < sizeof itvls_ms / sizeof itvls_ms[0]; j++) {
+                sim_mtu = mtus[i];
+                sim_itvl_ms = itvls_ms[j];
+
+                if (server == 0) {
+                    full_ms = sim_connect(node_attrs, sizeof node_attrs / sizeof node_attrs[0], false, &full_role);
+                    full_requests = sim_requests;
+                    targeted_ms = sim_connect(node_attrs, sizeof node_attrs / sizeof node_attrs[0], true,
+                                              &targeted_role);
+                } else {
+                    full_ms = sim_connect(hub_attrs, sizeof hub_attrs / sizeof hub_attrs[0], false, &full_role);
+                    full_requests = sim_requests;
+                    targeted_ms = sim_connect(hub_attrs, sizeof hub_attrs / sizeof hub_attrs[0], true,
+                                              &targeted_role);
+                }
+                targeted_requests = sim_requests;
+
+                printf("%-5s %4d %5d | %7d (%3d) %7d (%3d) | %3d%%\n", server == 0 ? "node" : "hub", sim_mtu,
+                       sim_itvl_ms, full_ms, full_requests, targeted_ms, targeted_requests,
+                       full_ms > 0 ? 100 - 100 * targeted_ms / full_ms : 0);
+
+                // Both have to tell a node from the hub, and the targeted one has to get there sooner.
+                if (full_ms < 0 || targeted_ms < 0 || full_role != targeted_role ||
+                    full_role != (server == 0 ? MESH_PEER_ROLE_NODE : MESH_PEER_ROLE_HUB) ||
+                    targeted_ms >= full_ms) {
+                    printf("FAIL\n");
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "mesh_rendezvous.h"
+#include "host_clock.h"
+
+/*
+ * Time until two neighbors that wake together first get to connect: one has to advertise while the other scans for
+ * long enough to see an advertisement and answer it. Compared are the rendezvous schedule with distinct seeds, with
+ * equal seeds with and without the random phase each wake starts at, and a schedule that draws each slot at random.
+ */
+
+#define SIM_TRIALS 2000
+#define SIM_STEP_MS 10
+
+/* Overlap of one advertising and the other scanning that it takes to get a connection going. */
+#define SIM_MEET_MS 100
+
+/* Wakes aligned on mesh time still start a little apart. */
+#define SIM_WAKE_JITTER_MS 50
+
+/* Give up after this many frames. */
+#define SIM_MAX_FRAMES 10
+#define SIM_MAX_MS (SIM_MAX_FRAMES * RENDEZVOUS_FRAME_MS)
+
+#define SIM_SCHEME_RANDOM 0
+#define SIM_SCHEME_RENDEZVOUS 1
+
+struct sim_node {
+    uint8_t seed;
+    uint32_t phase_ms;
+    uint32_t wake_ms;
+
+    /* Random scheme: the role of every slot, drawn up front. */
+    bool random_adv[SIM_MAX_MS / RENDEZVOUS_SLOT_MS + 1];
+};
+
+static int sim_scheme;
+
+/* Whether the node advertises at the time, counted from the earlier of the two wakes. */
+static bool
+sim_adv(const struct sim_node *node, uint32_t t_ms) {
+    uint32_t duration_ms;
+
+    if (t_ms < node->wake_ms) {
+        return false;
+    }
+
+    if (sim_scheme == SIM_SCHEME_RANDOM) {
+        return node->random_adv[(t_ms - node->wake_ms) / RENDEZVOUS_SLOT_MS];
+    }
+
+    // The schedule only keeps a seed and a start time, so it can be replayed for each node in turn.
+    host_clock_reset();
+    mesh_rendezvous_start(node->seed, node->phase_ms);
+    host_clock_advance_ms(t_ms - node->wake_ms);
+    return mesh_rendezvous_next(&duration_ms);
+}
+
+/**
+ * @return milliseconds from the first wake until the pair could connect, -1 if it never got the chance.
+ */
+static int
+sim_time_to_meet(const struct sim_node *a, const struct sim_node *b) {
+    uint32_t overlap_ms = 0;
+    uint32_t t_ms;
+    bool a_adv, b_adv;
+
+    for (t_ms = 0; t_ms < SIM_MAX_MS; t_ms += SIM_STEP_MS) {
+        a_adv = sim_adv(a, t_ms);
+        b_adv = sim_adv(b, t_ms);
+
+        // Both have to be awake, and exactly one of them advertising.
+        if (t_ms >= a->wake_ms && t_ms >= b->wake_ms && a_adv != b_adv) {
+            overlap_ms += SIM_STEP_MS;
+            if (overlap_ms >= SIM_MEET_MS) {
+                return (int) t_ms + SIM_STEP_MS;
+            }
+        } else {
+            overlap_ms = 0;
+        }
+    }
+
+    return -1;
+}
+
+static void
+sim_node_init(struct sim_node *node, uint8_t seed, bool random_phase) {
+    int i;
+
+    node->seed = seed;
+    node->phase_ms = random_phase ? (uint32_t) rand() : 0;
+    node->wake_ms = rand() % SIM_WAKE_JITTER_MS;
+    for (i = 0; i < sizeof node->random_adv; i++) {
+        node->random_adv[i] = rand() & 1;
+    }
+}
+
+struct sim_result {
+    int met;
+    int mean_ms;
+    int p95_ms;
+    int max_ms;
+};
+
+static int
+sim_cmp_int(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+static struct sim_result
+sim_run(const char *name, int scheme, bool equal_seeds, bool random_phase) {
+    static int times[SIM_TRIALS];
+    struct sim_node a, b;
+    struct sim_result result = {0};
+    long total_ms = 0;
+    int trial;
+    int t;
+
+    sim_scheme = scheme;
+    srand(1);
+    for (trial = 0; trial < SIM_TRIALS; trial++) {
+        sim_node_init(&a, rand() & 0xff, random_phase);
+        sim_node_init(&b, equal_seeds ? a.seed : (a.seed + 1 + rand() % 255) & 0xff, random_phase);
+
+        t = sim_time_to_meet(&a, &b);
+        if (t >= 0) {
+            times[result.met++] = t;
+            total_ms += t;
+        }
+    }
+
+    if (result.met > 0) {
+        qsort(times, result.met, sizeof times[0], sim_cmp_int);
+        result.mean_ms = (int) (total_ms / result.met);
+        result.p95_ms = times[result.met * 95 / 100];
+        result.max_ms = times[result.met - 1];
+    }
+
+    printf("%-32s | %5.1f%% | %6d %6d %6d\n", name, 100.0 * result.met / SIM_TRIALS, result.mean_ms,
+           result.p95_ms, result.max_ms);
+    return result;
+}
+
+int
+main() {
+    struct sim_result distinct, equal_lockstep, equal_phased;
+    int failures = 0;
+
+    printf("%d ms frame, pairs waking within %d ms, %d trials\n", RENDEZVOUS_FRAME_MS, SIM_WAKE_JITTER_MS, SIM_TRIALS);
+    printf("%-32s | %6s | %6s %6s %6s\n", "schedule", "met", "mean", "p95", "max ms");
+
+    distinct = sim_run("rendezvous, distinct seeds", SIM_SCHEME_RENDEZVOUS, false, true);
+    equal_lockstep = sim_run("rendezvous, equal, no phase", SIM_SCHEME_RENDEZVOUS, true, false);
+    equal_phased = sim_run("rendezvous, equal, random phase", SIM_SCHEME_RENDEZVOUS, true, true);
+    sim_run("random slots", SIM_SCHEME_RANDOM, false, false);
+
+    // Distinct seeds always meet within a frame. Equal seeds meet with the random phase, nearly always and about as
+    // fast as distinct ones, where they never did without it. Random slots are there for reference, they get about
+    // as far on average but nothing bounds how long a pair can miss each other.
+    if (distinct.met != SIM_TRIALS || distinct.max_ms > RENDEZVOUS_FRAME_MS + SIM_WAKE_JITTER_MS + SIM_MEET_MS) {
+        printf("FAIL: distinct seeds\n");
+        failures++;
+    }
+    if (equal_phased.met < SIM_TRIALS * 95 / 100 || equal_phased.met <= equal_lockstep.met) {
+        printf("FAIL: equal seeds\n");
+        failures++;
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "host/ble_hs.h"
+#include "mesh_rendezvous.h"
+#include "mesh_scan.h"
+#include "host_clock.h"
+
+/*
+ * Discovery latency against scan radio-on time for a node searching for a parent. The parent shows up at a random
+ * point of the search and advertises through the advertise slots of its own rendezvous schedule. Three ways of
+ * backing off are compared: none, the window thinned out inside every scan slot the way the search used to back
+ * off, and runs of scan slots left out the way mesh_scan_slots_active does it.
+ */
+
+#define SIM_TRIALS 300
+#define SIM_STEP_MS 10
+#define SIM_MAX_MS 120000
+
+/* The parent appears this long into the search at the latest. */
+#define SIM_APPEAR_MAX_MS 30000
+
+/* Listening through one advertising interval catches an advertisement. */
+#define SIM_MEET_MS (SCAN_ADV_ITVL_MAX * 625 / 1000)
+
+/* Floor the thinned out window used to back off to, one window every eight. */
+#define SIM_THIN_MAX_BACKOFF 3
+
+#define SIM_POLICY_NONE 0
+#define SIM_POLICY_THIN_WINDOW 1
+#define SIM_POLICY_SKIP_SLOTS 2
+
+struct sim_node {
+    uint8_t seed;
+    uint32_t phase_ms;
+};
+
+struct sim_result {
+    int met;
+    int mean_ms;
+    int p95_ms;
+    int max_ms;
+    int duty_pct;
+};
+
+/* Whether the node's schedule has it advertising t_ms into the search. */
+static bool
+sim_adv(const struct sim_node *node, uint32_t t_ms) {
+    uint32_t duration_ms;
+
+    mesh_rendezvous_start(node->seed, node->phase_ms + t_ms);
+    return mesh_rendezvous_next(&duration_ms);
+}
+
+/* The backoff of the old window thinning, which doubled the scan interval every step. */
+static uint32_t
+sim_thin_itvl_ms(uint32_t t_ms) {
+    int backoff;
+
+    backoff = t_ms / SCAN_SEARCH_BACKOFF_STEP_MS;
+    if (backoff > SIM_THIN_MAX_BACKOFF) {
+        backoff = SIM_THIN_MAX_BACKOFF;
+    }
+    return (SCAN_WINDOW << backoff) * 625 / 1000;
+}
+
+/**
+ * Runs the search until the searching node has listened through an advertising interval of the parent.
+ *
+ * @return milliseconds from the parent showing up until then, -1 if it never happened. Adds the time the searching
+ *         node's radio was on for scanning to scan_ms and the time it searched to search_ms.
+ */
+static int
+sim_search(int policy, const struct sim_node *child, const struct sim_node *parent, uint32_t appear_ms,
+           long *scan_ms, long *search_ms) {
+    struct ble_gap_disc_params disc_params;
+    uint32_t window_ms = SCAN_WINDOW * 625 / 1000;
+    uint32_t run_started_at = 0;
+    uint32_t overlap_ms = 0;
+    uint32_t itvl_ms = 0;
+    uint32_t t_ms;
+    bool scanning = false;
+    bool listening;
+    bool was_scan = false;
+    bool scan_slot;
+
+    // A new search starts with the first scan parameters we ask for.
+    host_clock_reset();
+    mesh_scan_fill_params(&disc_params, false, false);
+    mesh_scan_fill_params(&disc_params, true, false);
+
+    for (t_ms = 0; t_ms < SIM_MAX_MS; t_ms += SIM_STEP_MS, host_clock_advance_ms(SIM_STEP_MS)) {
+        scan_slot = !sim_adv(child, t_ms);
+
+        // A scan is started for each run of scan slots, and the policy decides then.
+        if (scan_slot && !was_scan) {
+            run_started_at = t_ms;
+            itvl_ms = sim_thin_itvl_ms(t_ms);
+            scanning = policy != SIM_POLICY_SKIP_SLOTS || mesh_scan_slots_active(true, rand());
+        }
+        was_scan = scan_slot;
+
+        listening = scan_slot && scanning;
+        if (listening && policy == SIM_POLICY_THIN_WINDOW) {
+            listening = (t_ms - run_started_at) % itvl_ms < window_ms;
+        }
+        if (listening) {
+            *scan_ms += SIM_STEP_MS;
+        }
+
+        if (listening && t_ms >= appear_ms && sim_adv(parent, t_ms - appear_ms)) {
+            overlap_ms += SIM_STEP_MS;
+            if (overlap_ms >= SIM_MEET_MS) {
+                *search_ms += t_ms + SIM_STEP_MS;
+                return (int) (t_ms + SIM_STEP_MS - appear_ms);
+            }
+        } else {
+            overlap_ms = 0;
+        }
+    }
+
+    *search_ms += SIM_MAX_MS;
+    return -1;
+}
+
+static int
+sim_cmp_int(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+static struct sim_result
+sim_run(const char *name, int policy) {
+    static int times[SIM_TRIALS];
+    struct sim_result result = {0};
+    struct sim_node child, parent;
+    long scan_ms = 0;
+    long search_ms = 0;
+    long total_ms = 0;
+    uint32_t appear_ms;
+    int trial;
+    int t;
+
+    srand(1);
+    for (trial = 0; trial < SIM_TRIALS; trial++) {
+        child.seed = rand() & 0xff;
+        child.phase_ms = rand();
+        parent.seed = (child.seed + 1 + rand() % 255) & 0xff;
+        parent.phase_ms = rand();
+        appear_ms = rand() % SIM_APPEAR_MAX_MS;
+
+        t = sim_search(policy, &child, &parent, appear_ms, &scan_ms, &search_ms);
+        if (t >= 0) {
+            times[result.met++] = t;
+            total_ms += t;
+        }
+    }
+
+    if (result.met > 0) {
+        qsort(times, result.met, sizeof times[0], sim_cmp_int);
+        result.mean_ms = (int) (total_ms / result.met);
+        result.p95_ms = times[result.met * 95 / 100];
+        result.max_ms = times[result.met - 1];
+    }
+    result.duty_pct = (int) (100 * scan_ms / search_ms);
+
+    printf("%-14s | %5.1f%% | %6d %6d %6d | %3d%%\n", name, 100.0 * result.met / SIM_TRIALS, result.mean_ms,
+           result.p95_ms, result.max_ms, result.duty_pct);
+    return result;
+}
+
+int
+main() {
+    struct sim_result none, thin, skip;
+    int failures = 0;
+
+    printf("parent appears within %d s of the search, %d trials\n", SIM_APPEAR_MAX_MS / 1000, SIM_TRIALS);
+    printf("%-14s | %6s | %6s %6s %6s | %s\n", "backoff", "found", "mean", "p95", "max ms", "scan duty");
+
+    none = sim_run("none", SIM_POLICY_NONE);
+    thin = sim_run("thin window", SIM_POLICY_THIN_WINDOW);
+    skip = sim_run("skip slots", SIM_POLICY_SKIP_SLOTS);
+
+    // Leaving out scan slots finds every parent and still saves radio time over not backing off. The thinned window
+    // keeps its windows at the same place in each run and leaves some parents unfound. It gets by on less radio
+    // time because a window only has to land in one of the parent's advertise slots, not cover it.
+    if (skip.met != SIM_TRIALS || skip.duty_pct >= none.duty_pct) {
+        printf("FAIL: leaving out scan slots\n");
+        failures++;
+    }
+    if (thin.met > skip.met) {
+        printf("FAIL: thinning the window found more parents\n");
+        failures++;
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "mesh_rendezvous.h"
+#include "mesh_time.h"
+#include "host_clock.h"
+
+/*
+ * Radio-on time per node for a mesh waking on the mesh time schedule, with and without the per hop stagger of the
+ * wake. Nodes sit in layers below the hub, each with a parent in the layer above. A node has its radio on from its
+ * wake until the mesh goes back to sleep. It joins once its parent has joined and their rendezvous schedules have
+ * one advertising while the other scans long enough to connect. The mesh sleeps a little after the last node joined,
+ * or when the awake budget runs out.
+ */
+
+#define SIM_TRIALS 200
+#define SIM_STEP_MS 10
+
+#define SIM_LAYERS MESH_TIME_STAGGER_MAX_HOPS
+#define SIM_LAYER_NODES 4
+#define SIM_NODES (SIM_LAYERS * SIM_LAYER_NODES)
+
+/* Overlap of one advertising and the other scanning that it takes to get a connection going. */
+#define SIM_MEET_MS 100
+
+/* Wakes aligned on mesh time still start a little apart. */
+#define SIM_WAKE_JITTER_MS 50
+
+/* From the last node joining until readings reached the hub and the go to sleep command came back. */
+#define SIM_SETTLE_MS 1000
+
+/* SYNCED_MAX_TIME_AWAKE_IN_MS in mesh_main.c. */
+#define SIM_MAX_AWAKE_MS 20000
+
+#define SIM_PERIOD_MS 60000
+#define SIM_BASE_MS 30000
+
+struct sim_node {
+    int parent;
+    uint8_t hop_depth;
+    uint8_t seed;
+    uint32_t phase_ms;
+    uint32_t wake_ms;
+    int32_t joined_ms;
+};
+
+struct sim_result {
+    int joined;
+    int formed_ms;
+    int radio_on_ms;
+    int leaf_radio_on_ms;
+};
+
+static struct sim_node nodes[SIM_NODES];
+
+/**
+ * @return milliseconds after the scheduled base the node wakes, as mesh_time plans it.
+ */
+static uint32_t
+sim_wake_ms(uint8_t hop_depth, uint16_t hop_offset_ms) {
+    host_clock_reset();
+    mesh_time_sync(0);
+    mesh_time_set_wake_schedule(SIM_BASE_MS, hop_offset_ms);
+    return (uint32_t) (mesh_time_sleep_us_until_wake(SIM_PERIOD_MS, hop_depth) / 1000) - SIM_BASE_MS;
+}
+
+static bool
+sim_adv(const struct sim_node *node, uint32_t t_ms) {
+    uint32_t duration_ms;
+
+    mesh_rendezvous_start(node->seed, node->phase_ms + t_ms - node->wake_ms);
+    return mesh_rendezvous_next(&duration_ms);
+}
+
+/**
+ * @return when the node joins its parent, -1 if it doesn't before either of them goes back to sleep.
+ */
+static int32_t
+sim_join(const struct sim_node *node) {
+    const struct sim_node *parent = node->parent >= 0 ? &nodes[node->parent] : NULL;
+    uint32_t overlap_ms = 0;
+    uint32_t start_ms;
+    uint32_t end_ms;
+    uint32_t t_ms;
+
+    // The hub is always up and listening for its children.
+    if (parent == NULL) {
+        return (int32_t) (node->wake_ms + SIM_MEET_MS);
+    }
+    if (parent->joined_ms < 0) {
+        return -1;
+    }
+
+    start_ms = node->wake_ms > parent->joined_ms ? node->wake_ms : parent->joined_ms;
+    end_ms = node->wake_ms + SIM_MAX_AWAKE_MS;
+    if (end_ms > parent->wake_ms + SIM_MAX_AWAKE_MS) {
+        end_ms = parent->wake_ms + SIM_MAX_AWAKE_MS;
+    }
+
+    for (t_ms = start_ms; t_ms < end_ms; t_ms += SIM_STEP_MS) {
+        if (sim_adv(node, t_ms) != sim_adv(parent, t_ms)) {
+            overlap_ms += SIM_STEP_MS;
+            if (overlap_ms >= SIM_MEET_MS) {
+                return (int32_t) (t_ms + SIM_STEP_MS);
+            }
+        } else {
+            overlap_ms = 0;
+        }
+    }
+
+    return -1;
+}
+
+static struct sim_result
+sim_run(uint16_t hop_offset_ms) {
+    struct sim_result result = {0};
+    struct sim_node *node;
+    long radio_on_ms = 0;
+    long leaf_radio_on_ms = 0;
+    uint32_t on_ms;
+    uint32_t sleep_ms;
+    int32_t formed_ms = 0;
+    long total_formed_ms = 0;
+    int trial;
+    int i;
+
+    srand(1);
+    for (trial = 0; trial < SIM_TRIALS; trial++) {
+        // Layers are in order, so every parent has its join worked out before its children.
+        for (i = 0; i < SIM_NODES; i++) {
+            node = &nodes[i];
+            node->hop_depth = i / SIM_LAYER_NODES + 1;
+            node->parent = node->hop_depth == 1 ? -1
+                                                : (node->hop_depth - 2) * SIM_LAYER_NODES + rand() % SIM_LAYER_NODES;
+            node->seed = rand() & 0xff;
+            node->phase_ms = rand();
+            node->wake_ms = sim_wake_ms(node->hop_depth, hop_offset_ms) + rand() % SIM_WAKE_JITTER_MS;
+        }
+
+        formed_ms = 0;
+        for (i = 0; i < SIM_NODES; i++) {
+            node = &nodes[i];
+            node->joined_ms = sim_join(node);
+            if (node->joined_ms >= 0) {
+                result.joined++;
+                if (node->joined_ms > formed_ms) {
+                    formed_ms = node->joined_ms;
+                }
+            }
+        }
+        total_formed_ms += formed_ms;
+
+        for (i = 0; i < SIM_NODES; i++) {
+            node = &nodes[i];
+            sleep_ms = formed_ms + SIM_SETTLE_MS;
+            if (node->joined_ms < 0 || sleep_ms > node->wake_ms + SIM_MAX_AWAKE_MS) {
+                sleep_ms = node->wake_ms + SIM_MAX_AWAKE_MS;
+            }
+            on_ms = sleep_ms > node->wake_ms ? sleep_ms - node->wake_ms : 0;
+            radio_on_ms += on_ms;
+            if (node->hop_depth == SIM_LAYERS) {
+                leaf_radio_on_ms += on_ms;
+            }
+        }
+    }
+
+    result.formed_ms = (int) (total_formed_ms / SIM_TRIALS);
+    result.radio_on_ms = (int) (radio_on_ms / SIM_TRIALS / SIM_NODES);
+    result.leaf_radio_on_ms = (int) (leaf_radio_on_ms / SIM_TRIALS / SIM_LAYER_NODES);
+
+    printf("%9d ms | %6.2f%% | %9d | %8d %8d\n", hop_offset_ms, 100.0 * result.joined / SIM_TRIALS / SIM_NODES,
+           result.formed_ms, result.radio_on_ms, result.leaf_radio_on_ms);
+    return result;
+}
+
+int
+main() {
+    struct sim_result unstaggered, staggered;
+    int failures = 0;
+
+    printf("%d layers of %d nodes, %d trials\n", SIM_LAYERS, SIM_LAYER_NODES, SIM_TRIALS);
+    printf("%12s | %7s | %9s | %s\n", "per hop", "joined", "formed ms", "radio-on ms: node    leaf");
+
+    unstaggered = sim_run(0);
+    staggered = sim_run(250);
+    sim_run(500);
+    sim_run(1000);
+
+    // A hop takes about half a second to join. Staggering by a part of that keeps the deeper nodes from scanning for
+    // parents that aren't up yet. Staggering by more than it has the whole mesh wait on the deepest nodes' wake. Now
+    // and then a pair whose schedules line up misses each other either way.
+    if (staggered.joined < SIM_TRIALS * SIM_NODES * 999 / 1000 || staggered.radio_on_ms >= unstaggered.radio_on_ms) {
+        printf("FAIL: staggered wakes\n");
+        failures++;
+    }
+
+    return failures != 0;
+}
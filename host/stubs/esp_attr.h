@@ -0,0 +1,7 @@
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+/* There is no RTC memory on the host, everything survives a simulated sleep. */
+#define RTC_DATA_ATTR
+
+#endif //HOST_ESP_ATTR_H
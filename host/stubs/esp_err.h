@@ -0,0 +1,14 @@
+#ifndef HOST_ESP_ERR_H
+#define HOST_ESP_ERR_H
+
+#include <stdint.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL (-1)
+#define ESP_ERR_NVS_NOT_INITIALIZED 0x1101
+
+const char *esp_err_to_name(esp_err_t code);
+
+#endif //HOST_ESP_ERR_H
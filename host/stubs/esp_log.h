@@ -0,0 +1,18 @@
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+/* Host stand-in for ESP-IDF logging, see host_stubs.c. */
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+        __attribute__((format(printf, 3, 4)));
+
+#endif //HOST_ESP_LOG_H
@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_SYSTEM_H
+#define HOST_ESP_SYSTEM_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+uint32_t esp_random(void);
+
+#endif //HOST_ESP_SYSTEM_H
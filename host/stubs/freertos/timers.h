@@ -0,0 +1,20 @@
+#ifndef HOST_FREERTOS_TIMERS_H
+#define HOST_FREERTOS_TIMERS_H
+
+#include "freertos/FreeRTOS.h"
+
+/*
+ * Software timers on the simulated clock, they fire from host_clock_advance_ms. See host_clock.h.
+ */
+
+typedef struct host_timer *TimerHandle_t;
+typedef TimerHandle_t xTimerHandle;
+typedef void TimerCallbackFunction_t(TimerHandle_t timer);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload, void *timer_id,
+                           TimerCallbackFunction_t *callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks_to_wait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks_to_wait);
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer);
+
+#endif //HOST_FREERTOS_TIMERS_H
@@ -0,0 +1,128 @@
+#ifndef HOST_BLE_GATT_H
+#define HOST_BLE_GATT_H
+
+#include <stdint.h>
+#include "host/ble_uuid.h"
+#include "os/os_mbuf.h"
+
+#define BLE_ATT_MTU_DFLT 23
+#define BLE_ATT_ERR_INVALID_HANDLE 0x01
+#define BLE_ATT_ERR_ATTR_NOT_FOUND 0x0a
+#define BLE_ATT_ERR_UNLIKELY 0x0e
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN 0x0d
+
+#define BLE_GATT_SVC_TYPE_PRIMARY 1
+
+#define BLE_GATT_CHR_F_WRITE 0x0008
+#define BLE_GATT_CHR_F_NOTIFY 0x0010
+
+#define BLE_GATT_ACCESS_OP_READ_CHR 0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR 1
+
+#define BLE_GATT_REGISTER_OP_SVC 1
+#define BLE_GATT_REGISTER_OP_CHR 2
+#define BLE_GATT_REGISTER_OP_DSC 3
+
+struct ble_gatt_error {
+    uint16_t status;
+    uint16_t att_handle;
+};
+
+struct ble_gatt_svc {
+    uint16_t start_handle;
+    uint16_t end_handle;
+    ble_uuid_any_t uuid;
+};
+
+struct ble_gatt_chr {
+    uint16_t def_handle;
+    uint16_t val_handle;
+    uint8_t properties;
+    ble_uuid_any_t uuid;
+};
+
+struct ble_gatt_dsc {
+    uint16_t handle;
+    ble_uuid_any_t uuid;
+};
+
+struct ble_gatt_attr {
+    uint16_t handle;
+    uint16_t offset;
+    struct os_mbuf *om;
+};
+
+struct ble_gatt_access_ctxt;
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt,
+                               void *arg);
+
+struct ble_gatt_chr_def {
+    const ble_uuid_t *uuid;
+    ble_gatt_access_fn *access_cb;
+    void *arg;
+    uint16_t flags;
+    uint16_t *val_handle;
+};
+
+struct ble_gatt_svc_def {
+    uint8_t type;
+    const ble_uuid_t *uuid;
+    const struct ble_gatt_chr_def *characteristics;
+};
+
+struct ble_gatt_dsc_def {
+    const ble_uuid_t *uuid;
+};
+
+struct ble_gatt_access_ctxt {
+    uint8_t op;
+    struct os_mbuf *om;
+    const struct ble_gatt_chr_def *chr;
+};
+
+struct ble_gatt_register_ctxt {
+    uint8_t op;
+    union {
+        struct {
+            uint16_t handle;
+            const struct ble_gatt_svc_def *svc_def;
+        } svc;
+        struct {
+            uint16_t def_handle;
+            uint16_t val_handle;
+            const struct ble_gatt_chr_def *chr_def;
+        } chr;
+        struct {
+            uint16_t handle;
+            const struct ble_gatt_dsc_def *dsc_def;
+        } dsc;
+    };
+};
+
+typedef int ble_gatt_mtu_fn(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t mtu, void *arg);
+typedef int ble_gatt_disc_svc_fn(uint16_t conn_handle, const struct ble_gatt_error *error,
+                                 const struct ble_gatt_svc *service, void *arg);
+typedef int ble_gatt_chr_fn(uint16_t conn_handle, const struct ble_gatt_error *error,
+                            const struct ble_gatt_chr *chr, void *arg);
+typedef int ble_gatt_dsc_fn(uint16_t conn_handle, const struct ble_gatt_error *error,
+                            uint16_t chr_val_handle, const struct ble_gatt_dsc *dsc, void *arg);
+typedef int ble_gatt_attr_fn(uint16_t conn_handle, const struct ble_gatt_error *error,
+                             struct ble_gatt_attr *attr, void *arg);
+
+int ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn *cb, void *cb_arg);
+int ble_gattc_disc_all_svcs(uint16_t conn_handle, ble_gatt_disc_svc_fn *cb, void *cb_arg);
+int ble_gattc_disc_svc_by_uuid(uint16_t conn_handle, const ble_uuid_t *uuid, ble_gatt_disc_svc_fn *cb,
+                               void *cb_arg);
+int ble_gattc_disc_all_chrs(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle,
+                            ble_gatt_chr_fn *cb, void *cb_arg);
+int ble_gattc_disc_all_dscs(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle,
+                            ble_gatt_dsc_fn *cb, void *cb_arg);
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t data_len,
+                         ble_gatt_attr_fn *cb, void *cb_arg);
+int ble_gattc_write_long(uint16_t conn_handle, uint16_t attr_handle, uint16_t offset, struct os_mbuf *txom,
+                         ble_gatt_attr_fn *cb, void *cb_arg);
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs);
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs);
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om);
+
+#endif //HOST_BLE_GATT_H
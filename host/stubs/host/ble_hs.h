@@ -0,0 +1,54 @@
+#ifndef HOST_BLE_HS_H
+#define HOST_BLE_HS_H
+
+/*
+ * Host stand-in for the parts of the NimBLE host the mesh modules use. Declarations only, the simulations provide
+ * whatever the code under test ends up calling, see host_stubs.c.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include "syscfg/syscfg.h"
+#include "os/endian.h"
+#include "os/os_mbuf.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "nimble/nimble_npl.h"
+#include "host/ble_uuid.h"
+#include "host/ble_gap.h"
+#include "host/ble_gatt.h"
+#include "host/ble_hs_adv.h"
+#include "host/ble_l2cap.h"
+
+#define BLE_HS_EAGAIN 1
+#define BLE_HS_EALREADY 2
+#define BLE_HS_EINVAL 3
+#define BLE_HS_EMSGSIZE 4
+#define BLE_HS_ENOENT 5
+#define BLE_HS_ENOMEM 6
+#define BLE_HS_ENOTCONN 7
+#define BLE_HS_ENOTSUP 8
+#define BLE_HS_EAPP 9
+#define BLE_HS_EBADDATA 10
+#define BLE_HS_EOS 11
+#define BLE_HS_ECONTROLLER 12
+#define BLE_HS_ETIMEOUT 13
+#define BLE_HS_EDONE 14
+#define BLE_HS_EBUSY 15
+#define BLE_HS_EREJECT 16
+#define BLE_HS_EUNKNOWN 17
+#define BLE_HS_ESTALLED 31
+
+#define BLE_HS_ERR_ATT_BASE 0x100
+#define BLE_HS_ATT_ERR(x) ((x) ? BLE_HS_ERR_ATT_BASE + (x) : 0)
+
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type);
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa);
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len);
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len);
+
+#endif //HOST_BLE_HS_H
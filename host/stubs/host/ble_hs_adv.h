@@ -0,0 +1,14 @@
+#ifndef HOST_BLE_HS_ADV_H
+#define HOST_BLE_HS_ADV_H
+
+#define BLE_HS_ADV_TYPE_FLAGS 0x01
+#define BLE_HS_ADV_TYPE_INCOMP_UUIDS16 0x02
+#define BLE_HS_ADV_TYPE_COMP_UUIDS16 0x03
+#define BLE_HS_ADV_TYPE_INCOMP_NAME 0x08
+#define BLE_HS_ADV_TYPE_COMP_NAME 0x09
+#define BLE_HS_ADV_TYPE_TX_PWR_LVL 0x0a
+#define BLE_HS_ADV_TYPE_MFG_DATA 0xff
+
+struct ble_hs_adv_fields;
+
+#endif //HOST_BLE_HS_ADV_H
@@ -0,0 +1,54 @@
+#ifndef HOST_BLE_L2CAP_H
+#define HOST_BLE_L2CAP_H
+
+#include <stdint.h>
+#include "os/os_mbuf.h"
+
+#define BLE_L2CAP_EVENT_COC_CONNECTED 0
+#define BLE_L2CAP_EVENT_COC_DISCONNECTED 1
+#define BLE_L2CAP_EVENT_COC_ACCEPT 2
+#define BLE_L2CAP_EVENT_COC_DATA_RECEIVED 3
+#define BLE_L2CAP_EVENT_COC_TX_UNSTALLED 4
+
+struct ble_l2cap_chan;
+
+struct ble_l2cap_event {
+    int type;
+    union {
+        struct {
+            int status;
+            uint16_t conn_handle;
+            struct ble_l2cap_chan *chan;
+        } connect;
+        struct {
+            uint16_t conn_handle;
+            struct ble_l2cap_chan *chan;
+        } disconnect;
+        struct {
+            uint16_t conn_handle;
+            uint16_t peer_sdu_size;
+            struct ble_l2cap_chan *chan;
+        } accept;
+        struct {
+            uint16_t conn_handle;
+            struct ble_l2cap_chan *chan;
+            struct os_mbuf *sdu_rx;
+        } receive;
+        struct {
+            uint16_t conn_handle;
+            struct ble_l2cap_chan *chan;
+            int status;
+        } tx_unstalled;
+    };
+};
+
+typedef int ble_l2cap_event_fn(struct ble_l2cap_event *event, void *arg);
+
+int ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn *cb, void *cb_arg);
+int ble_l2cap_connect(uint16_t conn_handle, uint16_t psm, uint16_t mtu, struct os_mbuf *sdu_rx,
+                      ble_l2cap_event_fn *cb, void *cb_arg);
+int ble_l2cap_disconnect(struct ble_l2cap_chan *chan);
+int ble_l2cap_send(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_tx);
+int ble_l2cap_recv_ready(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_rx);
+
+#endif //HOST_BLE_L2CAP_H
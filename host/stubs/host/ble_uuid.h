@@ -0,0 +1,62 @@
+#ifndef HOST_BLE_UUID_H
+#define HOST_BLE_UUID_H
+
+#include <stdint.h>
+#include <string.h>
+/* The IDF port pulls in its logging through the NimBLE headers, mesh_log.h relies on that. */
+#include "esp_log.h"
+
+#define BLE_UUID_TYPE_16 16
+#define BLE_UUID_TYPE_32 32
+#define BLE_UUID_TYPE_128 128
+
+#define BLE_UUID_STR_LEN 37
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint32_t value;
+} ble_uuid32_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+typedef union {
+    ble_uuid_t u;
+    ble_uuid16_t u16;
+    ble_uuid32_t u32;
+    ble_uuid128_t u128;
+} ble_uuid_any_t;
+
+#define BLE_UUID16_INIT(uuid16) { .u.type = BLE_UUID_TYPE_16, .value = (uuid16) }
+#define BLE_UUID16_DECLARE(uuid16) ((ble_uuid_t *) (&(ble_uuid16_t) BLE_UUID16_INIT(uuid16)))
+
+char *ble_uuid_to_str(const ble_uuid_t *uuid, char *dst);
+
+static inline int
+ble_uuid_cmp(const ble_uuid_t *uuid1, const ble_uuid_t *uuid2) {
+    if (uuid1->type != uuid2->type) {
+        return uuid1->type - uuid2->type;
+    }
+
+    switch (uuid1->type) {
+        case BLE_UUID_TYPE_16:
+            return (int) ((const ble_uuid16_t *) uuid1)->value - (int) ((const ble_uuid16_t *) uuid2)->value;
+        case BLE_UUID_TYPE_32:
+            return ((const ble_uuid32_t *) uuid1)->value == ((const ble_uuid32_t *) uuid2)->value ? 0 : 1;
+        default:
+            return memcmp(((const ble_uuid128_t *) uuid1)->value, ((const ble_uuid128_t *) uuid2)->value, 16);
+    }
+}
+
+#endif //HOST_BLE_UUID_H
@@ -0,0 +1,6 @@
+#ifndef HOST_BLE_HS_UTIL_H
+#define HOST_BLE_HS_UTIL_H
+
+#include "host/ble_hs.h"
+
+#endif //HOST_BLE_HS_UTIL_H
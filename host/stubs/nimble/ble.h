@@ -0,0 +1,31 @@
+#ifndef HOST_NIMBLE_BLE_H
+#define HOST_NIMBLE_BLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "syscfg/syscfg.h"
+
+#define BLE_ADDR_PUBLIC 0x00
+#define BLE_ADDR_RANDOM 0x01
+
+#define BLE_ERR_REM_USER_CONN_TERM 0x13
+#define BLE_ERR_RD_CONN_TERM_PWROFF 0x15
+
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+static inline int
+ble_addr_cmp(const ble_addr_t *a, const ble_addr_t *b) {
+    int type_diff;
+
+    type_diff = a->type - b->type;
+    if (type_diff != 0) {
+        return type_diff;
+    }
+
+    return memcmp(a->val, b->val, sizeof(a->val));
+}
+
+#endif //HOST_NIMBLE_BLE_H
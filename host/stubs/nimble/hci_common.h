@@ -0,0 +1,15 @@
+#ifndef HOST_NIMBLE_HCI_COMMON_H
+#define HOST_NIMBLE_HCI_COMMON_H
+
+#define BLE_HCI_SCAN_FILT_NO_WL 0
+#define BLE_HCI_SCAN_FILT_USE_WL 1
+
+#define BLE_HCI_SUGG_DEF_DATALEN_TX_OCTETS_MIN 27
+
+#define BLE_HCI_ADV_RPT_EVTYPE_ADV_IND 0
+#define BLE_HCI_ADV_RPT_EVTYPE_DIR_IND 1
+#define BLE_HCI_ADV_RPT_EVTYPE_SCAN_IND 2
+#define BLE_HCI_ADV_RPT_EVTYPE_NONCONN_IND 3
+#define BLE_HCI_ADV_RPT_EVTYPE_SCAN_RSP 4
+
+#endif //HOST_NIMBLE_HCI_COMMON_H
@@ -0,0 +1,58 @@
+#ifndef HOST_NIMBLE_NPL_H
+#define HOST_NIMBLE_NPL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_log.h"
+/* The IDF port of the NPL is built on FreeRTOS and pulls its headers in. */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+/* One tick per millisecond of the simulated clock, see host_clock.h. */
+typedef uint32_t ble_npl_time_t;
+
+struct ble_npl_event;
+typedef void ble_npl_event_fn(struct ble_npl_event *ev);
+
+struct ble_npl_event {
+    ble_npl_event_fn *fn;
+    void *arg;
+};
+
+/* There is a single event queue, callouts run from host_clock_advance_ms as they come due. See host_clock.h. */
+struct ble_npl_eventq {
+    int unused;
+};
+
+struct ble_npl_callout {
+    struct ble_npl_event ev;
+    bool active;
+    ble_npl_time_t expires_at;
+    struct ble_npl_callout *next;
+};
+
+ble_npl_time_t ble_npl_time_get(void);
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq, ble_npl_event_fn *ev_cb,
+                          void *ev_arg);
+int ble_npl_callout_reset(struct ble_npl_callout *co, ble_npl_time_t ticks);
+void ble_npl_callout_stop(struct ble_npl_callout *co);
+bool ble_npl_callout_is_active(struct ble_npl_callout *co);
+
+static inline void *
+ble_npl_event_get_arg(struct ble_npl_event *ev) {
+    return ev->arg;
+}
+
+static inline uint32_t
+ble_npl_time_ms_to_ticks32(uint32_t ms) {
+    return ms;
+}
+
+static inline uint32_t
+ble_npl_time_ticks_to_ms32(ble_npl_time_t ticks) {
+    return ticks;
+}
+
+#endif //HOST_NIMBLE_NPL_H
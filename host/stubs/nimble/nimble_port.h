@@ -0,0 +1,8 @@
+#ifndef HOST_NIMBLE_PORT_H
+#define HOST_NIMBLE_PORT_H
+
+#include "nimble/nimble_npl.h"
+
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void);
+
+#endif //HOST_NIMBLE_PORT_H
@@ -0,0 +1,42 @@
+#ifndef HOST_OS_MBUF_H
+#define HOST_OS_MBUF_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+/*
+ * Flat stand-ins for mbufs and memory pools. An mbuf here is a single growable buffer, which is all the mesh code
+ * relies on: appending, reading the packet length and freeing the chain.
+ */
+
+struct os_mempool {
+    int blocks;
+    int block_size;
+
+    /** Free blocks of the pool's memory, each one holding the next. */
+    void *free_list;
+};
+
+struct os_mbuf_pool {
+    struct os_mempool *pool;
+};
+
+struct os_mbuf {
+    uint8_t *om_data;
+    uint16_t om_len;
+    uint16_t om_cap;
+};
+
+#define OS_MEMPOOL_BYTES(n, blksize) ((n) * (blksize))
+#define OS_MBUF_PKTLEN(om) ((om)->om_len)
+
+int os_mempool_init(struct os_mempool *mp, uint16_t blocks, uint32_t block_size, void *membuf, const char *name);
+void *os_memblock_get(struct os_mempool *mp);
+int os_memblock_put(struct os_mempool *mp, void *block_addr);
+int os_mbuf_pool_init(struct os_mbuf_pool *omp, struct os_mempool *mp, uint16_t buf_len, uint16_t nbufs);
+struct os_mbuf *os_mbuf_get_pkthdr(struct os_mbuf_pool *omp, uint8_t pkthdr_len);
+struct os_mbuf *os_msys_get_pkthdr(uint16_t dsize, uint16_t user_hdr_len);
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len);
+int os_mbuf_free_chain(struct os_mbuf *om);
+
+#endif //HOST_OS_MBUF_H
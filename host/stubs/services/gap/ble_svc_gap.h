@@ -0,0 +1,6 @@
+#ifndef HOST_BLE_SVC_GAP_H
+#define HOST_BLE_SVC_GAP_H
+
+void ble_svc_gap_init(void);
+
+#endif //HOST_BLE_SVC_GAP_H
@@ -0,0 +1,6 @@
+#ifndef HOST_BLE_SVC_GATT_H
+#define HOST_BLE_SVC_GATT_H
+
+void ble_svc_gatt_init(void);
+
+#endif //HOST_BLE_SVC_GATT_H
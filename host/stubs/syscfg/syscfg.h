@@ -0,0 +1,8 @@
+#ifndef HOST_SYSCFG_H
+#define HOST_SYSCFG_H
+
+#define MYNEWT_VAL(name) MYNEWT_VAL_ ## name
+
+#define MYNEWT_VAL_BLE_MAX_CONNECTIONS 4
+
+#endif //HOST_SYSCFG_H
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "mesh_custody.h"
+#include "mesh_node.h"
+#include "host_clock.h"
+
+/*
+ * A packet in custody has the whole time since it reached us taken off its deadline whenever it is sent, whether that
+ * is the first send or a resend, and the queue goes out earliest deadline first.
+ */
+
+#define TEST_FROM_CONN_HANDLE 3
+#define TEST_NEXT_HOP_CONN_HANDLE 5
+
+static int failures;
+
+static uint8_t sent_sources[CUSTODY_MAX_PACKETS];
+static uint16_t sent_deadlines[CUSTODY_MAX_PACKETS];
+static int sent_count;
+
+#define TEST_EXPECT(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void
+test_send(struct mesh_data_packet *packet, uint16_t from_conn_handle) {
+    if (sent_count < CUSTODY_MAX_PACKETS) {
+        sent_sources[sent_count] = packet->source;
+        sent_deadlines[sent_count] = packet->deadline_ms;
+        sent_count++;
+    }
+}
+
+static void
+test_store(uint8_t source, uint16_t deadline_ms, TickType_t received_at) {
+    struct mesh_data_packet *packet;
+    int rc;
+
+    packet = mdp_alloc(2);
+    packet->type = PT_NODE_CONNECTED;
+    packet->source = source;
+    packet->dest = HUB_NODE_ID;
+    packet->ttl = 10;
+    packet->idempotency_key = source;
+    packet->data_length = 2;
+    packet->deadline_ms = deadline_ms;
+    memset(packet->data, 0, 2);
+
+    rc = mesh_custody_store(packet, TEST_FROM_CONN_HANDLE, received_at);
+    TEST_EXPECT(rc == 0);
+    mdp_free(packet);
+}
+
+static void
+test_reset() {
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        mesh_custody_handed_to(i, i, TEST_NEXT_HOP_CONN_HANDLE);
+        mesh_custody_release(i, i, TEST_NEXT_HOP_CONN_HANDLE);
+    }
+    sent_count = 0;
+    host_clock_reset();
+}
+
+/* Time spent before custody was taken, waiting for a free slot or the next hop, counts as well. */
+static void
+test_first_send_ages_from_arrival() {
+    test_reset();
+
+    test_store(1, 1000, xTaskGetTickCount());
+    host_clock_advance_ms(200);
+    test_store(2, 1000, 0);
+    host_clock_advance_ms(100);
+
+    TEST_EXPECT(mesh_custody_deliver_packet(1, 1, test_send) == 0);
+    TEST_EXPECT(mesh_custody_deliver_packet(2, 2, test_send) == 0);
+    TEST_EXPECT(sent_count == 2);
+    TEST_EXPECT(sent_deadlines[0] == 700);
+    TEST_EXPECT(sent_deadlines[1] == 700);
+}
+
+/* A resend doesn't get back the time the earlier sends took, and gives up once there isn't a hop's worth left. */
+static void
+test_resend_ages_from_arrival() {
+    test_reset();
+
+    test_store(1, 1000, 0);
+    host_clock_advance_ms(100);
+    mesh_custody_deliver(test_send);
+    host_clock_advance_ms(500);
+    mesh_custody_deliver(test_send);
+    host_clock_advance_ms(350);
+    mesh_custody_deliver(test_send);
+
+    TEST_EXPECT(sent_count == 2);
+    TEST_EXPECT(sent_deadlines[0] == 900);
+    TEST_EXPECT(sent_deadlines[1] == 400);
+    TEST_EXPECT(mesh_custody_count() == 0);
+}
+
+static void
+test_earliest_deadline_first() {
+    test_reset();
+
+    test_store(1, 0, 0);
+    test_store(2, 3000, 0);
+    host_clock_advance_ms(1000);
+    test_store(3, 1500, xTaskGetTickCount());
+    test_store(4, 2500, 0);
+    host_clock_advance_ms(200);
+    mesh_custody_deliver(test_send);
+
+    // 3 and 4 both have 1300 ms left, 2 has 1800 and 1 has no deadline.
+    TEST_EXPECT(sent_count == 4);
+    TEST_EXPECT(sent_sources[0] == 3 || sent_sources[0] == 4);
+    TEST_EXPECT(sent_sources[1] == 3 || sent_sources[1] == 4);
+    TEST_EXPECT(sent_sources[2] == 2);
+    TEST_EXPECT(sent_sources[3] == 1);
+    TEST_EXPECT(sent_deadlines[2] == 1800);
+    TEST_EXPECT(sent_deadlines[3] == 0);
+}
+
+/* Only the hops a packet was handed to can take custody of it, the latest two of them. */
+static void
+test_release_by_next_hop_only() {
+    test_reset();
+
+    test_store(1, 0, 0);
+    TEST_EXPECT(mesh_custody_release(1, 1, TEST_NEXT_HOP_CONN_HANDLE) == BLE_HS_EINVAL);
+    TEST_EXPECT(mesh_custody_release(1, 1, TEST_FROM_CONN_HANDLE) == BLE_HS_EINVAL);
+
+    mesh_custody_handed_to(1, 1, 6);
+    mesh_custody_handed_to(1, 1, 7);
+    mesh_custody_handed_to(1, 1, 6);
+    mesh_custody_handed_to(1, 1, 8);
+    TEST_EXPECT(mesh_custody_release(1, 1, 7) == BLE_HS_EINVAL);
+    TEST_EXPECT(mesh_custody_count() == 1);
+    TEST_EXPECT(mesh_custody_release(1, 1, 6) == 0);
+    TEST_EXPECT(mesh_custody_count() == 0);
+}
+
+/* A deadline is meant for the request's wake, the packets without one, readings among them, outlive a deep sleep. */
+static void
+test_wake_drops_deadlines() {
+    test_reset();
+
+    test_store(1, 0, 0);
+    test_store(2, 3000, 0);
+    host_clock_deep_sleep_us(60 * 1000 * 1000);
+    mesh_custody_init();
+
+    TEST_EXPECT(mesh_custody_count() == 1);
+    mesh_custody_deliver(test_send);
+    TEST_EXPECT(sent_count == 1);
+    TEST_EXPECT(sent_sources[0] == 1);
+}
+
+int
+main() {
+    test_first_send_ages_from_arrival();
+    test_resend_ages_from_arrival();
+    test_earliest_deadline_first();
+    test_release_by_next_hop_only();
+    test_wake_drops_deadlines();
+
+    printf("%s\n", failures == 0 ? "custody: ok" : "custody: FAILED");
+    return failures != 0;
+}
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "mesh_custody.h"
+#include "mesh_node.h"
+#include "mesh_peer.h"
+#include "mesh_transport.h"
+#include "host_clock.h"
+
+/*
+ * Runs packets through the routing, dedup and custody of mesh_node over the loopback transport. The node under test
+ * has a parent and two children, the test stands in for all three at the far end of their links.
+ */
+
+#define TEST_NODE_ID 4
+
+#define TEST_PARENT_CONN 1
+#define TEST_CHILD_A_CONN 2
+#define TEST_CHILD_B_CONN 3
+
+#define TEST_LOG_SIZE 64
+#define TEST_BENCH_PACKETS 10000
+
+struct test_frame {
+    uint16_t conn_handle;
+    uint8_t type;
+    uint8_t source;
+    uint8_t dest;
+    uint8_t key;
+    uint8_t ttl;
+    uint16_t deadline_ms;
+};
+
+static int failures;
+
+static struct test_frame sent_log[TEST_LOG_SIZE];
+static int sent_count;
+static int processed_count;
+
+/* The parent takes custody of every upstream packet it is sent, as a relay would. */
+static bool parent_takes_custody;
+
+#define TEST_EXPECT(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void
+test_inject_ttl(uint16_t conn_handle, uint8_t type, uint8_t source, uint8_t dest, uint8_t key, uint8_t ttl,
+                const uint8_t *data, uint8_t data_length) {
+    struct mesh_data_packet packet;
+    uint8_t packed[DATA_PACKET_MAX_SIZE];
+    uint8_t packed_len;
+    uint8_t zero = 0;
+
+    memset(&packet, 0, sizeof packet);
+    packet.type = type;
+    packet.source = source;
+    packet.dest = dest;
+    packet.idempotency_key = key;
+    packet.ttl = ttl;
+    packet.data = data != NULL ? (uint8_t *) data : &zero;
+    packet.data_length = data != NULL ? data_length : 1;
+
+    mdp_pack(packed, &packed_len, sizeof packed, &packet);
+    TEST_EXPECT(mesh_transport_loopback_inject(conn_handle, packed, packed_len) == 0);
+}
+
+static void
+test_inject(uint16_t conn_handle, uint8_t type, uint8_t source, uint8_t dest, uint8_t key, const uint8_t *data,
+            uint8_t data_length) {
+    test_inject_ttl(conn_handle, type, source, dest, key, type == PT_CUSTODY_ACK ? 0 : std_ttl - 1, data, data_length);
+}
+
+static void
+test_inject_custody_ack(uint16_t conn_handle, uint8_t source, uint8_t key) {
+    uint8_t data[2] = {source, key};
+
+    test_inject(conn_handle, PT_CUSTODY_ACK, conn_handle + 100, TEST_NODE_ID, 0, data, sizeof data);
+}
+
+static void
+test_wire(uint16_t conn_handle, const uint8_t *packed_data, uint16_t packed_len) {
+    struct mesh_data_packet packet;
+    struct test_frame *frame;
+
+    frame = &sent_log[sent_count % TEST_LOG_SIZE];
+    frame->conn_handle = conn_handle;
+    frame->source = packed_data[DATA_PACKET_SRC_IDX];
+    frame->dest = packed_data[DATA_PACKET_DST_IDX];
+    frame->ttl = packed_data[DATA_PACKET_TTL_IDX];
+    frame->key = packed_data[DATA_PACKET_IDEMPOTENCY_KEY_IDX];
+    frame->type = packed_data[DATA_PACKET_TYPE_IDX];
+    mdp_unpack((uint8_t *) packed_data, packed_len, &packet);
+    frame->deadline_ms = packet.deadline_ms;
+    free(packet.data);
+    sent_count++;
+
+    if (parent_takes_custody && conn_handle == TEST_PARENT_CONN && frame->dest == HUB_NODE_ID &&
+        frame->type != PT_CUSTODY_ACK) {
+        test_inject_custody_ack(conn_handle, frame->source, frame->key);
+    }
+}
+
+/**
+ * Number of packets of the given type from the given source sent over a link since the log was last cleared.
+ */
+static int
+test_sent(uint16_t conn_handle, uint8_t type, uint8_t source) {
+    int count = 0;
+    int i;
+
+    for (i = 0; i < sent_count && i < TEST_LOG_SIZE; i++) {
+        if (sent_log[i].conn_handle == conn_handle && sent_log[i].type == type && sent_log[i].source == source) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void
+test_run() {
+    sent_count = 0;
+    mesh_transport_loopback_run();
+}
+
+static void
+test_handle_packet(struct mesh_data_packet *packet) {
+    processed_count++;
+}
+
+static void
+test_add_peer(uint16_t conn_handle, uint8_t role, bool upstream) {
+    struct mesh_peer *peer;
+    ble_addr_t addr = {0};
+
+    addr.val[0] = conn_handle;
+    TEST_EXPECT(mesh_peer_add(conn_handle, &addr) == 0);
+
+    peer = mesh_peer_find(conn_handle);
+    peer->role = role;
+    peer->transport = &mesh_transport_loopback;
+    mesh_peer_set_upstream(conn_handle, upstream);
+}
+
+static void
+test_setup() {
+    mesh_peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS));
+    TEST_EXPECT(mesh_node_init() == 0);
+    mesh_node_set_node_id(TEST_NODE_ID);
+    mesh_node_register_packet_handler(PT_REQ_BATTERY_PCT, test_handle_packet);
+    mesh_transport_loopback_init(test_wire);
+
+    test_add_peer(TEST_PARENT_CONN, MESH_PEER_ROLE_NODE, true);
+    test_add_peer(TEST_CHILD_A_CONN, MESH_PEER_ROLE_NODE, false);
+    test_add_peer(TEST_CHILD_B_CONN, MESH_PEER_ROLE_NODE, false);
+}
+
+/*
+ * A relayed upstream packet is taken into custody, acked back and passed to the parent only. The same packet over a
+ * second path is only acked.
+ */
+static void
+test_upstream_copies_merge() {
+    test_inject(TEST_CHILD_A_CONN, PT_RESP_BATTERY_PCT, 9, HUB_NODE_ID, 20, NULL, 0);
+    test_run();
+
+    TEST_EXPECT(test_sent(TEST_CHILD_A_CONN, PT_CUSTODY_ACK, TEST_NODE_ID) == 1);
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_RESP_BATTERY_PCT, 9) == 1);
+    TEST_EXPECT(test_sent(TEST_CHILD_A_CONN, PT_RESP_BATTERY_PCT, 9) == 0);
+    TEST_EXPECT(test_sent(TEST_CHILD_B_CONN, PT_RESP_BATTERY_PCT, 9) == 0);
+    TEST_EXPECT(mesh_custody_count() == 1);
+
+    test_inject(TEST_CHILD_B_CONN, PT_RESP_BATTERY_PCT, 9, HUB_NODE_ID, 20, NULL, 0);
+    test_run();
+
+    TEST_EXPECT(test_sent(TEST_CHILD_B_CONN, PT_CUSTODY_ACK, TEST_NODE_ID) == 1);
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_RESP_BATTERY_PCT, 9) == 0);
+    TEST_EXPECT(mesh_custody_count() == 1);
+
+    // A child never had the packet from us, its ack doesn't count.
+    test_inject_custody_ack(TEST_CHILD_B_CONN, 9, 20);
+    test_run();
+    TEST_EXPECT(mesh_custody_count() == 1);
+
+    // Once the parent has it, there's nothing left to resend.
+    test_inject_custody_ack(TEST_PARENT_CONN, 9, 20);
+    test_run();
+    TEST_EXPECT(mesh_custody_count() == 0);
+}
+
+/*
+ * Packets from the hub for another node are passed on down to the children with one hop less to go, never back up.
+ * A second copy is not passed on again.
+ */
+static void
+test_downstream_forwarded() {
+    int i;
+
+    test_inject(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, 7, 30, NULL, 0);
+    test_run();
+
+    TEST_EXPECT(test_sent(TEST_CHILD_A_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID) == 1);
+    TEST_EXPECT(test_sent(TEST_CHILD_B_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID) == 1);
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID) == 0);
+    for (i = 0; i < sent_count; i++) {
+        TEST_EXPECT(sent_log[i].ttl == std_ttl - 2);
+    }
+
+    test_inject(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, 7, 30, NULL, 0);
+    test_run();
+    TEST_EXPECT(sent_count == 0);
+}
+
+/* A packet for another node coming up from a child only goes on to the other child. */
+static void
+test_downstream_not_sent_back() {
+    test_inject(TEST_CHILD_A_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, 8, 31, NULL, 0);
+    test_run();
+
+    TEST_EXPECT(test_sent(TEST_CHILD_A_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID) == 0);
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID) == 0);
+    TEST_EXPECT(test_sent(TEST_CHILD_B_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID) == 1);
+}
+
+/* A packet for us is processed once, a copy with the same key is not. */
+static void
+test_own_packets_processed_once() {
+    processed_count = 0;
+
+    test_inject(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, TEST_NODE_ID, 40, NULL, 0);
+    test_run();
+    TEST_EXPECT(processed_count == 1);
+
+    test_inject(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, TEST_NODE_ID, 40, NULL, 0);
+    test_run();
+    TEST_EXPECT(processed_count == 1);
+}
+
+/*
+ * Hop counts are learned from upstream links only and follow the latest packet from the hub. A child that claims to
+ * be next to the hub still doesn't become a parent.
+ */
+static void
+test_hops_learned_upstream_only() {
+    test_inject_ttl(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, 7, 50, std_ttl - 1, NULL, 0);
+    test_run();
+    TEST_EXPECT(mesh_peer_find(TEST_PARENT_CONN)->hops_to_hub == 1);
+
+    test_inject_ttl(TEST_PARENT_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, 7, 51, std_ttl - 3, NULL, 0);
+    test_run();
+    TEST_EXPECT(mesh_peer_find(TEST_PARENT_CONN)->hops_to_hub == 3);
+
+    test_inject_ttl(TEST_CHILD_A_CONN, PT_REQ_BATTERY_PCT, HUB_NODE_ID, 7, 52, std_ttl, NULL, 0);
+    test_run();
+    TEST_EXPECT(mesh_peer_find(TEST_CHILD_A_CONN)->hops_to_hub == MESH_PEER_HOPS_UNKNOWN);
+
+    test_inject(TEST_CHILD_B_CONN, PT_RESP_BATTERY_PCT, 9, HUB_NODE_ID, 53, NULL, 0);
+    test_run();
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_RESP_BATTERY_PCT, 9) == 1);
+    TEST_EXPECT(test_sent(TEST_CHILD_A_CONN, PT_RESP_BATTERY_PCT, 9) == 0);
+
+    test_inject_custody_ack(TEST_PARENT_CONN, 9, 53);
+    test_run();
+    TEST_EXPECT(mesh_custody_count() == 0);
+}
+
+/*
+ * Only requests we originate carry the time left until we sleep as their deadline. A reading carries none, so it is
+ * still delivered if it misses this wake.
+ */
+static void
+test_deadline_on_requests_only() {
+    struct mesh_data_packet *reading;
+    int i;
+
+    mesh_node_set_sleep_deadline(xTaskGetTickCount() + pdMS_TO_TICKS(5000));
+
+    reading = mdp_alloc(1);
+    reading->type = PT_RESP_MOISTURE_PCT;
+    reading->source = TEST_NODE_ID;
+    reading->dest = HUB_NODE_ID;
+    reading->ttl = std_ttl;
+    reading->idempotency_key = mesh_node_next_idempotency_key();
+    reading->data_length = 1;
+    reading->data[0] = 0;
+    mesh_node_send_packet_multipath(reading, false);
+    mesh_node_send_empty_packet(PT_NODE_LEASE_RENEW, true);
+    test_run();
+
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_RESP_MOISTURE_PCT, TEST_NODE_ID) == 1);
+    TEST_EXPECT(test_sent(TEST_PARENT_CONN, PT_NODE_LEASE_RENEW, TEST_NODE_ID) == 1);
+    for (i = 0; i < sent_count; i++) {
+        if (sent_log[i].type == PT_RESP_MOISTURE_PCT) {
+            TEST_EXPECT(sent_log[i].deadline_ms == 0);
+            test_inject_custody_ack(TEST_PARENT_CONN, TEST_NODE_ID, sent_log[i].key);
+        } else if (sent_log[i].type == PT_NODE_LEASE_RENEW) {
+            TEST_EXPECT(sent_log[i].deadline_ms == 5000);
+        }
+    }
+
+    test_run();
+    TEST_EXPECT(mesh_custody_count() == 0);
+    mesh_node_set_sleep_deadline(0);
+}
+
+/**
+ * Relays upstream packets from both children to a parent that takes custody of each, and reports the time routing
+ * takes per packet on this machine.
+ */
+static void
+bench_upstream_relay() {
+    struct timespec start, end;
+    double elapsed_us;
+    int i;
+
+    parent_takes_custody = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < TEST_BENCH_PACKETS; i++) {
+        test_inject(i % 2 ? TEST_CHILD_A_CONN : TEST_CHILD_B_CONN, PT_RESP_BATTERY_PCT, 10 + i % 200, HUB_NODE_ID,
+                    i / 200, NULL, 0);
+        test_run();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    parent_takes_custody = false;
+
+    TEST_EXPECT(mesh_custody_count() == 0);
+
+    elapsed_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    printf("relayed %d upstream packets in %.0f us, %.2f us per packet\n", TEST_BENCH_PACKETS, elapsed_us,
+           elapsed_us / TEST_BENCH_PACKETS);
+}
+
+int
+main() {
+    host_clock_reset();
+    test_setup();
+
+    test_upstream_copies_merge();
+    test_downstream_forwarded();
+    test_downstream_not_sent_back();
+    test_own_packets_processed_once();
+    test_hops_learned_upstream_only();
+    test_deadline_on_requests_only();
+    bench_upstream_relay();
+
+    if (failures != 0) {
+        printf("%d failures\n", failures);
+    }
+    return failures != 0;
+}
@@ -0,0 +1,168 @@
+#include <string.h>
+#include "host/ble_hs.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_adv.h"
+
+static ble_addr_t adv_foreign[MESH_ADV_FOREIGN_CACHE_SIZE];
+static int adv_foreign_count;
+static int adv_foreign_next;
+
+static bool
+ma_is_foreign(const ble_addr_t *addr) {
+    int i;
+
+    for (i = 0; i < adv_foreign_count; i++) {
+        if (ble_addr_cmp(&adv_foreign[i], addr) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+ma_remember_foreign(const ble_addr_t *addr) {
+    adv_foreign[adv_foreign_next] = *addr;
+    adv_foreign_next = (adv_foreign_next + 1) % MESH_ADV_FOREIGN_CACHE_SIZE;
+    if (adv_foreign_count < MESH_ADV_FOREIGN_CACHE_SIZE) {
+        adv_foreign_count++;
+    }
+}
+
+/**
+ * Classifies an advertising report in a single walk over its raw AD structures, picking out what we use on the way.
+ * A report is one of ours if it lists our data service or carries our manufacturer data. Every other advertiser
+ * goes into a small cache so its next reports are dropped without looking at them.
+ *
+ * @return The report's kind, also stored in report->kind.
+ */
+int
+mesh_adv_scan_report(const ble_addr_t *addr, const uint8_t *data, uint8_t len, struct mesh_adv_report *report) {
+    const uint8_t *field;
+    uint8_t field_len;
+    int off;
+    int i;
+
+    memset(report, 0, sizeof *report);
+    if (ma_is_foreign(addr)) {
+        return MESH_ADV_KIND_FOREIGN;
+    }
+
+    for (off = 0; off + 1 < len && data[off] != 0; off += data[off] + 1) {
+        if (off + 1 + data[off] > len) {
+            break;
+        }
+
+        /* The length covers the type byte, the field follows it. */
+        field = data + off + 2;
+        field_len = data[off] - 1;
+
+        switch (data[off + 1]) {
+            case BLE_HS_ADV_TYPE_INCOMP_UUIDS16:
+            case BLE_HS_ADV_TYPE_COMP_UUIDS16:
+                for (i = 0; i + 1 < field_len; i += 2) {
+                    if (get_le16(field + i) == GATT_SVR_SVC_DATA_UUID && report->kind == MESH_ADV_KIND_FOREIGN) {
+                        report->kind = MESH_ADV_KIND_NODE;
+                    }
+                }
+                break;
+            case BLE_HS_ADV_TYPE_TX_PWR_LVL:
+                if (field_len == 1) {
+                    report->tx_pwr_present = true;
+                    report->tx_pwr = (int8_t) field[0];
+                }
+                break;
+            case BLE_HS_ADV_TYPE_MFG_DATA:
+                if (field_len >= 3 && get_le16(field) == MESH_ADV_COMPANY_ID) {
+                    report->mfg_data = field;
+                    report->mfg_data_len = field_len;
+                    if (field[2] == MESH_ADV_TAG_READING) {
+                        report->kind = MESH_ADV_KIND_READING;
+                    } else if (field[2] == MESH_ADV_TAG && report->kind == MESH_ADV_KIND_FOREIGN) {
+                        report->kind = MESH_ADV_KIND_NODE;
+                    }
+                }
+                break;
+        }
+    }
+
+    if (report->kind == MESH_ADV_KIND_FOREIGN) {
+        ma_remember_foreign(addr);
+    }
+    return report->kind;
+}
+
+/**
+ * Layout of the manufacturer specific data: company id (little endian), tag, hop depth, free connection slots, node
+ * id and flags. Returns the number of bytes written, or BLE_HS_ENOMEM if the buffer is too small.
+ */
+int
+mesh_adv_info_encode(const struct mesh_adv_info *info, uint8_t *buf, int len) {
+    if (len < MESH_ADV_INFO_LEN) {
+        return BLE_HS_ENOMEM;
+    }
+
+    put_le16(buf, MESH_ADV_COMPANY_ID);
+    buf[2] = MESH_ADV_TAG;
+    buf[3] = info->hops_to_hub;
+    buf[4] = info->free_slots;
+    buf[5] = info->node_id;
+    buf[6] = info->flags;
+
+    return MESH_ADV_INFO_LEN;
+}
+
+/**
+ * Returns 0 if the manufacturer specific data is node info from one of us, BLE_HS_EINVAL otherwise.
+ */
+int
+mesh_adv_info_parse(const uint8_t *mfg_data, int len, struct mesh_adv_info *info) {
+    if (mfg_data == NULL || len < MESH_ADV_INFO_LEN ||
+        get_le16(mfg_data) != MESH_ADV_COMPANY_ID || mfg_data[2] != MESH_ADV_TAG) {
+        return BLE_HS_EINVAL;
+    }
+
+    info->hops_to_hub = mfg_data[3];
+    info->free_slots = mfg_data[4];
+    info->node_id = mfg_data[5];
+    info->flags = mfg_data[6];
+
+    return 0;
+}
+
+/**
+ * Layout of a reading: company id (little endian), reading tag, source, seq, ttl, packet type and the value (little
+ * endian).
+ */
+int
+mesh_adv_reading_encode(const struct mesh_adv_reading *reading, uint8_t *buf, int len) {
+    if (len < MESH_ADV_READING_LEN) {
+        return BLE_HS_ENOMEM;
+    }
+
+    put_le16(buf, MESH_ADV_COMPANY_ID);
+    buf[2] = MESH_ADV_TAG_READING;
+    buf[3] = reading->source;
+    buf[4] = reading->seq;
+    buf[5] = reading->ttl;
+    buf[6] = reading->type;
+    put_le32(buf + 7, reading->value);
+
+    return MESH_ADV_READING_LEN;
+}
+
+int
+mesh_adv_reading_parse(const uint8_t *mfg_data, int len, struct mesh_adv_reading *reading) {
+    if (mfg_data == NULL || len < MESH_ADV_READING_LEN ||
+        get_le16(mfg_data) != MESH_ADV_COMPANY_ID || mfg_data[2] != MESH_ADV_TAG_READING) {
+        return BLE_HS_EINVAL;
+    }
+
+    reading->source = mfg_data[3];
+    reading->seq = mfg_data[4];
+    reading->ttl = mfg_data[5];
+    reading->type = mfg_data[6];
+    reading->value = get_le32(mfg_data + 7);
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "host/ble_hs.h"
+
+#ifndef MESH_ADV_H
+#define MESH_ADV_H
+
+/* Company id reserved by the Bluetooth SIG for internal use, followed by a tag so other test devices are ignored. */
+#define MESH_ADV_COMPANY_ID 0xFFFF
+#define MESH_ADV_TAG 0x6d
+#define MESH_ADV_TAG_READING 0x72
+
+#define MESH_ADV_INFO_LEN 7
+#define MESH_ADV_READING_LEN 11
+
+/* Flags carried in the advertised node info. */
+#define MESH_ADV_F_PROVISIONED 0x01
+#define MESH_ADV_F_LOW_BATTERY 0x02
+
+/* Battery level under which we tell scanners to look for another parent. */
+#define MESH_ADV_LOW_BATTERY_PCT 20
+
+/* What an advertisement turned out to be. */
+#define MESH_ADV_KIND_FOREIGN 0
+#define MESH_ADV_KIND_NODE 1
+#define MESH_ADV_KIND_READING 2
+
+/* Advertisers recently found not to be one of us. */
+#define MESH_ADV_FOREIGN_CACHE_SIZE 16
+
+/**
+ * What a node tells scanners about itself in its advertising data, so they can rank it as a parent without connecting
+ * to it first.
+ */
+struct mesh_adv_info {
+    /** Our hop depth, MESH_PEER_HOPS_UNKNOWN until we have heard from the hub. */
+    uint8_t hops_to_hub;
+
+    /** Connections we can still accept. */
+    uint8_t free_slots;
+
+    uint8_t node_id;
+
+    uint8_t flags;
+};
+
+/**
+ * A sensor reading broadcast without a connection, see mesh_adv_bearer.h.
+ */
+struct mesh_adv_reading {
+    uint8_t source;
+
+    /** Per source, so relays and the hub can drop copies. */
+    uint8_t seq;
+
+    uint8_t ttl;
+
+    /** One of the PT_RESP_* packet types, the value is what the matching data packet would carry. */
+    uint8_t type;
+    uint32_t value;
+};
+
+/**
+ * The parts of an advertisement we use, pointing into the raw report.
+ */
+struct mesh_adv_report {
+    uint8_t kind;
+
+    bool tx_pwr_present;
+    int8_t tx_pwr;
+
+    const uint8_t *mfg_data;
+    uint8_t mfg_data_len;
+};
+
+int
+mesh_adv_scan_report(const ble_addr_t *addr, const uint8_t *data, uint8_t len, struct mesh_adv_report *report);
+
+int
+mesh_adv_info_encode(const struct mesh_adv_info *info, uint8_t *buf, int len);
+
+int
+mesh_adv_info_parse(const uint8_t *mfg_data, int len, struct mesh_adv_info *info);
+
+int
+mesh_adv_reading_encode(const struct mesh_adv_reading *reading, uint8_t *buf, int len);
+
+int
+mesh_adv_reading_parse(const uint8_t *mfg_data, int len, struct mesh_adv_reading *reading);
+
+#endif //MESH_ADV_H
@@ -0,0 +1,204 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "host/ble_hs.h"
+#include "services/gap/ble_svc_gap.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_adv_bearer.h"
+#include "mesh_node.h"
+#include "mesh_time.h"
+
+/**
+ * Sensor readings carried in non-connectable advertisements. A reading fits in one advertisement, so a provisioned
+ * leaf can broadcast it and go back to sleep without connecting, discovering and waiting for the hub to ask. Nodes
+ * that hear a reading while scanning re-advertise it until its ttl runs out, and the hub collects them by scanning.
+ * The connected path stays in use for everything else, see mesh_adv_bearer_gatt_wake().
+ */
+static struct mesh_adv_reading bearer_queue[ADV_BEARER_QUEUE_SIZE];
+static int bearer_queue_len;
+
+/* Readings we have seen, by source and seq. */
+static uint16_t bearer_seen[ADV_BEARER_DEDUP_SIZE];
+static int bearer_seen_next;
+
+RTC_DATA_ATTR static uint8_t bearer_seq;
+
+/* Children connected to us on the last wake the mesh connected on, so we stay up to relay their readings. */
+RTC_DATA_ATTR static bool bearer_relay;
+
+/* Whether other nodes may be broadcasting readings this wake, see mesh_adv_bearer_readings_expected. */
+static bool bearer_readings_expected = true;
+
+/**
+ * Returns whether this wake should go the connected way. Wakes are counted in mesh time, rounded to the nearest
+ * multiple of the wake period, so every node agrees on which wakes connect. The count restarts when mesh time wraps,
+ * which shortens one gap every 49 days on the whole mesh alike. Relays connect on every wake: the leaves below them
+ * broadcast, and their readings only get further than the hub can hear if a relay is up listening.
+ */
+bool
+mesh_adv_bearer_gatt_wake(uint8_t node_id, uint32_t period_ms) {
+    bool mesh_connects;
+    uint32_t wake;
+
+    /* Without mesh time we can't tell which wakes the rest of the mesh connects on. */
+    if (!mesh_time_synced()) {
+        bearer_readings_expected = true;
+        return true;
+    }
+
+    wake = (mesh_time_now_ms() + period_ms / 2) / period_ms;
+    mesh_connects = wake % ADV_BEARER_GATT_WAKE_EVERY == 0;
+    bearer_readings_expected = !mesh_connects;
+
+    /* Without an id from the hub our readings couldn't be told apart. */
+    if (node_id <= PROVISIONAL_NODE_ID) {
+        return true;
+    }
+
+    if (mesh_connects) {
+        /* Whether we are still a relay is learned again, see mesh_adv_bearer_child_connected. */
+        bearer_relay = false;
+        return true;
+    }
+
+    return bearer_relay;
+}
+
+void
+mesh_adv_bearer_child_connected() {
+    bearer_relay = true;
+}
+
+/**
+ * Returns whether other nodes may be broadcasting readings this wake: on the wakes the mesh doesn't connect on, or
+ * on any wake if we can't tell which those are. Only valid once mesh_adv_bearer_gatt_wake was called for the wake.
+ */
+bool
+mesh_adv_bearer_readings_expected() {
+    return bearer_readings_expected;
+}
+
+static bool
+mab_seen(const struct mesh_adv_reading *reading) {
+    uint16_t key = reading->source << 8 | reading->seq;
+    int i;
+
+    for (i = 0; i < ADV_BEARER_DEDUP_SIZE; i++) {
+        if (bearer_seen[i] == key) {
+            return true;
+        }
+    }
+
+    bearer_seen[bearer_seen_next] = key;
+    bearer_seen_next = (bearer_seen_next + 1) % ADV_BEARER_DEDUP_SIZE;
+    return false;
+}
+
+static int
+mab_enqueue(const struct mesh_adv_reading *reading) {
+    if (bearer_queue_len == ADV_BEARER_QUEUE_SIZE) {
+        return BLE_HS_ENOMEM;
+    }
+
+    bearer_queue[bearer_queue_len++] = *reading;
+    return 0;
+}
+
+/**
+ * Queues one of our own readings for broadcasting.
+ */
+int
+mesh_adv_bearer_send(uint8_t source, uint8_t type, uint32_t value) {
+    struct mesh_adv_reading reading;
+
+    reading.source = source;
+    reading.seq = bearer_seq++;
+    reading.ttl = ADV_BEARER_TTL;
+    reading.type = type;
+    reading.value = value;
+
+    /* Don't relay our own reading when a neighbor echoes it back. */
+    mab_seen(&reading);
+    return mab_enqueue(&reading);
+}
+
+/**
+ * Handles a reading heard while scanning, queueing it to be relayed if it hasn't been seen yet and may go further.
+ */
+void
+mesh_adv_bearer_received(const struct mesh_adv_reading *reading, uint8_t node_id) {
+    struct mesh_adv_reading relay;
+
+    if (reading->source == node_id || mab_seen(reading)) {
+        return;
+    }
+
+    LOGD("Heard reading type 0x%02x from node %d; seq=%d ttl=%d", reading->type, reading->source, reading->seq,
+         reading->ttl);
+    if (reading->ttl <= 1) {
+        return;
+    }
+
+    relay = *reading;
+    relay.ttl--;
+    if (mab_enqueue(&relay) != 0) {
+        LOGW("Relay queue full, dropping reading from node %d", reading->source);
+    }
+}
+
+bool
+mesh_adv_bearer_pending() {
+    return bearer_queue_len > 0;
+}
+
+/**
+ * Advertises the oldest queued reading for ADV_BEARER_BURST_MS. The caller gets BLE_GAP_EVENT_ADV_COMPLETE when it is
+ * done, and BLE_HS_ENOENT if there is nothing to send.
+ */
+int
+mesh_adv_bearer_start(uint8_t own_addr_type, ble_gap_event_fn *gap_event_cb) {
+    struct ble_gap_adv_params adv_params;
+    struct ble_hs_adv_fields fields;
+    uint8_t mfg_data[MESH_ADV_READING_LEN];
+    const char *name;
+    int rc;
+
+    if (bearer_queue_len == 0) {
+        return BLE_HS_ENOENT;
+    }
+
+    memset(&fields, 0, sizeof fields);
+    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+
+    /* Scanners only look at advertisers with our name. */
+    name = ble_svc_gap_device_name();
+    fields.name = (uint8_t *) name;
+    fields.name_len = strlen(name);
+    fields.name_is_complete = 1;
+
+    fields.mfg_data = mfg_data;
+    fields.mfg_data_len = mesh_adv_reading_encode(&bearer_queue[0], mfg_data, sizeof mfg_data);
+
+    rc = ble_gap_adv_set_fields(&fields);
+    if (rc != 0) {
+        LOGE("error setting reading advertisement data; rc=%d\n", rc);
+        return rc;
+    }
+
+    memset(&adv_params, 0, sizeof adv_params);
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_NON;
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = ADV_BEARER_ITVL;
+    adv_params.itvl_max = ADV_BEARER_ITVL;
+
+    LOGI("Broadcasting reading type 0x%02x from node %d; seq=%d ttl=%d", bearer_queue[0].type,
+         bearer_queue[0].source, bearer_queue[0].seq, bearer_queue[0].ttl);
+    rc = ble_gap_adv_start(own_addr_type, NULL, ADV_BEARER_BURST_MS, &adv_params, gap_event_cb, NULL);
+    if (rc != 0) {
+        LOGE("error enabling reading advertisement; rc=%d\n", rc);
+        return rc;
+    }
+
+    bearer_queue_len--;
+    memmove(bearer_queue, bearer_queue + 1, bearer_queue_len * sizeof bearer_queue[0]);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdbool.h>
+#include "host/ble_gap.h"
+#include "mesh_adv.h"
+
+#ifndef MESH_ADV_BEARER_H
+#define MESH_ADV_BEARER_H
+
+/* How long each reading is advertised for, at the fastest non-connectable interval (100 ms, in 0.625 ms units). */
+#define ADV_BEARER_BURST_MS 300
+#define ADV_BEARER_ITVL 160
+
+/* Hops a broadcast reading may be relayed over. */
+#define ADV_BEARER_TTL 3
+
+#define ADV_BEARER_QUEUE_SIZE 8
+#define ADV_BEARER_DEDUP_SIZE 16
+
+/* Every this many wakes the mesh still connects, so the hub can reach its nodes for control and OTA. */
+#define ADV_BEARER_GATT_WAKE_EVERY 10
+
+bool
+mesh_adv_bearer_gatt_wake(uint8_t node_id, uint32_t period_ms);
+
+void
+mesh_adv_bearer_child_connected();
+
+bool
+mesh_adv_bearer_readings_expected();
+
+int
+mesh_adv_bearer_send(uint8_t source, uint8_t type, uint32_t value);
+
+void
+mesh_adv_bearer_received(const struct mesh_adv_reading *reading, uint8_t node_id);
+
+bool
+mesh_adv_bearer_pending();
+
+int
+mesh_adv_bearer_start(uint8_t own_addr_type, ble_gap_event_fn *gap_event_cb);
+
+#endif //MESH_ADV_BEARER_H
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <string.h>
+#include "host/ble_hs.h"
+#include "host/ble_l2cap.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_coc.h"
+
+/**
+ * Connection oriented channel transport between mesh nodes. Compared to GATT writes it has no per operation ATT
+ * round trip and the peer paces us through credits, which is what bulk transfers need. It is optional: the hub
+ * doesn't open one and packets fall back to GATT whenever the channel can't take more data.
+ */
+
+static void *coc_rx_mem;
+static struct os_mempool coc_rx_pool;
+static struct os_mbuf_pool coc_rx_mbuf_pool;
+
+/* SDUs are flattened here before their frames are handed to the node, the host task is the only user. */
+static uint8_t coc_rx_buf[COC_MTU];
+
+static int mcoc_event(struct ble_l2cap_event *event, void *arg);
+static void mcoc_release(struct mesh_peer *peer);
+
+static int
+mcoc_recv_ready(struct ble_l2cap_chan *chan) {
+    struct os_mbuf *sdu_rx;
+
+    sdu_rx = os_mbuf_get_pkthdr(&coc_rx_mbuf_pool, 0);
+    if (sdu_rx == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+
+    return ble_l2cap_recv_ready(chan, sdu_rx);
+}
+
+/**
+ * Hands the queued SDU to the stack unless the channel is waiting for credits, in which case it is sent once the
+ * channel unstalls.
+ *
+ * @return 0 if the SDU was taken or stays queued, otherwise the stack's error. The SDU and every packet framed into it
+ *         are gone then.
+ */
+static int
+mcoc_flush(struct mesh_peer *peer) {
+    int rc;
+
+    if (peer->coc_tx_queue == NULL || peer->coc_stalled) {
+        return 0;
+    }
+
+    rc = ble_l2cap_send(peer->coc_chan, peer->coc_tx_queue);
+    switch (rc) {
+        case 0:
+            peer->coc_tx_queue = NULL;
+            return 0;
+        case BLE_HS_ESTALLED:
+            // The stack holds on to the SDU and sends the rest of it when credits arrive.
+            peer->coc_tx_queue = NULL;
+            peer->coc_stalled = true;
+            return 0;
+        case BLE_HS_EBUSY:
+            // A previous SDU is still going out, keep queueing behind it.
+            peer->coc_stalled = true;
+            return 0;
+        case BLE_HS_EBADDATA:
+            // Rejected before the stack took it, so the SDU is still ours to free.
+            LOGE("Peer with handle %d rejected SDU of %d bytes", peer->conn_handle, OS_MBUF_PKTLEN(peer->coc_tx_queue));
+            os_mbuf_free_chain(peer->coc_tx_queue);
+            peer->coc_tx_queue = NULL;
+            return rc;
+        default:
+            // The stack took the SDU and freed it when sending failed.
+            LOGE("Failed to send SDU to peer with handle %d; rc=%d", peer->conn_handle, rc);
+            peer->coc_tx_queue = NULL;
+            return rc;
+    }
+}
+
+/**
+ * Queues a packed packet on the peer's channel. While the channel is stalled packets are framed into the same SDU,
+ * so a burst goes out in as few SDUs as possible.
+ *
+ * Returns 0 if the channel took the packet, anything else has the packet fall back to GATT.
+ */
+static int
+mcoc_send(struct mesh_peer *peer, const uint8_t *packed_data, uint16_t packed_len) {
+    uint8_t frame_hdr[COC_FRAME_HDR_SIZE];
+    int rc;
+
+    if (peer->coc_chan == NULL) {
+        return BLE_HS_ENOTCONN;
+    }
+
+    if (peer->coc_tx_queue != NULL &&
+        OS_MBUF_PKTLEN(peer->coc_tx_queue) + COC_FRAME_HDR_SIZE + packed_len > COC_MTU) {
+        if (mcoc_flush(peer) != 0) {
+            // Only packets queued earlier were lost, this one goes into a new SDU.
+            mesh_peer_link_record(peer, false);
+        }
+        if (peer->coc_tx_queue != NULL) {
+            return BLE_HS_EBUSY;
+        }
+    }
+
+    if (peer->coc_tx_queue == NULL) {
+        peer->coc_tx_queue = os_msys_get_pkthdr(0, 0);
+        if (peer->coc_tx_queue == NULL) {
+            return BLE_HS_ENOMEM;
+        }
+    }
+
+    put_le16(frame_hdr, packed_len);
+    rc = os_mbuf_append(peer->coc_tx_queue, frame_hdr, COC_FRAME_HDR_SIZE);
+    if (rc == 0) {
+        rc = os_mbuf_append(peer->coc_tx_queue, packed_data, packed_len);
+    }
+    if (rc != 0) {
+        // Out of mbufs part way through a frame, drop the whole SDU rather than send a torn one.
+        os_mbuf_free_chain(peer->coc_tx_queue);
+        peer->coc_tx_queue = NULL;
+        return BLE_HS_ENOMEM;
+    }
+
+    // This packet went down with the SDU if the flush failed, so it falls back to GATT.
+    return mcoc_flush(peer);
+}
+
+static uint16_t
+mcoc_mtu(const struct mesh_peer *peer) {
+    return COC_MTU - COC_FRAME_HDR_SIZE;
+}
+
+const struct mesh_transport mesh_transport_coc = {
+        .name = "l2cap-coc",
+        .send = mcoc_send,
+        .mtu = mcoc_mtu,
+        .fallback = &mesh_transport_gatt_write,
+};
+
+static void
+mcoc_receive(uint16_t conn_handle, struct os_mbuf *sdu_rx) {
+    uint16_t sdu_len;
+    uint16_t frame_len;
+    uint16_t off;
+    int rc;
+
+    rc = ble_hs_mbuf_to_flat(sdu_rx, coc_rx_buf, sizeof coc_rx_buf, &sdu_len);
+    if (rc != 0) {
+        LOGE("Dropping oversized SDU from peer with handle %d", conn_handle);
+        return;
+    }
+
+    off = 0;
+    while (off + COC_FRAME_HDR_SIZE <= sdu_len) {
+        frame_len = get_le16(coc_rx_buf + off);
+        off += COC_FRAME_HDR_SIZE;
+        if (off + frame_len > sdu_len) {
+            LOGE("Truncated frame in SDU from peer with handle %d", conn_handle);
+            return;
+        }
+
+        mesh_transport_received(conn_handle, coc_rx_buf + off, frame_len);
+        off += frame_len;
+    }
+}
+
+static void
+mcoc_connected(uint16_t conn_handle, struct ble_l2cap_chan *chan) {
+    struct mesh_peer *peer;
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer == NULL) {
+        ble_l2cap_disconnect(chan);
+        return;
+    }
+
+    peer->coc_chan = chan;
+    peer->coc_stalled = false;
+    peer->transport = &mesh_transport_coc;
+
+    LOGI("Data channel to peer with handle %d is open", conn_handle);
+}
+
+static int
+mcoc_event(struct ble_l2cap_event *event, void *arg) {
+    struct mesh_peer *peer;
+
+    switch (event->type) {
+        case BLE_L2CAP_EVENT_COC_CONNECTED:
+            if (event->connect.status != 0) {
+                // The peer doesn't have the channel, GATT keeps carrying its packets.
+                LOGI("Data channel to peer with handle %d not available; status=%d",
+                     event->connect.conn_handle, event->connect.status);
+                return 0;
+            }
+            mcoc_connected(event->connect.conn_handle, event->connect.chan);
+            return 0;
+
+        case BLE_L2CAP_EVENT_COC_DISCONNECTED:
+            LOGI("Data channel to peer with handle %d closed", event->disconnect.conn_handle);
+            peer = mesh_peer_find(event->disconnect.conn_handle);
+            if (peer != NULL) {
+                mcoc_release(peer);
+            }
+            return 0;
+
+        case BLE_L2CAP_EVENT_COC_ACCEPT:
+            return mcoc_recv_ready(event->accept.chan);
+
+        case BLE_L2CAP_EVENT_COC_DATA_RECEIVED:
+            if (event->receive.sdu_rx != NULL) {
+                mcoc_receive(event->receive.conn_handle, event->receive.sdu_rx);
+                os_mbuf_free_chain(event->receive.sdu_rx);
+            }
+            return mcoc_recv_ready(event->receive.chan);
+
+        case BLE_L2CAP_EVENT_COC_TX_UNSTALLED:
+            peer = mesh_peer_find(event->tx_unstalled.conn_handle);
+            if (peer != NULL) {
+                peer->coc_stalled = false;
+                if (mcoc_flush(peer) != 0) {
+                    // The packets queued while stalled are lost, custody resends the ones that matter.
+                    mesh_peer_link_record(peer, false);
+                }
+            }
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Opens the data channel to a node once discovery is done. Only the central opens it so both ends don't race to
+ * set up two channels on the same connection.
+ */
+int
+mesh_coc_connect(struct mesh_peer *peer) {
+    struct ble_gap_conn_desc desc;
+    struct os_mbuf *sdu_rx;
+    int rc;
+
+    if (peer->role != MESH_PEER_ROLE_NODE || peer->coc_chan != NULL) {
+        return 0;
+    }
+
+    rc = ble_gap_conn_find(peer->conn_handle, &desc);
+    if (rc != 0 || desc.role != BLE_GAP_ROLE_MASTER) {
+        return rc;
+    }
+
+    sdu_rx = os_mbuf_get_pkthdr(&coc_rx_mbuf_pool, 0);
+    if (sdu_rx == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+
+    rc = ble_l2cap_connect(peer->conn_handle, COC_PSM, COC_MTU, sdu_rx, mcoc_event, NULL);
+    if (rc != 0) {
+        LOGW("Failed to open data channel to peer with handle %d; rc=%d", peer->conn_handle, rc);
+        os_mbuf_free_chain(sdu_rx);
+    }
+    return rc;
+}
+
+/**
+ * Forgets the peer's channel and drops whatever was still queued on it. Custody resends what mattered.
+ */
+static void
+mcoc_release(struct mesh_peer *peer) {
+    if (peer->coc_tx_queue != NULL) {
+        os_mbuf_free_chain(peer->coc_tx_queue);
+        peer->coc_tx_queue = NULL;
+    }
+    peer->coc_chan = NULL;
+    peer->coc_stalled = false;
+    peer->transport = NULL;
+}
+
+int
+mesh_coc_init() {
+    int rc;
+
+    coc_rx_mem = malloc(OS_MEMPOOL_BYTES(COC_RX_BUF_COUNT, COC_MTU));
+    if (coc_rx_mem == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+
+    rc = os_mempool_init(&coc_rx_pool, COC_RX_BUF_COUNT, COC_MTU, coc_rx_mem, "coc_rx_pool");
+    if (rc != 0) {
+        goto err;
+    }
+
+    rc = os_mbuf_pool_init(&coc_rx_mbuf_pool, &coc_rx_pool, COC_MTU, COC_RX_BUF_COUNT);
+    if (rc != 0) {
+        goto err;
+    }
+
+    rc = ble_l2cap_create_server(COC_PSM, COC_MTU, mcoc_event, NULL);
+    if (rc != 0) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    free(coc_rx_mem);
+    coc_rx_mem = NULL;
+    return rc;
+}
@@ -0,0 +1,27 @@
+#include "mesh_peer.h"
+#include "mesh_transport.h"
+
+#ifndef MESH_COC_H
+#define MESH_COC_H
+
+/* LE protocol/service multiplexer of the mesh data channel, from the dynamic range. */
+#define COC_PSM 0x0080
+
+/* Largest SDU either end accepts. An SDU carries as many framed packets as fit. */
+#define COC_MTU 512
+
+/* Receive SDU buffers. A full SDU spills into a second buffer once the mbuf headers are taken off. */
+#define COC_RX_BUF_COUNT (2 * MYNEWT_VAL(BLE_MAX_CONNECTIONS))
+
+/* Each packet in an SDU is preceded by its length. */
+#define COC_FRAME_HDR_SIZE 2
+
+extern const struct mesh_transport mesh_transport_coc;
+
+int
+mesh_coc_init();
+
+int
+mesh_coc_connect(struct mesh_peer *peer);
+
+#endif //MESH_COC_H
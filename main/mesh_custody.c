@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_custody.h"
+#include "mesh_node.h"
+
+struct mesh_custody_entry {
+    bool in_use;
+    uint8_t packed_len;
+    uint8_t packed[DATA_PACKET_MAX_SIZE];
+
+    /** The hop that handed us the packet. It already has it, so we don't send it back there. */
+    uint16_t from_conn_handle;
+
+    /** The parents we last handed the packet to, most recent first. Only their acks release it. */
+    uint16_t sent_to[CUSTODY_MAX_NEXT_HOPS];
+
+    /** When the packet reached us, so the time it spends with us can be taken off its deadline when it is sent. */
+    TickType_t stored_at;
+    uint16_t deadline_ms;
+};
+
+/**
+ * The custody queue lives in RTC memory so that packets we accepted but couldn't pass on before the mesh went to
+ * sleep are still here to deliver on the next wake.
+ */
+RTC_DATA_ATTR static struct mesh_custody_entry custody_entries[CUSTODY_MAX_PACKETS];
+
+static struct mesh_custody_entry *
+mc_find(uint8_t source, uint8_t idempotency_key) {
+    struct mesh_custody_entry *entry;
+    int i;
+
+    for (i = 0; i < CUSTODY_MAX_PACKETS; i++) {
+        entry = &custody_entries[i];
+        if (entry->in_use &&
+            entry->packed[DATA_PACKET_SRC_IDX] == source &&
+            entry->packed[DATA_PACKET_IDEMPOTENCY_KEY_IDX] == idempotency_key) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+mc_forget_next_hops(struct mesh_custody_entry *entry) {
+    int i;
+
+    for (i = 0; i < CUSTODY_MAX_NEXT_HOPS; i++) {
+        entry->sent_to[i] = BLE_HS_CONN_HANDLE_NONE;
+    }
+}
+
+static struct mesh_custody_entry *
+mc_find_free() {
+    int i;
+
+    for (i = 0; i < CUSTODY_MAX_PACKETS; i++) {
+        if (!custody_entries[i].in_use) {
+            return &custody_entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Stores a copy of the packet until the next hop acknowledges it.
+ *
+ * @return 0 on success, BLE_HS_EALREADY if we already hold the packet or BLE_HS_ENOMEM if the queue is full, in which
+ *         case custody must not be acknowledged so the previous hop keeps it.
+ */
+int
+mesh_custody_store(struct mesh_data_packet *packet, uint16_t from_conn_handle, TickType_t received_at) {
+    struct mesh_custody_entry *entry;
+
+    if (mc_find(packet->source, packet->idempotency_key) != NULL) {
+        return BLE_HS_EALREADY;
+    }
+
+    entry = mc_find_free();
+    if (entry == NULL) {
+        LOGW("Custody queue is full, refusing custody of packet from %d", packet->source);
+        return BLE_HS_ENOMEM;
+    }
+
+    mdp_pack(entry->packed, &entry->packed_len, DATA_PACKET_MAX_SIZE, packet);
+    entry->from_conn_handle = from_conn_handle;
+    mc_forget_next_hops(entry);
+    entry->stored_at = received_at;
+    entry->deadline_ms = packet->deadline_ms;
+    entry->in_use = true;
+
+    LOGD("Took custody of packet; source=%d key=%d", packet->source, packet->idempotency_key);
+    return 0;
+}
+
+/**
+ * Remembers that a packet in custody was handed to the peer, so that the peer's custody ack will be taken.
+ *
+ * @return 0 on success, BLE_HS_ENOENT if we don't hold the packet.
+ */
+int
+mesh_custody_handed_to(uint8_t source, uint8_t idempotency_key, uint16_t conn_handle) {
+    struct mesh_custody_entry *entry;
+    int i;
+
+    entry = mc_find(source, idempotency_key);
+    if (entry == NULL) {
+        return BLE_HS_ENOENT;
+    }
+
+    for (i = 0; i < CUSTODY_MAX_NEXT_HOPS - 1; i++) {
+        if (entry->sent_to[i] == conn_handle) {
+            break;
+        }
+    }
+    for (; i > 0; i--) {
+        entry->sent_to[i] = entry->sent_to[i - 1];
+    }
+    entry->sent_to[0] = conn_handle;
+    return 0;
+}
+
+/**
+ * Releases custody of a packet once the peer took it over.
+ *
+ * @return 0 on success, BLE_HS_ENOENT if we don't hold the packet or BLE_HS_EINVAL if it was never handed to the peer,
+ *         in which case we keep it.
+ */
+int
+mesh_custody_release(uint8_t source, uint8_t idempotency_key, uint16_t conn_handle) {
+    struct mesh_custody_entry *entry;
+    int i;
+
+    entry = mc_find(source, idempotency_key);
+    if (entry == NULL) {
+        return BLE_HS_ENOENT;
+    }
+
+    for (i = 0; i < CUSTODY_MAX_NEXT_HOPS; i++) {
+        if (entry->sent_to[i] == conn_handle) {
+            LOGD("Released custody of packet; source=%d key=%d", source, idempotency_key);
+            entry->in_use = false;
+            return 0;
+        }
+    }
+
+    LOGW("Ignoring custody ack from conn handle %d for packet from %d we didn't hand it", conn_handle, source);
+    return BLE_HS_EINVAL;
+}
+
+/**
+ * Time left on an entry's deadline, entries without one sort after all others.
+ */
+static uint32_t
+mc_time_left(const struct mesh_custody_entry *entry, TickType_t now) {
+    uint32_t elapsed_ms;
+
+    if (entry->deadline_ms == 0) {
+        return UINT32_MAX;
+    }
+
+    elapsed_ms = (now - entry->stored_at) * portTICK_PERIOD_MS;
+    return elapsed_ms >= entry->deadline_ms ? 0 : entry->deadline_ms - elapsed_ms;
+}
+
+/**
+ * Takes the time an entry has spent with us off its deadline and hands it to the send function, or drops it if it can
+ * no longer make it.
+ */
+static void
+mc_deliver_entry(struct mesh_custody_entry *entry, TickType_t now, mesh_custody_send_fn *send_fn) {
+    struct mesh_data_packet packet;
+
+    mdp_unpack(entry->packed, entry->packed_len, &packet);
+    if (mdp_age_deadline(&packet, (now - entry->stored_at) * portTICK_PERIOD_MS, DEADLINE_MIN_HOP_BUDGET_MS)) {
+        send_fn(&packet, entry->from_conn_handle);
+    } else {
+        LOGI("Dropping packet from %d in custody, it can no longer make its deadline", packet.source);
+        entry->in_use = false;
+    }
+    free(packet.data);
+}
+
+/**
+ * Hands every packet we hold custody of to the send function, earliest deadline first. Packets whose deadline has
+ * passed are dropped instead of spending airtime on them. Entries stay queued until released by a custody ack.
+ */
+void
+mesh_custody_deliver(mesh_custody_send_fn *send_fn) {
+    bool sent[CUSTODY_MAX_PACKETS] = {false};
+    TickType_t now;
+    uint32_t time_left;
+    uint32_t best_time_left;
+    int best;
+    int i;
+
+    now = xTaskGetTickCount();
+    for (;;) {
+        best = -1;
+        best_time_left = 0;
+        for (i = 0; i < CUSTODY_MAX_PACKETS; i++) {
+            if (!custody_entries[i].in_use || sent[i]) {
+                continue;
+            }
+            time_left = mc_time_left(&custody_entries[i], now);
+            if (best < 0 || time_left < best_time_left) {
+                best = i;
+                best_time_left = time_left;
+            }
+        }
+        if (best < 0) {
+            return;
+        }
+
+        sent[best] = true;
+        mc_deliver_entry(&custody_entries[best], now, send_fn);
+    }
+}
+
+/**
+ * Hands a single packet we hold custody of to the send function, the same way mesh_custody_deliver does.
+ *
+ * @return 0 if the packet was handed over or dropped as late, BLE_HS_ENOENT if we don't hold it.
+ */
+int
+mesh_custody_deliver_packet(uint8_t source, uint8_t idempotency_key, mesh_custody_send_fn *send_fn) {
+    struct mesh_custody_entry *entry;
+
+    entry = mc_find(source, idempotency_key);
+    if (entry == NULL) {
+        return BLE_HS_ENOENT;
+    }
+
+    mc_deliver_entry(entry, xTaskGetTickCount(), send_fn);
+    return 0;
+}
+
+uint8_t
+mesh_custody_count() {
+    uint8_t count = 0;
+    int i;
+
+    for (i = 0; i < CUSTODY_MAX_PACKETS; i++) {
+        if (custody_entries[i].in_use) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void
+mesh_custody_init() {
+    int i;
+
+    /* Connection handles from before we slept mean nothing now. Only requests carry a deadline, their originator
+     * resends them on this wake and the response to the old copy would find nobody waiting. Everything else is
+     * delivered. */
+    for (i = 0; i < CUSTODY_MAX_PACKETS; i++) {
+        custody_entries[i].from_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        mc_forget_next_hops(&custody_entries[i]);
+        custody_entries[i].stored_at = 0;
+        if (custody_entries[i].deadline_ms > 0) {
+            custody_entries[i].in_use = false;
+        }
+    }
+
+    if (mesh_custody_count() > 0) {
+        LOGI("Woke up holding custody of %d packets", mesh_custody_count());
+    }
+}
@@ -0,0 +1,36 @@
+#include "freertos/FreeRTOS.h"
+#include "mesh_data_packet.h"
+
+#ifndef MESH_CUSTODY_H
+#define MESH_CUSTODY_H
+
+/* Upstream packets this node holds custody of until the next hop takes them. Kept in RTC memory. */
+#define CUSTODY_MAX_PACKETS 8
+
+/* Next hops remembered per packet in custody, only these can take custody of it from us. */
+#define CUSTODY_MAX_NEXT_HOPS 2
+
+typedef void mesh_custody_send_fn(struct mesh_data_packet *packet, uint16_t from_conn_handle);
+
+void
+mesh_custody_init();
+
+int
+mesh_custody_store(struct mesh_data_packet *packet, uint16_t from_conn_handle, TickType_t received_at);
+
+int
+mesh_custody_handed_to(uint8_t source, uint8_t idempotency_key, uint16_t conn_handle);
+
+int
+mesh_custody_release(uint8_t source, uint8_t idempotency_key, uint16_t conn_handle);
+
+void
+mesh_custody_deliver(mesh_custody_send_fn *send_fn);
+
+int
+mesh_custody_deliver_packet(uint8_t source, uint8_t idempotency_key, mesh_custody_send_fn *send_fn);
+
+uint8_t
+mesh_custody_count();
+
+#endif //MESH_CUSTODY_H
@@ -1,4 +1,6 @@
 #include "mesh_data_packet.h"
+#include <assert.h>
+#include <stdlib.h>
 #include <esp_log.h>
 #include <memory.h>
 #include "mesh_sensor_constants.h"
@@ -19,11 +21,70 @@ void mdp_pack(uint8_t *packed_buf, uint8_t *packed_data_len, uint8_t allocated_p
 
     *packed_data_len = DATA_PACKET_DATA_IDX + packet->data_length;
 
+    if (packet->ack_count > 0) {
+        packed_buf[*packed_data_len] = DATA_PACKET_OPT_ACKS;
+        packed_buf[*packed_data_len + DATA_PACKET_OPT_TAG_SIZE] = packet->ack_count;
+        memcpy(packed_buf + *packed_data_len + DATA_PACKET_OPT_HDR_SIZE, packet->acks, packet->ack_count);
+        *packed_data_len += DATA_PACKET_OPT_HDR_SIZE + packet->ack_count;
+    }
+
+    if (packet->deadline_ms > 0) {
+        packed_buf[*packed_data_len] = DATA_PACKET_OPT_DEADLINE;
+        packed_buf[*packed_data_len + DATA_PACKET_OPT_TAG_SIZE] = DATA_PACKET_DEADLINE_SIZE;
+        memcpy(packed_buf + *packed_data_len + DATA_PACKET_OPT_HDR_SIZE, &packet->deadline_ms,
+               DATA_PACKET_DEADLINE_SIZE);
+        *packed_data_len += DATA_PACKET_OPT_HDR_SIZE + DATA_PACKET_DEADLINE_SIZE;
+    }
+
+    if (packet->mesh_time_ms > 0) {
+        packed_buf[*packed_data_len] = DATA_PACKET_OPT_MESH_TIME;
+        packed_buf[*packed_data_len + DATA_PACKET_OPT_TAG_SIZE] = DATA_PACKET_MESH_TIME_SIZE;
+        memcpy(packed_buf + *packed_data_len + DATA_PACKET_OPT_HDR_SIZE, &packet->mesh_time_ms,
+               DATA_PACKET_MESH_TIME_SIZE);
+        *packed_data_len += DATA_PACKET_OPT_HDR_SIZE + DATA_PACKET_MESH_TIME_SIZE;
+    }
+
     mdp_print_packed_packet(packed_buf, *packed_data_len, allocated_packed_data_len);
 }
 
-void mdp_unpack(uint8_t *packed_buf, struct mesh_data_packet *packet) {
+static void mdp_unpack_opts(uint8_t *packed_buf, uint16_t idx, uint16_t packed_len, struct mesh_data_packet *packet) {
+    uint8_t tag;
+    uint8_t len;
+
+    while (idx + DATA_PACKET_OPT_HDR_SIZE <= packed_len) {
+        tag = packed_buf[idx];
+        len = packed_buf[idx + DATA_PACKET_OPT_TAG_SIZE];
+        idx += DATA_PACKET_OPT_HDR_SIZE;
+        if (idx + len > packed_len) {
+            LOGW("Truncated option in packed packet; tag=%d len=%d", tag, len);
+            return;
+        }
+
+        switch (tag) {
+            case DATA_PACKET_OPT_ACKS:
+                packet->ack_count = len < DATA_PACKET_MAX_ACKS ? len : DATA_PACKET_MAX_ACKS;
+                memcpy(packet->acks, packed_buf + idx, packet->ack_count);
+                break;
+            case DATA_PACKET_OPT_DEADLINE:
+                if (len == DATA_PACKET_DEADLINE_SIZE) {
+                    memcpy(&packet->deadline_ms, packed_buf + idx, DATA_PACKET_DEADLINE_SIZE);
+                }
+                break;
+            case DATA_PACKET_OPT_MESH_TIME:
+                if (len == DATA_PACKET_MESH_TIME_SIZE) {
+                    memcpy(&packet->mesh_time_ms, packed_buf + idx, DATA_PACKET_MESH_TIME_SIZE);
+                }
+                break;
+            default:
+                /* Unknown options are skipped so newer senders can still talk to us. */
+                LOGD("Skipping unknown packet option; tag=%d", tag);
+                break;
+        }
+        idx += len;
+    }
+}
 
+void mdp_unpack(uint8_t *packed_buf, uint16_t packed_len, struct mesh_data_packet *packet) {
 
     memcpy(&packet->source, packed_buf + DATA_PACKET_SRC_IDX, DATA_PACKET_SRC_SIZE);
     memcpy(&packet->dest, packed_buf + DATA_PACKET_DST_IDX, DATA_PACKET_DST_SIZE);
@@ -34,6 +95,11 @@ void mdp_unpack(uint8_t *packed_buf, struct mesh_data_packet *packet) {
     packet->data = (uint8_t *) malloc((packet->data_length) * SOB);
     memcpy(packet->data, packed_buf + DATA_PACKET_DATA_IDX, packet->data_length);
 
+    packet->ack_count = 0;
+    packet->deadline_ms = 0;
+    packet->mesh_time_ms = 0;
+    mdp_unpack_opts(packed_buf, DATA_PACKET_DATA_IDX + packet->data_length, packed_len, packet);
+
     mdp_print_packet(packet);
 }
 
@@ -41,6 +107,16 @@ void mdp_print_packet(struct mesh_data_packet *packet) {
     LOGI_("\nMesh Data Packet Info: \n  source: 0x%02x\n  dest: 0x%02x\n  ttl: 0x%02x\n  idempotency key: 0x%02x\n  data type: 0x%02x\n  data length: %d\n  data: ",
           packet->source, packet->dest, packet->ttl, packet->idempotency_key, packet->type, packet->data_length);
     mesh_print_bytes(packet->data, packet->data_length);
+    if (packet->ack_count > 0) {
+        LOGI__("\n  acks: ");
+        mesh_print_bytes(packet->acks, packet->ack_count);
+    }
+    if (packet->deadline_ms > 0) {
+        LOGI__("\n  deadline: %d ms", packet->deadline_ms);
+    }
+    if (packet->mesh_time_ms > 0) {
+        LOGI__("\n  mesh time: %u ms", packet->mesh_time_ms);
+    }
     LOGI__("\n");
 }
 
@@ -100,3 +176,40 @@ mdp_cmp(struct mesh_data_packet *packet1, struct mesh_data_packet *packet2) {
         return 1;
 }
 
+
+/**
+ * Takes the time a packet spent with us off its deadline.
+ *
+ * @return false if the packet has less than min_remaining_ms left and should be dropped rather than sent on.
+ */
+bool
+mdp_age_deadline(struct mesh_data_packet *packet, uint32_t elapsed_ms, uint16_t min_remaining_ms) {
+    if (packet->deadline_ms == 0) {
+        return true;
+    }
+
+    if (elapsed_ms + min_remaining_ms >= packet->deadline_ms) {
+        LOGD("Packet from %d with key %d is past its deadline", packet->source, packet->idempotency_key);
+        return false;
+    }
+
+    packet->deadline_ms -= elapsed_ms;
+    return true;
+}
+
+/**
+ * Adds the time a packet spent with us to the hub's clock it carries, so the next hop syncs to the hub's clock as it
+ * is when the packet leaves us rather than when the hub sent it.
+ */
+void
+mdp_age_mesh_time(struct mesh_data_packet *packet, uint32_t elapsed_ms) {
+    if (packet->mesh_time_ms == 0) {
+        return;
+    }
+
+    packet->mesh_time_ms += elapsed_ms;
+    if (packet->mesh_time_ms == 0) {
+        // 0 means unstamped, stay a millisecond off rather than lose the stamp when the clock wraps.
+        packet->mesh_time_ms = 1;
+    }
+}
@@ -3,6 +3,7 @@
 
 #include <stdint-gcc.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /* Size of byte */
 #define SOB sizeof(uint8_t)
@@ -24,7 +25,30 @@
 #define DATA_PACKET_DATA_IDX        (DATA_PACKET_DATA_LEN_IDX + DATA_PACKET_DATA_LEN_SIZE)
 
 #define DATA_PACKET_MIN_SIZE (DATA_PACKET_DATA_IDX + SOB)
-#define DATA_PACKET_MAX_SIZE (DATA_PACKET_MIN_SIZE + DATA_PACKET_MAX_DATA_SIZE)
+
+/*
+ * Optional trailer following the data. It is a sequence of [tag][len][value] blocks so that receivers which don't
+ * know about a tag can skip it, and receivers which predate the trailer ignore it entirely.
+ */
+#define DATA_PACKET_OPT_TAG_SIZE SOB
+#define DATA_PACKET_OPT_LEN_SIZE SOB
+#define DATA_PACKET_OPT_HDR_SIZE (DATA_PACKET_OPT_TAG_SIZE + DATA_PACKET_OPT_LEN_SIZE)
+
+/* Option tags */
+#define DATA_PACKET_OPT_ACKS 1
+#define DATA_PACKET_OPT_DEADLINE 2
+#define DATA_PACKET_OPT_MESH_TIME 3
+
+#define DATA_PACKET_DEADLINE_SIZE sizeof(uint16_t)
+#define DATA_PACKET_MESH_TIME_SIZE sizeof(uint32_t)
+
+/* Acks piggybacked on an outgoing packet, one packet type per ack. */
+#define DATA_PACKET_MAX_ACKS 4
+
+#define DATA_PACKET_MAX_OPTS_SIZE (DATA_PACKET_OPT_HDR_SIZE + DATA_PACKET_MAX_ACKS + \
+                                   DATA_PACKET_OPT_HDR_SIZE + DATA_PACKET_DEADLINE_SIZE + \
+                                   DATA_PACKET_OPT_HDR_SIZE + DATA_PACKET_MESH_TIME_SIZE)
+#define DATA_PACKET_MAX_SIZE (DATA_PACKET_MIN_SIZE + DATA_PACKET_MAX_DATA_SIZE + DATA_PACKET_MAX_OPTS_SIZE)
 
 /* Packet types */
 
@@ -34,6 +58,16 @@
 #define PT_OTA_UPDATE_AVAILABLE 3
 #define PT_OTA_UPDATE_AVAILABLE_RESP 4
 #define PT_GO_TO_SLEEP 5
+#define PT_NODE_LEASE_RENEW 6
+#define PT_NODE_LEASE_RENEW_RESP 7
+
+/* Acknowledgement types */
+#define PT_ACKS 20
+#define PT_ACK_NODE_CONNECTED 21
+#define PT_ACK_OTA_UPDATE_CURRENT 22
+#define PT_CUSTODY_ACK 23
+#define PT_GO_TO_SLEEP_ACK 24
+#define PT_SUBTREE_ASLEEP 25
 
 /* Data request types */
 #define PT_REQ_BATTERY_PCT 10
@@ -66,17 +100,29 @@ struct mesh_data_packet {
     uint8_t type;
     uint8_t data_length;
     uint8_t *data;
+
+    /** Acks carried in the trailer, see DATA_PACKET_OPT_ACKS. */
+    uint8_t ack_count;
+    uint8_t acks[DATA_PACKET_MAX_ACKS];
+
+    /** Time left in ms before the packet is useless, 0 if it has no deadline. See DATA_PACKET_OPT_DEADLINE. */
+    uint16_t deadline_ms;
+
+    /** The hub's clock when it sent the packet, 0 if it isn't stamped. See DATA_PACKET_OPT_MESH_TIME. */
+    uint32_t mesh_time_ms;
 };
 
 
 /* Data packet distribution */
 void mdp_pack(uint8_t *packed_buf, uint8_t *packed_data_len, uint8_t allocated_packed_data_len, struct mesh_data_packet *packet);
-void mdp_unpack(uint8_t *packed_buf, struct mesh_data_packet *packet);
+void mdp_unpack(uint8_t *packed_buf, uint16_t packed_len, struct mesh_data_packet *packet);
 void mdp_print_packet(struct mesh_data_packet *packet);
 void mdp_print_packed_packet(uint8_t *packed_packet, uint8_t packed_packet_len, uint8_t allocated_packed_packet_len);
 void mdp_free(struct mesh_data_packet *packet);
 struct mesh_data_packet *mdp_alloc(size_t data_length);
 struct mesh_data_packet *mdp_copy_packet(struct mesh_data_packet *packet);
 int mdp_cmp(struct mesh_data_packet *packet1, struct mesh_data_packet *packet2);
+bool mdp_age_deadline(struct mesh_data_packet *packet, uint32_t elapsed_ms, uint16_t min_remaining_ms);
+void mdp_age_mesh_time(struct mesh_data_packet *packet, uint32_t elapsed_ms);
 
 #endif //MESH_DATA_PACKET_H
@@ -0,0 +1,509 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_link.h"
+#include "mesh_misc.h"
+#include "mesh_peer.h"
+
+/**
+ * Every link goes through candidate -> connecting -> discovering -> ready -> closing. The controller only initiates
+ * one connection at a time, but discovery runs on the established connection, so the next candidate is connected to
+ * while earlier links are still being discovered. Forming the mesh then takes about as long as the slowest link
+ * instead of the sum of all of them.
+ */
+static struct mesh_link links[LINK_TABLE_SIZE];
+
+/**
+ * How connections to an address went on this and earlier wakes, so a node that keeps failing us is tried after the
+ * ones that don't.
+ */
+struct ml_history {
+    bool valid;
+    ble_addr_t addr;
+    uint8_t successes;
+    uint8_t failures;
+};
+
+RTC_DATA_ATTR static struct ml_history link_history[LINK_HISTORY_SIZE];
+
+static struct ble_npl_callout link_tick_callout;
+static ble_gap_event_fn *link_gap_event_cb;
+
+static const char *
+ml_state_str(uint8_t state) {
+    switch (state) {
+        case LINK_STATE_CANDIDATE:
+            return "candidate";
+        case LINK_STATE_CONNECTING:
+            return "connecting";
+        case LINK_STATE_DISCOVERING:
+            return "discovering";
+        case LINK_STATE_READY:
+            return "ready";
+        case LINK_STATE_CLOSING:
+            return "closing";
+        default:
+            return "free";
+    }
+}
+
+static void
+ml_start_tick() {
+    if (!ble_npl_callout_is_active(&link_tick_callout)) {
+        ble_npl_callout_reset(&link_tick_callout, ble_npl_time_ms_to_ticks32(LINK_TICK_IN_MS));
+    }
+}
+
+static void
+ml_set_state(struct mesh_link *link, uint8_t state) {
+    LOGD("Link to %s: %s -> %s", mesh_addr_str(link->addr.val), ml_state_str(link->state), ml_state_str(state));
+    link->state = state;
+    link->state_entered_at = ble_npl_time_get();
+
+    if (state != LINK_STATE_FREE && state != LINK_STATE_READY) {
+        ml_start_tick();
+    }
+}
+
+static struct mesh_link *
+ml_find_by_addr(const ble_addr_t *addr) {
+    int i;
+
+    for (i = 0; i < LINK_TABLE_SIZE; i++) {
+        if (links[i].state != LINK_STATE_FREE && ble_addr_cmp(&links[i].addr, addr) == 0) {
+            return &links[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct mesh_link *
+ml_find_by_conn_handle(uint16_t conn_handle) {
+    int i;
+
+    for (i = 0; i < LINK_TABLE_SIZE; i++) {
+        if (links[i].state >= LINK_STATE_DISCOVERING && links[i].conn_handle == conn_handle) {
+            return &links[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct mesh_link *
+ml_find_by_state(uint8_t state) {
+    int i;
+
+    for (i = 0; i < LINK_TABLE_SIZE; i++) {
+        if (links[i].state == state) {
+            return &links[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct ml_history *
+ml_history_find(const ble_addr_t *addr) {
+    int i;
+
+    for (i = 0; i < LINK_HISTORY_SIZE; i++) {
+        if (link_history[i].valid && ble_addr_cmp(&link_history[i].addr, addr) == 0) {
+            return &link_history[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Records a connection outcome, making room by dropping the address we know least about.
+ */
+static void
+ml_history_record(const ble_addr_t *addr, bool success) {
+    struct ml_history *history;
+    int i;
+
+    history = ml_history_find(addr);
+    if (history == NULL) {
+        for (i = 0; i < LINK_HISTORY_SIZE; i++) {
+            if (!link_history[i].valid) {
+                history = &link_history[i];
+                break;
+            }
+            if (history == NULL ||
+                link_history[i].successes + link_history[i].failures < history->successes + history->failures) {
+                history = &link_history[i];
+            }
+        }
+
+        memset(history, 0, sizeof *history);
+        history->valid = true;
+        history->addr = *addr;
+    }
+
+    /* Halve old outcomes so the recent ones count most. */
+    if (history->successes + history->failures >= LINK_HISTORY_MAX_OUTCOMES) {
+        history->successes /= 2;
+        history->failures /= 2;
+    }
+
+    if (success) {
+        history->successes++;
+    } else {
+        history->failures++;
+    }
+}
+
+/**
+ * Ranks a candidate, higher is better. The signal is normalised to a 0 dBm transmitter when the advertiser told us its
+ * power, and adjusted by how far it advertises to be from the hub and how our earlier connections to it went.
+ */
+static int
+ml_score(const struct mesh_link *link) {
+    const struct ml_history *history;
+    int score;
+
+    score = link->rssi == LINK_RSSI_UNKNOWN ? LINK_MIN_CANDIDATE_RSSI : link->rssi;
+    if (link->tx_pwr != LINK_TX_PWR_UNKNOWN) {
+        score -= link->tx_pwr;
+    }
+
+    if (link->has_info) {
+        if (link->info.hops_to_hub == MESH_PEER_HOPS_UNKNOWN) {
+            score -= LINK_SCORE_NO_HUB_PENALTY;
+        } else {
+            score -= link->info.hops_to_hub * LINK_SCORE_HOP_PENALTY;
+        }
+        if (link->info.flags & MESH_ADV_F_LOW_BATTERY) {
+            score -= LINK_SCORE_LOW_BATTERY_PENALTY;
+        }
+    }
+
+    history = ml_history_find(&link->addr);
+    if (history != NULL) {
+        score += history->successes * LINK_SCORE_SUCCESS_BONUS - history->failures * LINK_SCORE_FAILURE_PENALTY;
+    }
+
+    return score;
+}
+
+/**
+ * Whether the candidate advertises being fewer than max_hops hops from the hub, MESH_PEER_HOPS_UNKNOWN taking any.
+ */
+static bool
+ml_within_hops(const struct mesh_link *link, uint8_t max_hops) {
+    if (max_hops == MESH_PEER_HOPS_UNKNOWN) {
+        return true;
+    }
+
+    return link->has_info && link->info.hops_to_hub < max_hops;
+}
+
+static struct mesh_link *
+ml_find_candidate(bool best, uint8_t max_hops) {
+    struct mesh_link *found = NULL;
+    int i;
+
+    for (i = 0; i < LINK_TABLE_SIZE; i++) {
+        if (links[i].state != LINK_STATE_CANDIDATE || !ml_within_hops(&links[i], max_hops)) {
+            continue;
+        }
+        if (found == NULL || (best ? ml_score(&links[i]) > ml_score(found) : ml_score(&links[i]) < ml_score(found))) {
+            found = &links[i];
+        }
+    }
+
+    return found;
+}
+
+int
+mesh_link_count(uint8_t state) {
+    int count = 0;
+    int i;
+
+    for (i = 0; i < LINK_TABLE_SIZE; i++) {
+        if (links[i].state == state) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static int
+ml_active_count() {
+    return mesh_link_count(LINK_STATE_CONNECTING) + mesh_link_count(LINK_STATE_DISCOVERING) +
+           mesh_link_count(LINK_STATE_READY) + mesh_link_count(LINK_STATE_CLOSING);
+}
+
+/**
+ * Connections we can still take on, advertised so scanners don't waste a connection attempt on a full node.
+ */
+int
+mesh_link_free_slots() {
+    int active = ml_active_count();
+
+    return active < LINK_MAX_CONNECTIONS ? LINK_MAX_CONNECTIONS - active : 0;
+}
+
+static void
+ml_set_candidate_info(struct mesh_link *link, int8_t rssi, int8_t tx_pwr, const struct mesh_adv_info *info) {
+    link->rssi = rssi;
+    link->tx_pwr = tx_pwr;
+    link->has_info = info != NULL;
+    if (info != NULL) {
+        link->info = *info;
+    }
+}
+
+/**
+ * Remembers an advertiser to connect to. Returns BLE_HS_EALREADY if we already have a link to it in any state, and
+ * BLE_HS_EREJECT if its signal is too weak to bother or it advertises having no room for us. A full table makes room
+ * by dropping its worst candidate if the new one ranks higher.
+ */
+int
+mesh_link_add_candidate(const ble_addr_t *addr, int8_t rssi, int8_t tx_pwr, const struct mesh_adv_info *info) {
+    struct mesh_link incoming = {.addr = *addr};
+    struct mesh_link *worst;
+    struct mesh_link *link;
+
+    if (rssi != LINK_RSSI_UNKNOWN && rssi < LINK_MIN_CANDIDATE_RSSI) {
+        LOGD("Ignoring weak advertiser %s; rssi=%d", mesh_addr_str(addr->val), rssi);
+        return BLE_HS_EREJECT;
+    }
+
+    if (info != NULL && info->free_slots == 0) {
+        LOGD("Ignoring full advertiser %s", mesh_addr_str(addr->val));
+        return BLE_HS_EREJECT;
+    }
+
+    ml_set_candidate_info(&incoming, rssi, tx_pwr, info);
+
+    link = ml_find_by_addr(addr);
+    if (link != NULL) {
+        if (link->state == LINK_STATE_CANDIDATE && rssi != LINK_RSSI_UNKNOWN) {
+            /* Heard again, keep it fresh. */
+            ml_set_candidate_info(link, rssi, tx_pwr, info);
+            link->state_entered_at = ble_npl_time_get();
+        }
+        return BLE_HS_EALREADY;
+    }
+
+    link = ml_find_by_state(LINK_STATE_FREE);
+    if (link == NULL) {
+        worst = ml_find_candidate(false, MESH_PEER_HOPS_UNKNOWN);
+        if (worst == NULL) {
+            return BLE_HS_ENOMEM;
+        }
+
+        if (ml_score(&incoming) <= ml_score(worst)) {
+            return BLE_HS_ENOMEM;
+        }
+
+        LOGD("Dropping candidate %s for a better one", mesh_addr_str(worst->addr.val));
+        link = worst;
+    }
+
+    *link = incoming;
+    ml_set_state(link, LINK_STATE_CANDIDATE);
+    return 0;
+}
+
+/**
+ * Initiates a connection to the best ranked candidate fewer than max_hops hops from the hub, MESH_PEER_HOPS_UNKNOWN
+ * for any. Returns true while a connection is being initiated, in which case scanning has to wait; false means the
+ * caller may scan. A running scan is left to finish so the candidates it collects can be ranked against each other,
+ * rather than dialing whichever advertiser happened to be heard first.
+ */
+bool
+mesh_link_connect_next(uint8_t own_addr_type, uint8_t max_hops) {
+    struct ble_gap_conn_params conn_params;
+    struct mesh_link *link;
+    int rc;
+
+    /* A cancelled connect keeps the controller busy until its completion arrives, see mesh_link_connected. */
+    if (ml_find_by_state(LINK_STATE_CONNECTING) != NULL || ble_gap_conn_active()) {
+        return true;
+    }
+
+    if (ble_gap_disc_active() || ml_active_count() >= LINK_MAX_CONNECTIONS) {
+        return false;
+    }
+
+    mesh_peer_fill_connect_params(&conn_params);
+    while ((link = ml_find_candidate(true, max_hops)) != NULL) {
+        LOGI("Connecting to %s; score=%d", mesh_addr_str(link->addr.val), ml_score(link));
+        rc = ble_gap_connect(own_addr_type, &link->addr, LINK_CONNECT_TIMEOUT_IN_MS, &conn_params,
+                             link_gap_event_cb, NULL);
+        if (rc == 0) {
+            ml_set_state(link, LINK_STATE_CONNECTING);
+            return true;
+        }
+
+        LOGE("Error: Failed to connect to device; addr_type=%d addr=%s; rc=%d\n",
+             link->addr.type, mesh_addr_str(link->addr.val), rc);
+        ml_set_state(link, LINK_STATE_FREE);
+    }
+
+    return false;
+}
+
+/**
+ * A connection came up, either one we initiated or one a peer opened to us. A peer we are still connecting to may
+ * beat us to it. Our connect is then cancelled, so its completion can't take the link over again. If it completed
+ * anyway, the two connections are sorted out like any other duplicate.
+ */
+void
+mesh_link_connected(uint16_t conn_handle, const ble_addr_t *addr, bool inbound) {
+    struct mesh_link *link;
+    int rc;
+
+    link = ml_find_by_addr(addr);
+    if (link != NULL && link->state == LINK_STATE_CONNECTING && inbound) {
+        rc = ble_gap_conn_cancel();
+        LOGI("%s opened a connection while we were connecting to it; cancel rc=%d", mesh_addr_str(addr->val), rc);
+    }
+
+    if (link == NULL) {
+        link = ml_find_by_state(LINK_STATE_FREE);
+        if (link == NULL) {
+            LOGW("No link slot for connection with handle %d", conn_handle);
+            return;
+        }
+        link->addr = *addr;
+        ml_set_candidate_info(link, LINK_RSSI_UNKNOWN, LINK_TX_PWR_UNKNOWN, NULL);
+    }
+
+    link->conn_handle = conn_handle;
+    ml_set_state(link, LINK_STATE_DISCOVERING);
+}
+
+void
+mesh_link_connect_failed() {
+    struct mesh_link *link;
+
+    link = ml_find_by_state(LINK_STATE_CONNECTING);
+    if (link != NULL) {
+        ml_history_record(&link->addr, false);
+        ml_set_state(link, LINK_STATE_FREE);
+    }
+}
+
+void
+mesh_link_ready(uint16_t conn_handle) {
+    struct mesh_link *link;
+
+    link = ml_find_by_conn_handle(conn_handle);
+    if (link != NULL) {
+        ml_history_record(&link->addr, true);
+        ml_set_state(link, LINK_STATE_READY);
+    }
+}
+
+void
+mesh_link_close(uint16_t conn_handle) {
+    struct mesh_link *link;
+
+    link = ml_find_by_conn_handle(conn_handle);
+    if (link != NULL && link->state != LINK_STATE_CLOSING) {
+        if (link->state == LINK_STATE_DISCOVERING) {
+            /* The link never became usable. */
+            ml_history_record(&link->addr, false);
+        }
+        ml_set_state(link, LINK_STATE_CLOSING);
+    }
+    ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+/**
+ * Closes a connection that duplicates another one to the same node. Nothing is wrong with the node, so unlike
+ * mesh_link_close this leaves its connection history alone.
+ */
+void
+mesh_link_drop_duplicate(uint16_t conn_handle) {
+    struct mesh_link *link;
+
+    link = ml_find_by_conn_handle(conn_handle);
+    if (link != NULL && link->state != LINK_STATE_CLOSING) {
+        ml_set_state(link, LINK_STATE_CLOSING);
+    }
+    ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+void
+mesh_link_disconnected(uint16_t conn_handle) {
+    struct mesh_link *link;
+
+    link = ml_find_by_conn_handle(conn_handle);
+    if (link != NULL) {
+        ml_set_state(link, LINK_STATE_FREE);
+    }
+}
+
+/**
+ * Returns the transmit power the peer advertised before we connected to it, LINK_TX_PWR_UNKNOWN if we never heard it.
+ */
+int8_t
+mesh_link_tx_pwr(uint16_t conn_handle) {
+    struct mesh_link *link;
+
+    link = ml_find_by_conn_handle(conn_handle);
+    return link != NULL ? link->tx_pwr : LINK_TX_PWR_UNKNOWN;
+}
+
+/**
+ * Gives up on links that have been in a state for too long. Connect attempts time out in the controller, so the
+ * connecting state needs no check here.
+ */
+static void
+ml_tick(struct ble_npl_event *ev) {
+    struct mesh_link *link;
+    uint32_t in_state_ms;
+    bool pending = false;
+    int i;
+
+    for (i = 0; i < LINK_TABLE_SIZE; i++) {
+        link = &links[i];
+        in_state_ms = ble_npl_time_ticks_to_ms32(ble_npl_time_get() - link->state_entered_at);
+
+        switch (link->state) {
+            case LINK_STATE_CANDIDATE:
+                if (in_state_ms > LINK_CANDIDATE_TIMEOUT_IN_MS) {
+                    ml_set_state(link, LINK_STATE_FREE);
+                }
+                break;
+            case LINK_STATE_DISCOVERING:
+                if (in_state_ms > LINK_DISCOVER_TIMEOUT_IN_MS) {
+                    LOGW("Discovery of peer with handle %d timed out", link->conn_handle);
+                    mesh_link_close(link->conn_handle);
+                }
+                break;
+            case LINK_STATE_CLOSING:
+                if (in_state_ms > LINK_CLOSE_TIMEOUT_IN_MS) {
+                    // The disconnect never arrived, don't let the slot leak.
+                    mesh_peer_delete(link->conn_handle);
+                    ml_set_state(link, LINK_STATE_FREE);
+                }
+                break;
+        }
+
+        if (link->state != LINK_STATE_FREE && link->state != LINK_STATE_READY) {
+            pending = true;
+        }
+    }
+
+    if (pending) {
+        ble_npl_callout_reset(&link_tick_callout, ble_npl_time_ms_to_ticks32(LINK_TICK_IN_MS));
+    }
+}
+
+void
+mesh_link_init(ble_gap_event_fn *gap_event_cb) {
+    memset(links, 0, sizeof links);
+    link_gap_event_cb = gap_event_cb;
+    ble_npl_callout_init(&link_tick_callout, nimble_port_get_dflt_eventq(), ml_tick, NULL);
+}
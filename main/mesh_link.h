@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include "host/ble_gap.h"
+#include "nimble/nimble_npl.h"
+#include "mesh_adv.h"
+
+#ifndef MESH_LINK_H
+#define MESH_LINK_H
+
+/**
+ * Link states. A candidate is an advertiser we want to connect to, a link is connecting while our connect request is
+ * outstanding, discovering until the peer's data path is known, ready once packets can flow and closing until the
+ * disconnect arrives.
+ */
+#define LINK_STATE_FREE 0
+#define LINK_STATE_CANDIDATE 1
+#define LINK_STATE_CONNECTING 2
+#define LINK_STATE_DISCOVERING 3
+#define LINK_STATE_READY 4
+#define LINK_STATE_CLOSING 5
+
+/* Connections we hold at most, and room for as many candidates waiting their turn. */
+#define LINK_MAX_CONNECTIONS MYNEWT_VAL(BLE_MAX_CONNECTIONS)
+#define LINK_TABLE_SIZE (2 * LINK_MAX_CONNECTIONS)
+
+/* How long a link may stay in each state before it is given up on. */
+#define LINK_CANDIDATE_TIMEOUT_IN_MS 10000
+#define LINK_CONNECT_TIMEOUT_IN_MS 3000
+#define LINK_DISCOVER_TIMEOUT_IN_MS 5000
+#define LINK_CLOSE_TIMEOUT_IN_MS 2000
+
+/* Cadence of the timeout checks while any link is on its way up or down. */
+#define LINK_TICK_IN_MS 250
+
+/* Advertisers heard weaker than this are not worth a connection attempt. */
+#define LINK_MIN_CANDIDATE_RSSI (-90)
+#define LINK_RSSI_UNKNOWN INT8_MIN
+#define LINK_TX_PWR_UNKNOWN INT8_MAX
+
+/* Connection outcomes remembered per address, across deep sleep. */
+#define LINK_HISTORY_SIZE 8
+#define LINK_HISTORY_MAX_OUTCOMES 8
+
+/* Score adjustment in dB for each remembered successful and failed connection. */
+#define LINK_SCORE_SUCCESS_BONUS 3
+#define LINK_SCORE_FAILURE_PENALTY 6
+
+/* Score adjustment in dB for what an advertiser tells us about itself: each hop it is from the hub, not knowing the
+ * way to the hub at all, and running low on battery. */
+#define LINK_SCORE_HOP_PENALTY 6
+#define LINK_SCORE_NO_HUB_PENALTY 20
+#define LINK_SCORE_LOW_BATTERY_PENALTY 10
+
+struct mesh_link {
+    uint8_t state;
+
+    ble_addr_t addr;
+
+    /** Last heard signal strength and the transmit power the advertiser reported, for ranking candidates. */
+    int8_t rssi;
+    int8_t tx_pwr;
+
+    /** Node info from its advertising data, if it sent any. */
+    bool has_info;
+    struct mesh_adv_info info;
+
+    /** Valid from the discovering state on. */
+    uint16_t conn_handle;
+
+    ble_npl_time_t state_entered_at;
+};
+
+void
+mesh_link_init(ble_gap_event_fn *gap_event_cb);
+
+int
+mesh_link_add_candidate(const ble_addr_t *addr, int8_t rssi, int8_t tx_pwr, const struct mesh_adv_info *info);
+
+bool
+mesh_link_connect_next(uint8_t own_addr_type, uint8_t max_hops);
+
+void
+mesh_link_connected(uint16_t conn_handle, const ble_addr_t *addr, bool inbound);
+
+void
+mesh_link_connect_failed();
+
+void
+mesh_link_ready(uint16_t conn_handle);
+
+void
+mesh_link_close(uint16_t conn_handle);
+
+void
+mesh_link_drop_duplicate(uint16_t conn_handle);
+
+void
+mesh_link_disconnected(uint16_t conn_handle);
+
+int
+mesh_link_count(uint8_t state);
+
+int
+mesh_link_free_slots();
+
+int8_t
+mesh_link_tx_pwr(uint16_t conn_handle);
+
+#endif //MESH_LINK_H
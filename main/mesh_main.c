@@ -3,6 +3,7 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include <esp_sleep.h>
+#include "esp_system.h"
 #include <esp_ota_ops.h>
 #include "mesh_ota_update.h"
 #include <esp_event_legacy.h>
@@ -24,24 +25,65 @@
 #include "services/gap/ble_svc_gap.h"
 #include "mesh_sensor.h"
 #include "mesh_node.h"
+#include "mesh_coc.h"
+#include "mesh_link.h"
+#include "mesh_neighbor.h"
+#include "mesh_rendezvous.h"
+#include "mesh_adv.h"
+#include "mesh_adv_bearer.h"
+#include "mesh_scan.h"
+#include "mesh_time.h"
+#include "mesh_shutdown.h"
 
-/*
- * We add in an offset that's different for each sensor to ensure they can't accidentally overlap and never see each other.
- */
-#define MAX_ADV_DURATION_IN_MS 30000
-#define MAX_DSC_DURATION_IN_MS 30000
 #define MAX_CONNECTION_DISCOVERY_DURATION_IN_MS 15000
 #define MAX_TIME_AWAKE_IN_MS 60000
 
+/* Awake budget once our wakes are aligned with the rest of the mesh, see mesh_time.h. */
+#define SYNCED_MAX_TIME_AWAKE_IN_MS 20000
+
+/*
+ * PT_OTA_UPDATE_AVAILABLE payload: the available firmware version, followed by a byte of capability flags from hubs
+ * that have any. Hubs that predate the flags send the version only.
+ */
+#define OTA_UPDATE_VERSION_SIZE sizeof(uint32_t)
+#define OTA_UPDATE_CAPS_IDX OTA_UPDATE_VERSION_SIZE
+
+/*
+ * The hub reads the PT_OTA_UPDATE_AVAILABLE_RESP and PT_ACK_OTA_UPDATE_CURRENT acks riding on other packets. Hubs
+ * without it still get the 4 byte response packet, see meshsnsr_send_legacy_ota_resp.
+ */
+#define OTA_UPDATE_CAP_READS_ACKS 0x01
+
 #define DEFAULT_SLEEP_TIME_SECONDS 60
 #define uS_TO_S_FACTOR 1000000  /* Conversion factor for micro seconds to seconds */
-#define MAX_DOWNSTREAM_PEERS 0
+
+/* Children we accept below us in the tree, on top of the parents we connect to. */
+#define MAX_DOWNSTREAM_PEERS 3
+
+/* Parents we connect to: one gets us to the hub, a second one closer to the hub than us gives multipath packets a
+ * path of their own, see mesh_node_send_packet_multipath. */
+#define MAX_UPSTREAM_PEERS 2
+
+/* An upstream link that hasn't shown us the way to the hub after this long no longer stops us looking for a parent. */
+#define UPSTREAM_HOPS_TIMEOUT_IN_MS 10000
 
 
 static uint8_t own_addr[6] = {0};
 static uint8_t own_addr_type;
 static bool connection_discovery_stopped = false;
 
+/* Sampled once per wake, advertised so neighbors prefer other parents. */
+static bool battery_low = false;
+
+/* This wake only broadcasts our readings and goes back to sleep. */
+static bool broadcast_only_wake = false;
+
+/* The running advertisement carries a reading rather than our node info. */
+static bool advertising_reading = false;
+
+/* Runs out at the end of the scan slots we leave the radio off for, see mesh_scan_slots_active. */
+static struct ble_npl_callout idle_slot_callout;
+
 /**
  * Variables to hold stored state
  */
@@ -63,15 +105,27 @@ const int CONNECTED_BIT = BIT0;
 void ble_store_config_init(void);
 
 static void
-meshsnsr_connect_if_interesting(const struct ble_gap_disc_desc *disc, const struct ble_hs_adv_fields *fields);
+meshsnsr_connect_if_interesting(const struct ble_gap_disc_desc *disc, const struct mesh_adv_report *report);
 
 static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg);
 
 static void meshsnsr_on_disc_complete(const struct mesh_peer *peer, int status, void *arg);
 
-static void meshsnsr_dsc(void);
+static void meshsnsr_dsc(int32_t duration_ms);
+
+static void meshsnsr_adv(int32_t duration_ms);
+
+static void meshsnsr_next_slot(void);
 
-static void meshsnsr_adv(void);
+static void meshsnsr_refresh_adv(void);
+
+static int meshsnsr_child_slots(void);
+
+static bool meshsnsr_accept_connection(const struct ble_gap_conn_desc *desc);
+
+static bool meshsnsr_needs_parent(void);
+
+static void meshsnsr_form_links(void);
 
 //static void meshsnsr_adv_or_dsc(void);
 //
@@ -87,32 +141,49 @@ static void meshsnsr_adv(void);
 static void go_to_sleep() {
     uint64_t timeToSleep;
 
-    LOGI("Going to sleep for %" PRId64 " seconds...", timeToSleepInSeconds);
     hibernate_sensor();
-    timeToSleep = timeToSleepInSeconds * uS_TO_S_FACTOR;
+    if (mesh_time_synced()) {
+        /* Wake on the mesh wide schedule rather than a period after whenever we happened to fall asleep. */
+        timeToSleep = mesh_time_sleep_us_until_wake(timeToSleepInSeconds * 1000, mesh_node_get_hop_depth());
+        LOGI("Going to sleep until the next mesh wake, in %" PRIu64 " ms...", timeToSleep / 1000);
+    } else {
+        timeToSleep = timeToSleepInSeconds * uS_TO_S_FACTOR;
+        LOGI("Going to sleep for %" PRId64 " seconds...", timeToSleepInSeconds);
+    }
     esp_sleep_enable_timer_wakeup(timeToSleep);
     esp_deep_sleep_start();
 }
 
 /**
- * Enables advertising with the following parameters:
- *     o General discoverable mode.
- *     o Undirected connectable mode.
+ * Nodes that wake together find each other quickly, so a synced node can give up on the mesh much sooner.
  */
-static void meshsnsr_adv() {
-    struct ble_gap_adv_params adv_params;
-    struct ble_hs_adv_fields fields;
+static uint32_t
+max_time_awake_ms() {
+    return mesh_time_synced() ? SYNCED_MAX_TIME_AWAKE_IN_MS : MAX_TIME_AWAKE_IN_MS;
+}
+
+static void
+meshsnsr_sync_time(struct mesh_data_packet *packet) {
+    if (packet->source == HUB_NODE_ID && packet->mesh_time_ms > 0) {
+        mesh_time_sync(packet->mesh_time_ms);
+    }
+}
 
+/**
+ * Sets the data included in our advertisements:
+ *     o Flags (indicates advertisement type and other general info).
+ *     o Advertising tx power.
+ *     o Device name.
+ *     o 16-bit service UUIDs (alert notifications).
+ *     o Manufacturer data with our node info, see struct mesh_adv_info.
+ */
+static int meshsnsr_set_adv_fields(void) {
+    struct ble_hs_adv_fields fields;
+    struct mesh_adv_info info;
+    uint8_t mfg_data[MESH_ADV_INFO_LEN];
     const char *name;
     int rc;
 
-    /**
-     *  Set the advertisement data included in our advertisements:
-     *     o Flags (indicates advertisement type and other general info).
-     *     o Advertising tx power.
-     *     o Device name.
-     *     o 16-bit service UUIDs (alert notifications).
-     */
     memset(&fields, 0, sizeof fields);
 
     /* Advertise two flags:
@@ -140,52 +211,84 @@ static void meshsnsr_adv() {
     fields.num_uuids16 = 1;
     fields.uuids16_is_complete = 1;
 
+    info.hops_to_hub = mesh_node_get_hop_depth();
+    info.free_slots = meshsnsr_child_slots();
+    info.node_id = mesh_node_get_node_id();
+    info.flags = 0;
+    if (info.node_id > PROVISIONAL_NODE_ID) {
+        info.flags |= MESH_ADV_F_PROVISIONED;
+    }
+    if (battery_low) {
+        info.flags |= MESH_ADV_F_LOW_BATTERY;
+    }
+    fields.mfg_data = mfg_data;
+    fields.mfg_data_len = mesh_adv_info_encode(&info, mfg_data, sizeof mfg_data);
+
     rc = ble_gap_adv_set_fields(&fields);
     if (rc != 0) {
         LOGE("error setting advertisement data; rc=%d\n", rc);
+    }
+    return rc;
+}
+
+/**
+ * Brings the node info in our advertisements up to date if we are advertising. Starting to advertise sets it anyway.
+ * Advertising stops as soon as our child slots are full.
+ */
+static void meshsnsr_refresh_adv(void) {
+    if (!ble_gap_adv_active() || advertising_reading) {
         return;
     }
 
-    /* Begin advertising. */
-    memset(&adv_params, 0, sizeof adv_params);
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    if (meshsnsr_child_slots() == 0) {
+        ble_gap_adv_stop();
+        meshsnsr_next_slot();
+    } else {
+        meshsnsr_set_adv_fields();
+    }
+}
 
-    int32_t adv_period = (rand() % (MAX_ADV_DURATION_IN_MS - 1000)) + 1000;
+/**
+ * Advertises the next reading waiting to be broadcast, returns BLE_HS_ENOENT if there is none.
+ */
+static int meshsnsr_broadcast_next(void) {
+    int rc;
 
-    LOGI("Starting advertising for %d ms...", adv_period);
-    rc = ble_gap_adv_start(own_addr_type, NULL, adv_period, &adv_params, meshsnsr_gap_event, NULL);
+    rc = mesh_adv_bearer_start(own_addr_type, meshsnsr_gap_event);
+    advertising_reading = rc == 0;
+    return rc;
+}
 
+/**
+ * Enables advertising with the following parameters:
+ *     o General discoverable mode.
+ *     o Undirected connectable mode.
+ */
+static void meshsnsr_adv(int32_t duration_ms) {
+    struct ble_gap_adv_params adv_params;
+    int rc;
+
+    rc = meshsnsr_set_adv_fields();
     if (rc != 0) {
-        LOGE("error enabling advertisement; rc=%d\n", rc);
         return;
     }
-}
 
-bool should_process_adv(struct ble_gap_event *event) {
-    struct ble_hs_adv_fields fields;
-    char s[BLE_HS_ADV_MAX_SZ];
-    int rc;
+    /* Begin advertising. */
+    memset(&adv_params, 0, sizeof adv_params);
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = SCAN_ADV_ITVL_MIN;
+    adv_params.itvl_max = SCAN_ADV_ITVL_MAX;
 
-    if (event->type == BLE_GAP_EVENT_DISC) {
-        rc = ble_hs_adv_parse_fields(&fields, event->disc.data,
-                                     event->disc.length_data);
-        if (rc != 0) {
-            return false;
-        }
+    LOGI("Starting advertising for %d ms...", duration_ms);
+    rc = ble_gap_adv_start(own_addr_type, NULL, duration_ms, &adv_params, meshsnsr_gap_event, NULL);
 
-        if (fields.name != NULL) {
-            assert(fields.name_len < sizeof s - 1);
-            memcpy(s, fields.name, fields.name_len);
-            s[fields.name_len] = '\0';
-            return strncmp(LOG_NAME, s, fields.name_len) == 0;
-        }
-        return false;
+    if (rc != 0) {
+        LOGE("error enabling advertisement; rc=%d\n", rc);
+        return;
     }
-    return true;
 }
 
-
 /**
  * The nimble host executes this callback when a GAP event occurs.  The
  * application associates a GAP event callback with each connection that forms.
@@ -204,15 +307,14 @@ bool should_process_adv(struct ble_gap_event *event) {
 static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
     struct ble_gap_conn_desc desc;
     struct ble_hs_adv_fields fields;
+    struct mesh_adv_report report;
+    struct mesh_adv_reading reading;
     int rc;
 
-    if (!should_process_adv(event)) {
-        /* Ignore advertisements that aren't from another mesh sensor. */
-        return 0;
+    if (event->type != BLE_GAP_EVENT_DISC) {
+        LOGD("Received event %s\n", mesh_event_type_str(event->type));
     }
 
-    LOGD("Received event %s\n", mesh_event_type_str(event->type));
-
     switch (event->type) {
         case BLE_GAP_EVENT_NOTIFY_TX:
             LOGI("Notification transmit event, status=%d, indication=%d", event->notify_tx.status,
@@ -220,17 +322,33 @@ static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
             return 0;
 
         case BLE_GAP_EVENT_DISC:
-            rc = ble_hs_adv_parse_fields(&fields, event->disc.data,
-                                         event->disc.length_data);
-            if (rc != 0) {
-                return 0;
+            /* An advertisement report was received during GAP discovery. Reports from anything but another mesh
+             * node are dropped here, before any parsing. */
+            switch (mesh_adv_scan_report(&event->disc.addr, event->disc.data, event->disc.length_data, &report)) {
+                case MESH_ADV_KIND_READING:
+                    /* Readings broadcast by other nodes are relayed, never connected to. */
+                    if (mesh_adv_reading_parse(report.mfg_data, report.mfg_data_len, &reading) == 0) {
+                        mesh_adv_bearer_received(&reading, mesh_node_get_node_id());
+                    }
+                    return 0;
+                case MESH_ADV_KIND_NODE:
+                    break;
+                default:
+                    return 0;
             }
 
-            /* An advertisement report was received during GAP discovery. */
-            mesh_print_adv_fields(&fields);
+            if (MAX_LOG_LEVEL >= ESP_LOG_DEBUG &&
+                ble_hs_adv_parse_fields(&fields, event->disc.data, event->disc.length_data) == 0) {
+                mesh_print_adv_fields(&fields);
+            }
+
+            /* Cached neighbors are ranked against advertisers by signal normalised to their transmit power. */
+            if (report.tx_pwr_present) {
+                mesh_neighbor_heard(&event->disc.addr, report.tx_pwr);
+            }
 
             /* Try to connect to the advertiser if it looks interesting. */
-            meshsnsr_connect_if_interesting(&event->disc, &fields);
+            meshsnsr_connect_if_interesting(&event->disc, &report);
             return 0;
 
         case BLE_GAP_EVENT_CONNECT:
@@ -243,6 +361,14 @@ static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
                 assert(rc == 0);
                 mesh_print_conn_desc(&desc);
 
+                if (!meshsnsr_accept_connection(&desc)) {
+                    ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                    meshsnsr_form_links();
+                    return 0;
+                }
+                mesh_link_connected(event->connect.conn_handle, &desc.peer_id_addr,
+                                    desc.role == BLE_GAP_ROLE_SLAVE);
+
                 /* Remember peer. */
                 rc = mesh_peer_add(event->connect.conn_handle, &desc.peer_id_addr);
                 if (rc != 0) {
@@ -251,16 +377,31 @@ static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
                     } else {
                         LOGE("Failed to add peer; rc=%d\n", rc);
                     }
-                    return 0;
-                }
-
-                rc = mesh_peer_disc_all(event->connect.conn_handle,
-                                        meshsnsr_on_disc_complete, NULL);
-                if (rc != 0) {
-                    LOGE("Failed to discover services; rc=%d\n", rc);
-                    return 0;
+                } else {
+                    mesh_peer_set_upstream(event->connect.conn_handle, desc.role == BLE_GAP_ROLE_MASTER);
+                    mesh_peer_set_conn_params(event->connect.conn_handle, desc.conn_itvl, desc.conn_latency);
+                    mesh_peer_negotiate_link(event->connect.conn_handle);
+
+                    if (mesh_neighbor_restore(mesh_peer_find(event->connect.conn_handle))) {
+                        /* We've discovered this neighbor before and its handles can't have changed. */
+                        LOGI("Using cached handles for neighbor, skipping discovery.");
+                        meshsnsr_on_disc_complete(mesh_peer_find(event->connect.conn_handle), 0, NULL);
+                    } else {
+                        rc = mesh_peer_disc_mesh_svc(event->connect.conn_handle,
+                                                     meshsnsr_on_disc_complete, NULL);
+                        if (rc != 0) {
+                            LOGE("Failed to discover services; rc=%d\n", rc);
+                            mesh_link_close(event->connect.conn_handle);
+                        }
+                    }
                 }
+            } else {
+                mesh_link_connect_failed();
             }
+
+            /* Discovery of this link goes on while we bring up the next one. */
+            meshsnsr_refresh_adv();
+            meshsnsr_form_links();
             return 0;
 
         case BLE_GAP_EVENT_DISCONNECT:
@@ -269,7 +410,15 @@ static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
 
             /* Forget about peer. */
             mesh_peer_delete(event->disconnect.conn.conn_handle);
+            mesh_link_disconnected(event->disconnect.conn.conn_handle);
+            mesh_shutdown_peer_disconnected(event->disconnect.conn.conn_handle);
+            if (mesh_shutdown_in_progress()) {
+                return 0;
+            }
 
+            /* A connection slot may have opened up. */
+            meshsnsr_refresh_adv();
+            meshsnsr_form_links();
             return 0;
 
         case BLE_GAP_EVENT_CONN_UPDATE:
@@ -279,18 +428,29 @@ static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
             rc = ble_gap_conn_find(event->conn_update.conn_handle, &desc);
             assert(rc == 0);
             mesh_print_conn_desc(&desc);
+            if (event->conn_update.status == 0) {
+                mesh_peer_set_conn_params(event->conn_update.conn_handle, desc.conn_itvl, desc.conn_latency);
+            }
             return 0;
 
         case BLE_GAP_EVENT_ADV_COMPLETE:
             LOGI("advertise complete; reason=%d",
                  event->adv_complete.reason);
+            advertising_reading = false;
+            if (broadcast_only_wake) {
+                if (meshsnsr_broadcast_next() != 0) {
+                    go_to_sleep();
+                }
+                return 0;
+            }
             mesh_node_resend_packets_if_needed();
-            meshsnsr_dsc();
+            meshsnsr_next_slot();
             return 0;
 
         case BLE_GAP_EVENT_DISC_COMPLETE:
             LOGI("discovery complete; reason=%d", event->disc_complete.reason);
             mesh_node_resend_packets_if_needed();
+            meshsnsr_form_links();
             return 0;
 
         case BLE_GAP_EVENT_REPEAT_PAIRING:
@@ -308,6 +468,10 @@ static int meshsnsr_gap_event(struct ble_gap_event *event, void *arg) {
              */
             return BLE_GAP_REPEAT_PAIRING_RETRY;
 
+        case BLE_GAP_EVENT_MTU:
+            mesh_peer_set_mtu(event->mtu.conn_handle, event->mtu.value);
+            return 0;
+
         case BLE_GAP_EVENT_SUBSCRIBE:
             LOGI("subscribe event from hub; cur_notify=%d\n value handle; "
                  "val_handle=%d\n",
@@ -329,11 +493,11 @@ static void meshsnsr_on_disc_complete(const struct mesh_peer *peer, int status,
         /* Service discovery failed.  Terminate the connection. */
         LOGE("Error: Service discovery failed; status=%d "
              "conn_handle=%d\n", status, peer->conn_handle);
-        ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        mesh_neighbor_forget(&peer->addr);
+        mesh_link_close(peer->conn_handle);
     } else {
-        /* Service discovery has completed successfully.  Now we have a complete
-         * list of services, characteristics, and descriptors that the peer
-         * supports.
+        /* Service discovery has completed successfully.  Now we have the
+         * mesh data service and its characteristics, if the peer has them.
          */
         LOGI("Service discovery complete; status=%d "
              "conn_handle=%d\n", status, peer->conn_handle);
@@ -342,10 +506,15 @@ static void meshsnsr_on_disc_complete(const struct mesh_peer *peer, int status,
         assert(rc == 0);
         mesh_print_conn_desc(&desc);
 
+        mesh_link_ready(peer->conn_handle);
+        if (desc.role == BLE_GAP_ROLE_SLAVE && peer->role == MESH_PEER_ROLE_NODE) {
+            mesh_adv_bearer_child_connected();
+        }
+        mesh_peer_link_sample_rssi((struct mesh_peer *) peer);
+        mesh_neighbor_remember(peer, mesh_link_tx_pwr(peer->conn_handle));
+        mesh_coc_connect((struct mesh_peer *) peer);
         mesh_node_connection_available();
     }
-
-    meshsnsr_dsc();
 }/**
  * @brief Default MQTT HOST URL is pulled from the aws_iot_config.h
  */
@@ -384,110 +553,241 @@ static void meshsnsr_on_reset(int reason) {
 
 /**
  * Indicates whether we should try to connect to the sender of the specified
- * advertisement.  The function returns a positive result if the device
- * advertises connectability and support for the mesh data service.
+ * mesh node advertisement.  The function returns a positive result if the
+ * device advertises connectability and we aren't connected to it yet.
  */
 static int meshsnsr_should_connect(const struct ble_gap_disc_desc *disc) {
-    struct ble_hs_adv_fields fields;
-    int rc;
-    int i;
-
     /* The device has to be advertising connectability. */
     if (disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND &&
         disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
         return 0;
     }
 
-    rc = ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data);
-    if (rc != 0) {
-        return rc;
-    }
-
     if (mesh_peer_find_by_addr(&disc->addr) != NULL) {
         // We're already connected.
         return 0;
     }
 
-    /* The device has to advertise our mesh data service
-     */
-    for (i = 0; i < fields.num_uuids16; i++) {
-        if (ble_uuid_u16(&fields.uuids16[i].u) == GATT_SVR_SVC_DATA_UUID && mesh_peer_find_by_addr(&disc->addr) == NULL) {
-            return 1;
-        }
-    }
-
-    return 0;
+    return 1;
 }
 
 /**
- * Connects to the sender of the specified advertisement of it looks
- * interesting.  A device is "interesting" if it advertises connectability and
- * support for the mesh data service.
+ * Queues the sender of the specified advertisement as a link candidate if it
+ * looks interesting.  A device is "interesting" if it is one of our nodes and
+ * advertises connectability.
  */
 static void
-meshsnsr_connect_if_interesting(const struct ble_gap_disc_desc *disc, const struct ble_hs_adv_fields *fields) {
-    int rc;
-    char s[BLE_HS_ADV_MAX_SZ];
+meshsnsr_connect_if_interesting(const struct ble_gap_disc_desc *disc, const struct mesh_adv_report *report) {
+    struct mesh_adv_info info;
+    bool has_info;
 
     /* Don't do anything if we don't care about this advertiser. */
     if (!meshsnsr_should_connect(disc)) {
         return;
     }
 
-    /* Scanning must be stopped before a connection can be initiated. */
-    rc = ble_gap_disc_cancel();
-    if (rc != 0 && rc != BLE_HS_EALREADY) {
-        LOGE("Failed to cancel scan; rc=%d\n", rc);
+    /* Nodes running older firmware don't advertise their info, they are ranked on signal alone. */
+    has_info = mesh_adv_info_parse(report->mfg_data, report->mfg_data_len, &info) == 0;
+
+    /* Candidates are ranked and connected to once the scan slot ends. */
+    if (mesh_link_add_candidate(&disc->addr, disc->rssi, report->tx_pwr_present ? report->tx_pwr : LINK_TX_PWR_UNKNOWN,
+                                has_info ? &info : NULL) == 0) {
+        LOGI("Found node %s to connect to; rssi=%d hops=%d\n", mesh_addr_str(disc->addr.val), disc->rssi,
+             has_info ? info.hops_to_hub : -1);
     }
+}
 
-    /* Try to connect the the advertiser.  Allow 30 seconds (30000 ms) for
-     * timeout.
-     */
-    memcpy(s, fields->name, fields->name_len);
-    s[fields->name_len] = '\0';
-    LOGI("Attempting connection to node %s\n", s);
-    rc = ble_gap_connect(own_addr_type, &disc->addr, 30000, NULL,
-                         meshsnsr_gap_event, NULL);
+struct meshsnsr_tree_links {
+    int upstream;
+    /** Upstream links still young enough to be waiting for their way to the hub. */
+    int upstream_waiting;
+    int children;
+};
 
-    if (rc != 0) {
-        LOGE("Error: Failed to connect to device; addr_type=%d "
-             "addr=%s; rc=%d\n",
-             disc->addr.type, mesh_addr_str(disc->addr.val), rc);
+/**
+ * Sorts our connections into the tree: the ones we opened and the hub's lead upstream, the ones other nodes opened
+ * to us are our children. Routing follows the same split, see mesh_node.c.
+ */
+static void
+meshsnsr_count_tree_link(struct mesh_peer *peer, void *arg) {
+    struct meshsnsr_tree_links *links = arg;
+
+    if (mesh_peer_is_upstream(peer)) {
+        links->upstream++;
+        if (peer->role != MESH_PEER_ROLE_HUB && peer->hops_to_hub == MESH_PEER_HOPS_UNKNOWN &&
+            ble_npl_time_get() - peer->connected_at < ble_npl_time_ms_to_ticks32(UPSTREAM_HOPS_TIMEOUT_IN_MS)) {
+            links->upstream_waiting++;
+        }
+    } else {
+        links->children++;
     }
 }
 
+static void
+meshsnsr_count_tree_links(struct meshsnsr_tree_links *links) {
+    memset(links, 0, sizeof *links);
+    mesh_peer_exec_for_each(meshsnsr_count_tree_link, links);
+}
 
 /**
- * Initiates the GAP general discovery procedure.
+ * Children we can still take on. Advertised so that scanners looking for a parent pass us by once we are full.
  */
-static void meshsnsr_dsc(void) {
-    struct ble_gap_disc_params disc_params;
-    int rc;
+static int
+meshsnsr_child_slots(void) {
+    struct meshsnsr_tree_links links;
+    int slots;
+
+    meshsnsr_count_tree_links(&links);
+    slots = MAX_DOWNSTREAM_PEERS - links.children;
+    if (slots > mesh_link_free_slots()) {
+        slots = mesh_link_free_slots();
+    }
+    return slots > 0 ? slots : 0;
+}
+
+/**
+ * We need a parent while we don't know the way to the hub and have no upstream link that might still show it to us.
+ * An upstream link only shows the way once a packet from the hub came through it, one that doesn't in time may well
+ * lead nowhere.
+ */
+static bool
+meshsnsr_needs_parent(void) {
+    struct meshsnsr_tree_links links;
+
+    meshsnsr_count_tree_links(&links);
+    return links.upstream_waiting == 0 && mesh_node_get_hop_depth() == MESH_PEER_HOPS_UNKNOWN;
+}
+
+/**
+ * Once we know the way to the hub we connect out to one more parent, if we hear one closer to the hub than us.
+ */
+static bool
+meshsnsr_wants_second_parent(void) {
+    struct meshsnsr_tree_links links;
+
+    if (mesh_node_get_hop_depth() == MESH_PEER_HOPS_UNKNOWN) {
+        return false;
+    }
+
+    meshsnsr_count_tree_links(&links);
+    return links.upstream + mesh_link_count(LINK_STATE_CONNECTING) < MAX_UPSTREAM_PEERS;
+}
 
-    if (connection_discovery_stopped) {
+/**
+ * Decides whether a new connection fits the tree. Children beyond MAX_DOWNSTREAM_PEERS are turned away. When two
+ * nodes connect to each other at the same time, both ends keep the connection the lower address opened and drop the
+ * other one, so no loop of two links is left behind.
+ */
+static bool
+meshsnsr_accept_connection(const struct ble_gap_conn_desc *desc) {
+    struct meshsnsr_tree_links links;
+    struct mesh_peer *existing;
+    bool we_are_lower;
+
+    existing = mesh_peer_find_by_addr(&desc->peer_id_addr);
+    if (existing != NULL) {
+        we_are_lower = memcmp(own_addr, desc->peer_id_addr.val, sizeof own_addr) < 0;
+        if ((desc->role == BLE_GAP_ROLE_MASTER) != we_are_lower) {
+            LOGI("Dropping duplicate connection to %s", mesh_addr_str(desc->peer_id_addr.val));
+            return false;
+        }
+
+        LOGI("Replacing duplicate connection to %s", mesh_addr_str(desc->peer_id_addr.val));
+        mesh_link_drop_duplicate(existing->conn_handle);
+        mesh_peer_delete(existing->conn_handle);
+        return true;
+    }
+
+    if (desc->role == BLE_GAP_ROLE_SLAVE) {
+        meshsnsr_count_tree_links(&links);
+        if (links.children >= MAX_DOWNSTREAM_PEERS) {
+            LOGI("No room for another child, turning away %s", mesh_addr_str(desc->peer_id_addr.val));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Connects to the best link candidate if we still need a parent, or to the best one closer to the hub than us for a
+ * second parent. Scanning only pauses while a connection is being initiated, and is resumed once there is nobody
+ * left to connect to.
+ */
+static void
+meshsnsr_form_links(void) {
+    bool connecting;
+
+    if (meshsnsr_needs_parent()) {
+        connecting = mesh_link_connect_next(own_addr_type, MESH_PEER_HOPS_UNKNOWN);
+    } else if (meshsnsr_wants_second_parent()) {
+        connecting = mesh_link_connect_next(own_addr_type, mesh_node_get_hop_depth());
+    } else {
+        connecting = mesh_link_count(LINK_STATE_CONNECTING) > 0;
+    }
+
+    if (!connecting) {
+        meshsnsr_next_slot();
+    }
+}
+
+/**
+ * Advertises or scans for the rest of the current slot of our rendezvous schedule. Does nothing while either is
+ * already running, its completion moves us on to the next slot.
+ */
+static void
+meshsnsr_next_slot(void) {
+    uint32_t duration_ms;
+
+    if (connection_discovery_stopped || ble_gap_adv_active() || ble_gap_disc_active() ||
+        ble_npl_callout_is_active(&idle_slot_callout)) {
         return;
     }
 
-    /* Tell the controller to filter duplicates; we don't want to process
-     * repeated advertisements from the same device.
-     */
-    disc_params.filter_duplicates = 1;
+    if (mesh_rendezvous_next(&duration_ms)) {
+        /* Readings waiting to be relayed go out first, the slot's remainder is picked up once they are done. */
+        if (meshsnsr_broadcast_next() == 0) {
+            return;
+        }
 
-    /**
-     * We are going to actively scan to let the sensors know we've read their data and they can shut down.
-     */
-    disc_params.passive = 0;
+        /* Nobody may connect to us once our child slots are full, keep listening for readings to relay instead. */
+        if (meshsnsr_child_slots() > 0) {
+            meshsnsr_adv(duration_ms);
+        } else {
+            meshsnsr_dsc(duration_ms);
+        }
+    } else if (mesh_scan_slots_active(meshsnsr_needs_parent(), esp_random())) {
+        meshsnsr_dsc(duration_ms);
+    } else {
+        ble_npl_callout_reset(&idle_slot_callout, ble_npl_time_ms_to_ticks32(duration_ms));
+    }
+}
+
+/**
+ * The end of idle scan slots, picked up the way a finished scan is.
+ */
+static void
+meshsnsr_idle_slot_done(struct ble_npl_event *ev) {
+    mesh_node_resend_packets_if_needed();
+    meshsnsr_form_links();
+}
 
-    /* Use defaults for the rest of the parameters. */
-    disc_params.itvl = 0;
-    disc_params.window = 0;
-    disc_params.filter_policy = 0;
-    disc_params.limited = 0;
 
-    int32_t dsc_period = (rand() % (MAX_DSC_DURATION_IN_MS - 1000)) + 1000;
+/**
+ * Initiates the GAP general discovery procedure.
+ */
+static void meshsnsr_dsc(int32_t duration_ms) {
+    struct ble_gap_disc_params disc_params;
+    int rc;
+
+    if (connection_discovery_stopped || ble_gap_conn_active()) {
+        return;
+    }
 
-    LOGI("Starting discovery for %d ms...", dsc_period);
-    rc = ble_gap_disc(own_addr_type, dsc_period, &disc_params, meshsnsr_gap_event, NULL);
+    mesh_scan_fill_params(&disc_params, meshsnsr_needs_parent(), mesh_adv_bearer_readings_expected());
+
+    LOGI("Starting discovery for %d ms...", duration_ms);
+    rc = ble_gap_disc(own_addr_type, duration_ms, &disc_params, meshsnsr_gap_event, NULL);
     if (rc != 0) {
         LOGE("Error initiating GAP discovery procedure; rc=%d\n",
              rc);
@@ -536,7 +836,7 @@ meshsnsr_proc_data_request(struct mesh_data_packet *request_packet) {
 
     memcpy(data_packet->data, &data_value, sizeof(uint32_t));
 
-    mesh_node_send_packet(data_packet, false);
+    mesh_node_send_packet_multipath(data_packet, false);
 }
 
 void
@@ -546,7 +846,7 @@ meshsnsr_proc_config_update(struct mesh_data_packet *packet) {
     char *store_key;
     uint8_t ack_pt;
 
-    assert(packet->data_length == sizeof(uint32_t));
+    assert(packet->data_length >= OTA_UPDATE_VERSION_SIZE);
     memcpy(&new_value, packet->data, sizeof(uint32_t));
 
     switch (packet->type) {
@@ -590,16 +890,21 @@ meshsnsr_proc_config_update(struct mesh_data_packet *packet) {
 
     nvs_close(my_handle);
 
-    mesh_node_send_empty_packet(ack_pt, false);
+    mesh_node_queue_ack(ack_pt);
 }
 
-void
-meshsnsr_proc_ota_update_available(struct mesh_data_packet *packet) {
-    nvs_handle_t my_handle;
+/**
+ * Sends the OTA response as its own 4 byte packet, the way hubs that predate piggybacked acks expect it: 0 if the
+ * update will be installed, otherwise our current version. Hubs that announce OTA_UPDATE_CAP_READS_ACKS only get the
+ * ack. Once no deployed hub sends PT_OTA_UPDATE_AVAILABLE without capability flags, this and the legacy packet go.
+ */
+static void
+meshsnsr_send_legacy_ota_resp(const struct mesh_data_packet *packet, uint32_t value) {
     struct mesh_data_packet *resp_packet;
-    char *my_node_addr_str;
 
-    assert(packet->data_length == sizeof(uint32_t));
+    if (packet->data_length > OTA_UPDATE_CAPS_IDX && (packet->data[OTA_UPDATE_CAPS_IDX] & OTA_UPDATE_CAP_READS_ACKS)) {
+        return;
+    }
 
     resp_packet = mdp_alloc(sizeof(uint32_t));
     resp_packet->type = PT_OTA_UPDATE_AVAILABLE_RESP;
@@ -608,6 +913,17 @@ meshsnsr_proc_ota_update_available(struct mesh_data_packet *packet) {
     resp_packet->ttl = std_ttl;
     resp_packet->idempotency_key = mesh_node_next_idempotency_key();
     resp_packet->data_length = sizeof(uint32_t);
+    *((uint32_t *) resp_packet->data) = value;
+
+    mesh_node_send_packet(resp_packet, false);
+}
+
+void
+meshsnsr_proc_ota_update_available(struct mesh_data_packet *packet) {
+    nvs_handle_t my_handle;
+    char *my_node_addr_str;
+
+    assert(packet->data_length == sizeof(uint32_t));
 
     if (*((uint32_t *) packet->data) > firmware_version) {
         LOGI("Received ota update available message. Storing for use during startup.");
@@ -632,31 +948,21 @@ meshsnsr_proc_ota_update_available(struct mesh_data_packet *packet) {
 
         nvs_close(my_handle);
         ota_update_available = true;
-        /* 0 indicates the update will be downloaded and installed */
-        (*((uint32_t *) resp_packet->data)) = 0;
+        /* The response ack indicates the update will be downloaded and installed */
+        mesh_node_queue_ack(PT_OTA_UPDATE_AVAILABLE_RESP);
+        meshsnsr_send_legacy_ota_resp(packet, 0);
     } else {
         LOGI("Received ota update available, but current version is already at the available version.");
-        /* When we don't need the update, we just send our current version. Can help with debugging. */
-        (*((uint32_t *) resp_packet->data)) = firmware_version;
+        mesh_node_queue_ack(PT_ACK_OTA_UPDATE_CURRENT);
+        meshsnsr_send_legacy_ota_resp(packet, firmware_version);
     }
-
-    mesh_node_send_packet(resp_packet, false);
 }
 
-void
-meshsnsr_proc_go_to_sleep(struct mesh_data_packet *packet) {
-    struct mesh_data_packet *forward_packet;
-
-    forward_packet = mdp_copy_packet(packet);
-
-    // Resend the go to sleep packet before going to sleep.
-    mesh_node_send_packet(forward_packet, false);
-
-    forward_packet = mdp_copy_packet(packet);
-
-    // Send it twice just to be sure.
-    mesh_node_send_packet(forward_packet, false);
-
+/**
+ * Called once our subtree has gone to sleep, or we've given up waiting on it.
+ */
+static void
+meshsnsr_shutdown_done(void) {
     // Now disconnect from all peers.
     mesh_peer_exec_for_each(mesh_node_disconnect, NULL);
 
@@ -667,15 +973,64 @@ meshsnsr_proc_go_to_sleep(struct mesh_data_packet *packet) {
     }
 }
 
+void
+meshsnsr_proc_go_to_sleep(struct mesh_data_packet *packet) {
+    meshsnsr_sync_time(packet);
+    if (packet->data_length >= MESH_TIME_WAKE_SCHEDULE_SIZE) {
+        mesh_time_set_wake_schedule(get_le32(packet->data + MESH_TIME_WAKE_BASE_IDX),
+                                    get_le16(packet->data + MESH_TIME_WAKE_HOP_OFFSET_IDX));
+    }
+
+    // Don't let any acks we're still holding on to go to sleep with us.
+    mesh_node_flush_acks();
+
+    // The mesh is winding down, so stop looking for new links.
+    connection_discovery_stopped = true;
+    if (ble_gap_adv_active()) {
+        ble_gap_adv_stop();
+    }
+    if (ble_gap_disc_active()) {
+        ble_gap_disc_cancel();
+    }
+
+    mesh_shutdown_start(packet, meshsnsr_shutdown_done);
+}
+
 void
 meshsnsr_proc_node_connected_resp(struct mesh_data_packet *packet) {
+    /* Lease renewal responses carry the same address and node id, the id only differs if the hub reassigned it. */
+    meshsnsr_sync_time(packet);
     mesh_node_set_node_id(*(packet->data + BT_ADDRESS_SIZE));
     LOGI("Received assigned node id: %d", mesh_node_get_node_id());
+    meshsnsr_refresh_adv();
 
     mesh_node_packet_response_received(packet);
+    if (packet->type == PT_NODE_CONNECTED_RESP) {
+        mesh_node_queue_ack(PT_ACK_NODE_CONNECTED);
+    }
+}
+
+/**
+ * Broadcasts our readings without connecting to anyone, and goes back to sleep once they have been sent.
+ */
+static void
+meshsnsr_broadcast_readings(void) {
+    uint8_t node_id = mesh_node_get_node_id();
+
+    LOGI("Broadcasting readings instead of connecting this wake.");
+    broadcast_only_wake = true;
+
+    mesh_adv_bearer_send(node_id, PT_RESP_MOISTURE_PCT, convert_moisture_voltage_to_pct(read_soil_moisture_voltage()));
+    mesh_adv_bearer_send(node_id, PT_RESP_BATTERY_PCT, read_battery_remaining_percent());
+
+    if (meshsnsr_broadcast_next() != 0) {
+        go_to_sleep();
+    }
 }
 
 static void meshsnsr_on_sync(void) {
+    const struct mesh_neighbor *neighbor;
+    int cursor = 0;
     int rc;
 
     rc = ble_hs_util_ensure_addr(0);
@@ -698,6 +1053,13 @@ static void meshsnsr_on_sync(void) {
     /* Printing ADDR */
     mesh_print_addr(own_addr);
 
+    battery_low = read_battery_remaining_percent() < MESH_ADV_LOW_BATTERY_PCT;
+
+    if (!mesh_adv_bearer_gatt_wake(mesh_node_get_node_id(), timeToSleepInSeconds * 1000)) {
+        meshsnsr_broadcast_readings();
+        return;
+    }
+
     /* register the callbacks for specific packet types. */
     mesh_node_register_packet_handler(PT_REQ_BATTERY_VOLTAGE, meshsnsr_proc_data_request);
     mesh_node_register_packet_handler(PT_REQ_BATTERY_PCT, meshsnsr_proc_data_request);
@@ -705,6 +1067,7 @@ static void meshsnsr_on_sync(void) {
     mesh_node_register_packet_handler(PT_REQ_MOISTURE_PCT, meshsnsr_proc_data_request);
     mesh_node_register_packet_handler(PT_REQ_MOISTURE_VOLTAGE, meshsnsr_proc_data_request);
     mesh_node_register_packet_handler(PT_NODE_CONNECTED_RESP, meshsnsr_proc_node_connected_resp);
+    mesh_node_register_packet_handler(PT_NODE_LEASE_RENEW_RESP, meshsnsr_proc_node_connected_resp);
     mesh_node_register_packet_handler(PT_UPDATE_BATTERY_HV, meshsnsr_proc_config_update);
     mesh_node_register_packet_handler(PT_UPDATE_BATTERY_LV, meshsnsr_proc_config_update);
     mesh_node_register_packet_handler(PT_UPDATE_SENSOR_HV, meshsnsr_proc_config_update);
@@ -713,7 +1076,20 @@ static void meshsnsr_on_sync(void) {
     mesh_node_register_packet_handler(PT_OTA_UPDATE_AVAILABLE, meshsnsr_proc_ota_update_available);
     mesh_node_register_packet_handler(PT_GO_TO_SLEEP, meshsnsr_proc_go_to_sleep);
 
-    meshsnsr_adv();
+    /* Neighbors cached from our last wake are connected to directly, without scanning for them first. */
+    while ((neighbor = mesh_neighbor_next_to_connect(own_addr, &cursor)) != NULL) {
+        mesh_link_add_candidate(&neighbor->addr, neighbor->rssi, neighbor->tx_pwr, NULL);
+    }
+
+    /* Our node id is unique once the hub has assigned it, until then our address has to do. Either can match another
+     * node's seed, the random phase keeps two such nodes from running in lockstep. */
+    if (mesh_node_get_node_id() > PROVISIONAL_NODE_ID) {
+        mesh_rendezvous_start(mesh_node_get_node_id(), esp_random());
+    } else {
+        mesh_rendezvous_start(own_addr[0] ^ own_addr[1], esp_random());
+    }
+
+    meshsnsr_form_links();
 }
 
 static void
@@ -728,6 +1104,7 @@ start_sleep_timer() {
             LOGE("Unable to start forced sleep timer!!");
             assert(false);
         }
+        mesh_node_set_sleep_deadline(xTaskGetTickCount() + pdMS_TO_TICKS(max_time_awake_ms()));
     }
 }
 
@@ -855,9 +1232,15 @@ void init_mesh() {
     rc = mesh_node_init();
     assert(rc == 0);
 
-    rc = mesh_peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS), 64, 64, 64);
+    rc = mesh_peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS));
+    assert(rc == 0);
+
+    rc = mesh_coc_init();
     assert(rc == 0);
 
+    mesh_link_init(meshsnsr_gap_event);
+    ble_npl_callout_init(&idle_slot_callout, nimble_port_get_dflt_eventq(), meshsnsr_idle_slot_done, NULL);
+
     /* Set the default device name. */
     rc = ble_svc_gap_device_name_set(LOG_NAME);
     assert(rc == 0);
@@ -892,7 +1275,7 @@ app_main(void) {
     } else {
         forced_sleep_timer = xTimerCreate(
                 "forced_sleep_timer",
-                pdMS_TO_TICKS(MAX_TIME_AWAKE_IN_MS),
+                pdMS_TO_TICKS(max_time_awake_ms()),
                 pdFALSE,
                 (void *) 0,
                 forced_sleep
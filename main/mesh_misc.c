@@ -129,103 +129,103 @@ void mesh_print_adv_fields(const struct ble_hs_adv_fields *fields) {
     int i;
 
     if (fields->flags != 0) {
-        LOGI__("    flags=0x%02x\n", fields->flags);
+        LOGD__("    flags=0x%02x\n", fields->flags);
     }
 
     if (fields->uuids16 != NULL) {
-        LOGI__("    uuids16(%scomplete)=",
+        LOGD__("    uuids16(%scomplete)=",
                  fields->uuids16_is_complete ? "" : "in");
         for (i = 0; i < fields->num_uuids16; i++) {
             mesh_print_uuid(&fields->uuids16[i].u);
-            LOGI__(" ");
+            LOGD__(" ");
         }
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->uuids32 != NULL) {
-        LOGI__("    uuids32(%scomplete)=",
+        LOGD__("    uuids32(%scomplete)=",
                  fields->uuids32_is_complete ? "" : "in");
         for (i = 0; i < fields->num_uuids32; i++) {
             mesh_print_uuid(&fields->uuids32[i].u);
-            LOGI(" ");
+            LOGD(" ");
         }
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->uuids128 != NULL) {
-        LOGI__("    uuids128(%scomplete)=",
+        LOGD__("    uuids128(%scomplete)=",
                  fields->uuids128_is_complete ? "" : "in");
         for (i = 0; i < fields->num_uuids128; i++) {
             mesh_print_uuid(&fields->uuids128[i].u);
-            LOGI(" ");
+            LOGD(" ");
         }
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->name != NULL) {
         assert(fields->name_len < sizeof s - 1);
         memcpy(s, fields->name, fields->name_len);
         s[fields->name_len] = '\0';
-        LOGI__("    name(%scomplete)=%s\n",
+        LOGD__("    name(%scomplete)=%s\n",
                  fields->name_is_complete ? "" : "in", s);
     }
 
     if (fields->tx_pwr_lvl_is_present) {
-        LOGI__("    tx_pwr_lvl=%d\n", fields->tx_pwr_lvl);
+        LOGD__("    tx_pwr_lvl=%d\n", fields->tx_pwr_lvl);
     }
 
     if (fields->slave_itvl_range != NULL) {
-        LOGI__("    slave_itvl_range=");
+        LOGD__("    slave_itvl_range=");
         mesh_print_bytes(fields->slave_itvl_range, BLE_HS_ADV_SLAVE_ITVL_RANGE_LEN);
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->svc_data_uuid16 != NULL) {
-        LOGI__("    svc_data_uuid16=");
+        LOGD__("    svc_data_uuid16=");
         mesh_print_bytes(fields->svc_data_uuid16, fields->svc_data_uuid16_len);
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->public_tgt_addr != NULL) {
-        LOGI__("    public_tgt_addr=");
+        LOGD__("    public_tgt_addr=");
         u8p = fields->public_tgt_addr;
         for (i = 0; i < fields->num_public_tgt_addrs; i++) {
-            LOGI("public_tgt_addr=%s ", mesh_addr_str(u8p));
+            LOGD("public_tgt_addr=%s ", mesh_addr_str(u8p));
             u8p += BLE_HS_ADV_PUBLIC_TGT_ADDR_ENTRY_LEN;
         }
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->appearance_is_present) {
-        LOGI__("    appearance=0x%04x\n", fields->appearance);
+        LOGD__("    appearance=0x%04x\n", fields->appearance);
     }
 
     if (fields->adv_itvl_is_present) {
-        LOGI__("    adv_itvl=0x%04x\n", fields->adv_itvl);
+        LOGD__("    adv_itvl=0x%04x\n", fields->adv_itvl);
     }
 
     if (fields->svc_data_uuid32 != NULL) {
-        LOGI__("    svc_data_uuid32=");
+        LOGD__("    svc_data_uuid32=");
         mesh_print_bytes(fields->svc_data_uuid32, fields->svc_data_uuid32_len);
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->svc_data_uuid128 != NULL) {
-        LOGI__("    svc_data_uuid128=");
+        LOGD__("    svc_data_uuid128=");
         mesh_print_bytes(fields->svc_data_uuid128, fields->svc_data_uuid128_len);
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->uri != NULL) {
-        LOGI__("    uri=");
+        LOGD__("    uri=");
         mesh_print_bytes(fields->uri, fields->uri_len);
-        LOGI__("\n");
+        LOGD__("\n");
     }
 
     if (fields->mfg_data != NULL) {
-        LOGI__("    mfg_data=");
+        LOGD__("    mfg_data=");
         mesh_print_bytes(fields->mfg_data, fields->mfg_data_len);
-        LOGI__("\n");
+        LOGD__("\n");
     }
 }
 
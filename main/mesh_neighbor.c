@@ -0,0 +1,166 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "host/ble_hs.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_neighbor.h"
+#include "mesh_misc.h"
+
+/**
+ * Neighbors we had working connections to, kept in RTC memory. Our GATT table is static so a neighbor's handles don't
+ * change between wakes, which lets us reconnect to it directly and skip both scanning and discovery.
+ */
+RTC_DATA_ATTR static struct mesh_neighbor neighbors[NEIGHBOR_CACHE_SIZE];
+
+static struct mesh_neighbor *
+mnb_find(const ble_addr_t *addr) {
+    int i;
+
+    for (i = 0; i < NEIGHBOR_CACHE_SIZE; i++) {
+        if (neighbors[i].valid && ble_addr_cmp(&neighbors[i].addr, addr) == 0) {
+            return &neighbors[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the slot for a new neighbor, replacing the one with the weakest signal if the cache is full.
+ */
+static struct mesh_neighbor *
+mnb_find_slot() {
+    struct mesh_neighbor *weakest = NULL;
+    int i;
+
+    for (i = 0; i < NEIGHBOR_CACHE_SIZE; i++) {
+        if (!neighbors[i].valid) {
+            return &neighbors[i];
+        }
+        if (weakest == NULL || neighbors[i].rssi < weakest->rssi) {
+            weakest = &neighbors[i];
+        }
+    }
+
+    return weakest;
+}
+
+const struct mesh_neighbor *
+mesh_neighbor_find(const ble_addr_t *addr) {
+    return mnb_find(addr);
+}
+
+/**
+ * Remembers a peer whose discovery has completed, along with the transmit power it advertised if we heard it.
+ */
+void
+mesh_neighbor_remember(const struct mesh_peer *peer, int8_t tx_pwr) {
+    struct mesh_neighbor *neighbor;
+    int8_t rssi;
+
+    neighbor = mnb_find(&peer->addr);
+    if (neighbor == NULL) {
+        neighbor = mnb_find_slot();
+        neighbor->valid = false;
+        neighbor->tx_pwr = LINK_TX_PWR_UNKNOWN;
+    }
+
+    if (ble_gap_conn_rssi(peer->conn_handle, &rssi) != 0) {
+        rssi = neighbor->valid ? neighbor->rssi : INT8_MIN;
+    }
+
+    neighbor->addr = peer->addr;
+    neighbor->rssi = rssi;
+    if (tx_pwr != LINK_TX_PWR_UNKNOWN) {
+        neighbor->tx_pwr = tx_pwr;
+    }
+    neighbor->role = peer->role;
+    neighbor->data_val_handle = peer->data_val_handle;
+    neighbor->firmware_version = firmware_version;
+    neighbor->valid = true;
+
+    LOGD("Cached neighbor %s; role=%d val_handle=%d rssi=%d", mesh_addr_str(peer->addr.val), peer->role,
+         peer->data_val_handle, rssi);
+}
+
+/**
+ * Keeps the transmit power of a cached neighbor current as we hear its advertisements.
+ */
+void
+mesh_neighbor_heard(const ble_addr_t *addr, int8_t tx_pwr) {
+    struct mesh_neighbor *neighbor;
+
+    neighbor = mnb_find(addr);
+    if (neighbor != NULL) {
+        neighbor->tx_pwr = tx_pwr;
+    }
+}
+
+void
+mesh_neighbor_forget(const ble_addr_t *addr) {
+    struct mesh_neighbor *neighbor;
+
+    neighbor = mnb_find(addr);
+    if (neighbor != NULL) {
+        LOGI("Forgetting cached neighbor %s", mesh_addr_str(addr->val));
+        neighbor->valid = false;
+    }
+}
+
+/**
+ * Fills in the peer's data path from the cache so discovery can be skipped.
+ *
+ * @return true if the cache had a valid entry for the peer.
+ */
+bool
+mesh_neighbor_restore(struct mesh_peer *peer) {
+    struct mesh_neighbor *neighbor;
+
+    neighbor = mnb_find(&peer->addr);
+    if (neighbor == NULL || neighbor->firmware_version != firmware_version ||
+        neighbor->role == MESH_PEER_ROLE_UNKNOWN) {
+        return false;
+    }
+
+    peer->role = neighbor->role;
+    peer->data_val_handle = neighbor->data_val_handle;
+    return true;
+}
+
+/**
+ * Copies the addresses of all cached neighbors, returns how many there were.
+ */
+int
+mesh_neighbor_copy_addrs(ble_addr_t *addrs, int max_addrs) {
+    int count = 0;
+    int i;
+
+    for (i = 0; i < NEIGHBOR_CACHE_SIZE && count < max_addrs; i++) {
+        if (neighbors[i].valid) {
+            addrs[count++] = neighbors[i].addr;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Iterates over the cached neighbors this node should connect to directly on wake. To keep two neighbors from both
+ * trying to connect to each other, the one with the lower address connects and the other one advertises.
+ * The hub always connects to us, so it is never returned.
+ *
+ * @param cursor Start at 0, it is advanced past the returned neighbor.
+ */
+const struct mesh_neighbor *
+mesh_neighbor_next_to_connect(const uint8_t *own_addr, int *cursor) {
+    struct mesh_neighbor *neighbor;
+
+    while (*cursor < NEIGHBOR_CACHE_SIZE) {
+        neighbor = &neighbors[(*cursor)++];
+        if (neighbor->valid && neighbor->role == MESH_PEER_ROLE_NODE &&
+            memcmp(own_addr, neighbor->addr.val, sizeof neighbor->addr.val) < 0) {
+            return neighbor;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,49 @@
+#include "mesh_peer.h"
+#include "mesh_link.h"
+
+#ifndef MESH_NEIGHBOR_H
+#define MESH_NEIGHBOR_H
+
+/* Neighbors remembered across deep sleep. */
+#define NEIGHBOR_CACHE_SIZE 5
+
+struct mesh_neighbor {
+    bool valid;
+
+    ble_addr_t addr;
+
+    int8_t rssi;
+
+    /** Transmit power the neighbor advertises, LINK_TX_PWR_UNKNOWN until we heard it. See ml_score. */
+    int8_t tx_pwr;
+
+    /** Data path handles from the last discovery, see struct mesh_peer. */
+    uint8_t role;
+    uint16_t data_val_handle;
+
+    /** Handles are only trusted while we run the firmware that learned them. */
+    uint32_t firmware_version;
+};
+
+void
+mesh_neighbor_remember(const struct mesh_peer *peer, int8_t tx_pwr);
+
+void
+mesh_neighbor_heard(const ble_addr_t *addr, int8_t tx_pwr);
+
+void
+mesh_neighbor_forget(const ble_addr_t *addr);
+
+const struct mesh_neighbor *
+mesh_neighbor_find(const ble_addr_t *addr);
+
+bool
+mesh_neighbor_restore(struct mesh_peer *peer);
+
+int
+mesh_neighbor_copy_addrs(ble_addr_t *addrs, int max_addrs);
+
+const struct mesh_neighbor *
+mesh_neighbor_next_to_connect(const uint8_t *own_addr, int *cursor);
+
+#endif //MESH_NEIGHBOR_H
@@ -1,13 +1,22 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <host/util/util.h>
+#include "esp_attr.h"
+#include "esp_system.h"
 #include "nvs_flash.h"
 #include "host/ble_uuid.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
+#include "nimble/nimble_port.h"
 #include "mesh_data_packet.h"
 #include "mesh_peer.h"
 #include "mesh_node.h"
 #include "mesh_misc.h"
+#include "mesh_custody.h"
+#include "mesh_neighbor.h"
+#include "mesh_transport.h"
+#include "mesh_shutdown.h"
 
 #define MAX_PACKETS_AWAITING_RESPONSE 2
 static mn_handle_packet_cb_fn *packet_handlers[NUM_PACKET_TYPES] = {NULL};
@@ -16,7 +25,30 @@ static uint8_t node_ble_addr[6];
 static bool provisioning_requested = false;
 static bool resend_packets = false;
 static bool processed_packets[400];
-static uint8_t idempotency_key_counter = 0;
+
+/**
+ * Acks waiting to be piggybacked on the next packet we send to the hub. If nothing goes out before the ack flush
+ * callout fires, they are sent on their own in a single PT_ACKS packet.
+ */
+static uint8_t pending_acks[DATA_PACKET_MAX_ACKS];
+static uint8_t pending_ack_count = 0;
+static struct ble_npl_callout ack_flush_callout;
+
+/**
+ * Tick at which this node will be put to sleep. Requests we originate carry the time left until then as their
+ * deadline, since nobody will be awake to act on their response afterwards. See mn_stamp_deadline.
+ */
+static TickType_t sleep_at_tick = 0;
+
+/**
+ * Source and idempotency key of packets we forwarded recently, upstream or down. A copy of one of these arriving
+ * over another path is merged here instead of being forwarded again.
+ */
+static uint16_t forwarded_packets[FORWARD_DEDUP_SIZE];
+static uint8_t forwarded_packets_next = 0;
+
+/** Packets dropped because no transport to the peer could carry them yet, see mn_forward_packet. */
+static uint32_t oversized_drops = 0;
 
 static void *par_mem;
 static struct os_mempool par_pool;
@@ -26,6 +58,20 @@ static SLIST_HEAD(, par) pars;
  * Contains this nodes node id. We start out as a provisional node until we receive an assigned node id from the hub.
  */
 static uint8_t our_node_id = PROVISIONAL_NODE_ID;
+
+/**
+ * The assigned node id is kept in RTC memory so it survives deep sleep, and in NVS so it survives a power cycle. A
+ * node that wakes with an id only has to renew its lease with the hub instead of waiting to be provisioned again.
+ */
+RTC_DATA_ATTR static uint8_t rtc_node_id = PROVISIONAL_NODE_ID;
+
+/**
+ * Idempotency keys go on across wakes, since our parent may still hold custody of packets from an earlier wake under
+ * the keys we'd otherwise hand out again. The counter is kept in RTC memory and, every IDEMPOTENCY_KEY_STORE_EVERY
+ * keys, in NVS so that a power cycle skips past anything handed out since.
+ */
+RTC_DATA_ATTR static uint8_t rtc_idempotency_key;
+RTC_DATA_ATTR static bool rtc_idempotency_key_valid = false;
 uint16_t dp_value_handle;
 
 /**
@@ -39,6 +85,22 @@ static int mn_receive_data(uint16_t conn_handle, uint16_t attr_handle,
 
 static void mn_process_packet(struct mesh_data_packet *packet);
 static void mn_forward_packet(struct mesh_peer *peer, void *packet);
+static void mn_update_conn_profile(void);
+
+/** The up to two upstream peers a multipath packet is sent through. */
+struct mn_parents {
+    struct mesh_peer *peers[2];
+};
+
+struct mn_forward_arg {
+    struct mesh_data_packet *packet;
+
+    /** Peer the packet came from, it is not sent back there. */
+    uint16_t exclude_conn_handle;
+
+    /** Whether the packet goes to the links leading to the hub or to our children. */
+    bool upstream;
+};
 
 static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
         {
@@ -75,14 +137,263 @@ mesh_node_get_node_id() {
     return our_node_id;
 }
 
+static void
+mn_store_node_id(uint8_t node_id) {
+    nvs_handle_t my_handle;
+
+    esp_err_t err = nvs_open("io.morrissey", NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) {
+        LOGE("Error (%s) opening NVS handle for storing node id!", esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_u8(my_handle, NODE_ID_STORE_KEY, node_id);
+    if (err != ESP_OK) {
+        LOGE("Error (%s) storing node id %d!", esp_err_to_name(err), node_id);
+    } else {
+        nvs_commit(my_handle);
+    }
+
+    nvs_close(my_handle);
+}
+
+static void
+mn_load_node_id() {
+    nvs_handle_t my_handle;
+    uint8_t node_id;
+
+    if (rtc_node_id != PROVISIONAL_NODE_ID) {
+        LOGI("Reusing node id %d kept in RTC memory", rtc_node_id);
+        our_node_id = rtc_node_id;
+        return;
+    }
+
+    esp_err_t err = nvs_open("io.morrissey", NVS_READONLY, &my_handle);
+    if (err != ESP_OK) {
+        return;
+    }
+
+    err = nvs_get_u8(my_handle, NODE_ID_STORE_KEY, &node_id);
+    if (err == ESP_OK && node_id != PROVISIONAL_NODE_ID && node_id != HUB_NODE_ID) {
+        LOGI("Reusing node id %d stored in NVS", node_id);
+        our_node_id = node_id;
+        rtc_node_id = node_id;
+    }
+
+    nvs_close(my_handle);
+}
+
+static void
+mn_store_idempotency_key(uint8_t key) {
+    nvs_handle_t my_handle;
+
+    esp_err_t err = nvs_open("io.morrissey", NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) {
+        LOGE("Error (%s) opening NVS handle for storing idempotency key!", esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_u8(my_handle, IDEMPOTENCY_KEY_STORE_KEY, key);
+    if (err != ESP_OK) {
+        LOGE("Error (%s) storing idempotency key %d!", esp_err_to_name(err), key);
+    } else {
+        nvs_commit(my_handle);
+    }
+
+    nvs_close(my_handle);
+}
+
+static void
+mn_load_idempotency_key() {
+    nvs_handle_t my_handle;
+    uint8_t key;
+    esp_err_t err;
+
+    if (rtc_idempotency_key_valid) {
+        return;
+    }
+
+    err = nvs_open("io.morrissey", NVS_READONLY, &my_handle);
+    if (err == ESP_OK) {
+        err = nvs_get_u8(my_handle, IDEMPOTENCY_KEY_STORE_KEY, &key);
+        nvs_close(my_handle);
+    }
+
+    if (err == ESP_OK) {
+        // Keys up to a whole block past the stored one may have been handed out before we lost power.
+        rtc_idempotency_key = key + IDEMPOTENCY_KEY_STORE_EVERY;
+    } else {
+        // Provisional nodes all share a source id, a random start keeps them from using the same keys.
+        rtc_idempotency_key = esp_random();
+    }
+
+    rtc_idempotency_key_valid = true;
+    mn_store_idempotency_key(rtc_idempotency_key);
+}
+
 void
 mesh_node_set_node_id(uint8_t node_id) {
     our_node_id = node_id;
+
+    if (rtc_node_id != node_id) {
+        rtc_node_id = node_id;
+        mn_store_node_id(node_id);
+    }
+}
+
+static uint8_t
+mn_peer_hops_to_hub(const struct mesh_peer *peer) {
+    if (peer->role == MESH_PEER_ROLE_HUB) {
+        return 0;
+    }
+    return peer->hops_to_hub;
+}
+
+static void
+mn_min_hops_to_hub(struct mesh_peer *peer, void *arg) {
+    uint8_t *min_hops = arg;
+    uint8_t hops;
+
+    hops = mn_peer_hops_to_hub(peer);
+    if (hops < *min_hops) {
+        *min_hops = hops;
+    }
+}
+
+/**
+ * Returns how many hops this node is from the hub, or MESH_PEER_HOPS_UNKNOWN if we don't know yet.
+ */
+uint8_t
+mesh_node_get_hop_depth() {
+    uint8_t min_hops = MESH_PEER_HOPS_UNKNOWN;
+
+    mesh_peer_exec_for_each(mn_min_hops_to_hub, &min_hops);
+    return min_hops == MESH_PEER_HOPS_UNKNOWN ? MESH_PEER_HOPS_UNKNOWN : min_hops + 1;
+}
+
+/**
+ * Learns how far the upstream peer a packet from the hub came through is from the hub, based on how much of its ttl
+ * the packet used up on the way. The latest packet wins, so the count follows the peer when its own path to the hub
+ * gets longer. Nothing is learned from children, their counts lead back through us. A count goes with its link.
+ */
+static void
+mn_learn_hops_to_hub(uint16_t conn_handle, struct mesh_data_packet *packet) {
+    struct mesh_peer *peer;
+    uint8_t hops;
+
+    if (packet->source != HUB_NODE_ID || packet->ttl > std_ttl) {
+        return;
+    }
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer == NULL || !mesh_peer_is_upstream(peer)) {
+        return;
+    }
+
+    hops = std_ttl - packet->ttl;
+    if (hops != peer->hops_to_hub) {
+        LOGD("Peer with conn handle %d is %d hops from the hub", conn_handle, hops);
+        peer->hops_to_hub = hops;
+    }
+}
+
+/**
+ * Expected transmissions to get a packet to the hub through the peer: the cost of our link to it, plus one for
+ * each hop it is from the hub. A lossy link to a close peer can lose out to a clean link to one further away.
+ */
+static uint16_t
+mn_parent_cost(const struct mesh_peer *peer) {
+    return mn_peer_hops_to_hub(peer) * MESH_PEER_ETX_ONE + mesh_peer_link_cost(peer);
+}
+
+/**
+ * Keeps the two upstream peers with the cheapest path to the hub. Peers we don't know a distance for are never
+ * parents, and neither are our children.
+ */
+static void
+mn_consider_parent(struct mesh_peer *peer, void *arg) {
+    struct mn_parents *parents = arg;
+    uint16_t cost;
+
+    if (!mesh_peer_is_upstream(peer) || mn_peer_hops_to_hub(peer) == MESH_PEER_HOPS_UNKNOWN) {
+        return;
+    }
+
+    cost = mn_parent_cost(peer);
+    if (parents->peers[0] == NULL || cost < mn_parent_cost(parents->peers[0])) {
+        parents->peers[1] = parents->peers[0];
+        parents->peers[0] = peer;
+    } else if (parents->peers[1] == NULL || cost < mn_parent_cost(parents->peers[1])) {
+        parents->peers[1] = peer;
+    }
+}
+
+/**
+ * Picks the upstream peers for a multipath packet. The second parent is only kept if it is no further from the hub
+ * than the first, so it can't be reaching the hub through the first on a shortest path. That is all hop counts tell
+ * us, two parents at the same depth may still share a relay further up, in which case the copies merge there.
+ */
+static void
+mn_select_parents(struct mn_parents *parents) {
+    memset(parents, 0, sizeof *parents);
+    mesh_peer_exec_for_each(mn_consider_parent, parents);
+
+    if (parents->peers[1] != NULL &&
+        mn_peer_hops_to_hub(parents->peers[1]) > mn_peer_hops_to_hub(parents->peers[0])) {
+        parents->peers[1] = NULL;
+    }
+}
+
+static bool
+mn_forwarded_recently(struct mesh_data_packet *packet) {
+    uint16_t id = (packet->source << 8) | packet->idempotency_key;
+    int i;
+
+    for (i = 0; i < FORWARD_DEDUP_SIZE; i++) {
+        if (forwarded_packets[i] == id) {
+            return true;
+        }
+    }
+
+    forwarded_packets[forwarded_packets_next] = id;
+    forwarded_packets_next = (forwarded_packets_next + 1) % FORWARD_DEDUP_SIZE;
+    return false;
+}
+
+void
+mesh_node_set_sleep_deadline(TickType_t sleep_at) {
+    sleep_at_tick = sleep_at;
+}
+
+/**
+ * Gives a request we originate the time left until we sleep as its deadline. A request is resent with a fresh key on
+ * the next wake, so a copy that can't make it back before we sleep is only wasted airtime. Packets that don't await
+ * a response, such as readings, carry no deadline and stay in custody across sleep until they reach the hub.
+ */
+static void
+mn_stamp_deadline(struct mesh_data_packet *packet) {
+    TickType_t now;
+    uint32_t time_left_ms;
+
+    if (sleep_at_tick == 0 || packet->source != our_node_id) {
+        return;
+    }
+
+    now = xTaskGetTickCount();
+    time_left_ms = sleep_at_tick > now ? (sleep_at_tick - now) * portTICK_PERIOD_MS : 1;
+    packet->deadline_ms = time_left_ms > UINT16_MAX ? UINT16_MAX : time_left_ms;
 }
 
 uint8_t
 mesh_node_next_idempotency_key() {
-    return idempotency_key_counter++;
+    uint8_t key;
+
+    key = rtc_idempotency_key++;
+    if (rtc_idempotency_key % IDEMPOTENCY_KEY_STORE_EVERY == 0) {
+        mn_store_idempotency_key(rtc_idempotency_key);
+    }
+
+    return key;
 }
 
 static void
@@ -108,6 +419,118 @@ mn_set_resend_flag(xTimerHandle ev) {
     resend_packets = true;
 }
 
+static void
+mn_forward_packet_except(struct mesh_peer *peer, void *arg) {
+    struct mn_forward_arg *forward_arg;
+
+    forward_arg = arg;
+    if (peer->conn_handle != forward_arg->exclude_conn_handle &&
+        mesh_peer_is_upstream(peer) == forward_arg->upstream) {
+        mn_forward_packet(peer, forward_arg->packet);
+    }
+}
+
+/**
+ * Sends a packet for the hub to our best parent, and to the second best as well for multipath packets. Until we have
+ * learned how far our upstream links are from the hub it goes to all of them. It never goes down to our children or
+ * back to the peer it came from.
+ */
+static void
+mn_send_upstream(struct mesh_data_packet *packet, uint16_t from_conn_handle, bool multipath) {
+    struct mn_forward_arg forward_arg = {
+            .packet = packet,
+            .exclude_conn_handle = from_conn_handle,
+            .upstream = true
+    };
+    struct mn_parents parents;
+    int i;
+
+    mn_select_parents(&parents);
+    if (parents.peers[0] == NULL) {
+        mesh_peer_exec_for_each(mn_forward_packet_except, &forward_arg);
+        return;
+    }
+
+    for (i = 0; i < (multipath ? 2 : 1); i++) {
+        if (parents.peers[i] != NULL && parents.peers[i]->conn_handle != from_conn_handle) {
+            mn_forward_packet(parents.peers[i], packet);
+        }
+    }
+}
+
+/**
+ * Sends a packet from the hub on to our children, except the one it came from.
+ */
+static void
+mn_send_downstream(struct mesh_data_packet *packet, uint16_t from_conn_handle) {
+    struct mn_forward_arg forward_arg = {
+            .packet = packet,
+            .exclude_conn_handle = from_conn_handle,
+            .upstream = false
+    };
+
+    mesh_peer_exec_for_each(mn_forward_packet_except, &forward_arg);
+}
+
+/**
+ * Hands a packet in custody to our best parent. The send records the parent, see mn_forward_packet, and only its ack
+ * releases our custody.
+ */
+static void
+mn_send_custody_packet(struct mesh_data_packet *packet, uint16_t from_conn_handle) {
+    mn_send_upstream(packet, from_conn_handle, false);
+}
+
+/**
+ * Takes custody of an upstream packet. Custody stays with us until the next hop acknowledges it.
+ */
+static int
+mn_take_custody(struct mesh_data_packet *packet, uint16_t from_conn_handle, TickType_t received_at) {
+    int rc;
+
+    rc = mesh_custody_store(packet, from_conn_handle, received_at);
+    if (rc == 0) {
+        mn_start_resend_packets_timer();
+        mn_update_conn_profile();
+    }
+    return rc;
+}
+
+/**
+ * Tells the previous hop that we took custody of the packet so it can stop retrying it. The ack goes to that one
+ * peer only and is never forwarded.
+ */
+static void
+mn_send_custody_ack(uint16_t conn_handle, struct mesh_data_packet *packet) {
+    struct mesh_data_packet *ack_packet;
+    struct mesh_peer *peer;
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer == NULL) {
+        return;
+    }
+
+    ack_packet = mdp_alloc(2 * SOB);
+    ack_packet->type = PT_CUSTODY_ACK;
+    ack_packet->source = our_node_id;
+    ack_packet->dest = packet->source;
+    ack_packet->ttl = 0;
+    ack_packet->idempotency_key = mesh_node_next_idempotency_key();
+    ack_packet->data_length = 2 * SOB;
+    ack_packet->data[0] = packet->source;
+    ack_packet->data[1] = packet->idempotency_key;
+
+    mn_forward_packet(peer, ack_packet);
+    mdp_free(ack_packet);
+}
+
+static void
+mn_sample_link_rssi(struct mesh_peer *peer, void *arg) {
+    if (peer->role != MESH_PEER_ROLE_UNKNOWN) {
+        mesh_peer_link_sample_rssi(peer);
+    }
+}
+
 /**
  * This function checks for packets that are awaiting response and resends.
  */
@@ -120,21 +543,56 @@ mesh_node_resend_packets_if_needed()
 
     if (resend_packets) {
         resend_packets = false;
+
+        // Refresh the signal part of the link estimates before anything is resent.
+        mesh_peer_exec_for_each(mn_sample_link_rssi, NULL);
+
         LOGI("Resending packets...");
         SLIST_FOREACH(par_to_resend, &pars, next) {
             total_pars++;
 
             next_idempotency_key = mesh_node_next_idempotency_key();
             memcpy(&par_to_resend->packet->idempotency_key, &next_idempotency_key, SOB);
-            mesh_peer_exec_for_each(mn_forward_packet, par_to_resend->packet);
+            mn_stamp_deadline(par_to_resend->packet);
+            mn_send_upstream(par_to_resend->packet, BLE_HS_CONN_HANDLE_NONE, false);
         }
 
-        if (total_pars == 0) {
+        // Packets we hold custody of are retried from here rather than by their originator.
+        mesh_custody_deliver(mn_send_custody_packet);
+
+        if (total_pars == 0 && mesh_custody_count() == 0) {
             mn_stop_resend_packets_timer();
         }
+        mn_update_conn_profile();
     }
 }
 
+static void
+mn_set_peer_conn_profile(struct mesh_peer *peer, void *profile) {
+    if (peer->role != MESH_PEER_ROLE_UNKNOWN) {
+        mesh_peer_set_conn_profile(peer, *(uint8_t *)profile);
+    }
+}
+
+/**
+ * Keeps connections in the burst profile while we are waiting on responses, hold packets in custody or have acks
+ * queued, and lets them drop to the idle hold profile once nothing is in flight. Peers still being discovered keep
+ * the burst profile they were connected with. Only the connections we are central of follow our traffic, the
+ * others follow their central's.
+ */
+static void
+mn_update_conn_profile(void) {
+    uint8_t profile;
+
+    if (!SLIST_EMPTY(&pars) || mesh_custody_count() > 0 || pending_ack_count > 0) {
+        profile = MESH_PEER_CONN_PROFILE_BURST;
+    } else {
+        profile = MESH_PEER_CONN_PROFILE_IDLE;
+    }
+
+    mesh_peer_exec_for_each(mn_set_peer_conn_profile, &profile);
+}
+
 void
 mesh_node_disconnect(struct mesh_peer *peer, void *data) {
     LOGI("Terminating connection to peer with connection handle %d", peer->conn_handle);
@@ -143,7 +601,7 @@ mesh_node_disconnect(struct mesh_peer *peer, void *data) {
 }
 
 static int
-mn_write_data_to_buf(struct os_mbuf *om, void *dst)
+mn_write_data_to_buf(struct os_mbuf *om, void *dst, uint16_t *out_len)
 {
     uint16_t om_len;
     int rc;
@@ -155,7 +613,7 @@ mn_write_data_to_buf(struct os_mbuf *om, void *dst)
         return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
     }
 
-    rc = ble_hs_mbuf_to_flat(om, dst, DATA_PACKET_MAX_SIZE, NULL);
+    rc = ble_hs_mbuf_to_flat(om, dst, DATA_PACKET_MAX_SIZE, out_len);
     if (rc != 0) {
         return BLE_ATT_ERR_UNLIKELY;
     }
@@ -194,6 +652,7 @@ mn_add_packet_awaiting_response(struct mesh_data_packet *packet) {
     mdp_print_packet(tmp_par->packet);
 
     mn_start_resend_packets_timer();
+    mn_update_conn_profile();
 
     return 0;
 }
@@ -230,7 +689,10 @@ mesh_node_packet_response_received(struct mesh_data_packet *packet) {
     LOGI("Received response for packet with type %d", packet->type);
     if (packet->type == PT_NODE_CONNECTED_RESP) {
         mn_remove_packet_awaiting_response(PT_NODE_CONNECTED);
+    } else if (packet->type == PT_NODE_LEASE_RENEW_RESP) {
+        mn_remove_packet_awaiting_response(PT_NODE_LEASE_RENEW);
     }
+    mn_update_conn_profile();
 }
 
 int
@@ -259,6 +721,7 @@ mn_packet_resender_init() {
             (void *)0,
             mn_set_resend_flag
     );
+    return 0;
 
 err:
     free(par_mem);
@@ -282,10 +745,106 @@ mesh_node_send_empty_packet(uint8_t packet_type, bool await_response) {
     mesh_node_send_packet(packet, await_response);
 }
 
+static void
+mn_stop_ack_flush_callout() {
+    ble_npl_callout_stop(&ack_flush_callout);
+}
+
+/**
+ * Moves as many pending acks as fit onto a packet we originate for the hub.
+ */
+static void
+mn_attach_pending_acks(struct mesh_data_packet *packet) {
+    uint8_t count;
+
+    if (pending_ack_count == 0 || packet->type == PT_ACKS ||
+        packet->source != our_node_id || packet->dest != HUB_NODE_ID) {
+        return;
+    }
+
+    count = DATA_PACKET_MAX_ACKS - packet->ack_count;
+    if (count > pending_ack_count) {
+        count = pending_ack_count;
+    }
+
+    memcpy(packet->acks + packet->ack_count, pending_acks, count);
+    packet->ack_count += count;
+
+    pending_ack_count -= count;
+    memmove(pending_acks, pending_acks + count, pending_ack_count);
+
+    LOGD("Piggybacked %d acks on packet with type %d", count, packet->type);
+    if (pending_ack_count == 0) {
+        mn_stop_ack_flush_callout();
+    }
+}
+
 void
-mesh_node_send_packet(struct mesh_data_packet *packet, bool await_response) {
+mesh_node_flush_acks() {
+    struct mesh_data_packet *packet;
+
+    mn_stop_ack_flush_callout();
+    if (pending_ack_count == 0) {
+        return;
+    }
+
+    LOGI("Sending %d pending acks in a standalone packet", pending_ack_count);
+    packet = mdp_alloc(pending_ack_count);
+    packet->type = PT_ACKS;
+    packet->source = our_node_id;
+    packet->dest = HUB_NODE_ID;
+    packet->ttl = std_ttl;
+    packet->idempotency_key = mesh_node_next_idempotency_key();
+    packet->data_length = pending_ack_count;
+    memcpy(packet->data, pending_acks, pending_ack_count);
+
+    pending_ack_count = 0;
+
+    mesh_node_send_packet(packet, false);
+}
+
+static void
+mn_flush_acks_ev(struct ble_npl_event *ev) {
+    mesh_node_flush_acks();
+}
+
+void
+mesh_node_queue_ack(uint8_t ack_pt) {
+    int i;
+
+    for (i = 0; i < pending_ack_count; i++) {
+        if (pending_acks[i] == ack_pt) {
+            return;
+        }
+    }
+
+    if (pending_ack_count == DATA_PACKET_MAX_ACKS) {
+        mesh_node_flush_acks();
+    }
+
+    LOGD("Queueing ack with type %d", ack_pt);
+    pending_acks[pending_ack_count++] = ack_pt;
+
+    if (!ble_npl_callout_is_active(&ack_flush_callout)) {
+        ble_npl_callout_reset(&ack_flush_callout, ble_npl_time_ms_to_ticks32(ACK_FLUSH_DEADLINE_IN_MS));
+    }
+    mn_update_conn_profile();
+}
+
+static void
+mn_send_packet(struct mesh_data_packet *packet, bool await_response, bool multipath) {
+    mn_attach_pending_acks(packet);
+    if (await_response) {
+        mn_stamp_deadline(packet);
+    }
     mdp_print_packet(packet);
-    mesh_peer_exec_for_each(mn_forward_packet, (void *) packet);
+
+    if (!await_response && packet->source == our_node_id && packet->dest == HUB_NODE_ID) {
+        // Keep our own upstream packets until a parent takes custody of them.
+        mn_take_custody(packet, BLE_HS_CONN_HANDLE_NONE, xTaskGetTickCount());
+    }
+
+    mn_send_upstream(packet, BLE_HS_CONN_HANDLE_NONE, multipath);
 
     if (await_response) {
         mn_add_packet_awaiting_response(packet);
@@ -294,6 +853,31 @@ mesh_node_send_packet(struct mesh_data_packet *packet, bool await_response) {
     mn_print_packets_awaiting_response();
 }
 
+/**
+ * Sends a packet we originate towards the hub through our best parent.
+ */
+void
+mesh_node_send_packet(struct mesh_data_packet *packet, bool await_response) {
+    mn_send_packet(packet, await_response, false);
+}
+
+/**
+ * Sends a packet to a single peer only, for packets that go hop by hop rather than across the mesh.
+ */
+void
+mesh_node_send_packet_to_peer(struct mesh_peer *peer, struct mesh_data_packet *packet) {
+    mn_forward_packet(peer, packet);
+}
+
+/**
+ * Sends an upstream packet over the two best disjoint parent links at once, so one flaky path doesn't hold it up
+ * until the next resend. Relays and the hub merge the copies.
+ */
+void
+mesh_node_send_packet_multipath(struct mesh_data_packet *packet, bool await_response) {
+    mn_send_packet(packet, await_response, true);
+}
+
 uint8_t *
 mesh_node_get_node_addr() {
     uint8_t addr_type;
@@ -313,12 +897,18 @@ mesh_node_connection_available() {
         struct mesh_data_packet *connected_packet;
         uint8_t *node_addr = mesh_node_get_node_addr();
 
-        LOGI_("Connected to a peer, sending connected data packet, own addr: ");
+        connected_packet = mdp_alloc(BT_ADDRESS_SIZE);
+        if (our_node_id == PROVISIONAL_NODE_ID) {
+            LOGI_("Connected to a peer, sending connected data packet, own addr: ");
+            connected_packet->type = PT_NODE_CONNECTED;
+        } else {
+            // We already have an id from a previous wake, so keep using it and just let the hub revalidate it.
+            LOGI_("Connected to a peer, renewing lease on node id %d, own addr: ", our_node_id);
+            connected_packet->type = PT_NODE_LEASE_RENEW;
+        }
         mesh_print_addr(node_addr);
         LOGI__("\n");
 
-        connected_packet = mdp_alloc(BT_ADDRESS_SIZE);
-        connected_packet->type = PT_NODE_CONNECTED;
         connected_packet->source = our_node_id;
         connected_packet->dest = HUB_NODE_ID;
         connected_packet->idempotency_key = mesh_node_next_idempotency_key();
@@ -326,8 +916,11 @@ mesh_node_connection_available() {
         connected_packet->data_length = BT_ADDRESS_SIZE;
         memcpy(connected_packet->data, node_addr, BT_ADDRESS_SIZE);
 
-        mesh_node_send_packet(connected_packet, true);
+        mesh_node_send_packet_multipath(connected_packet, true);
     }
+
+    // A new path may lead upstream, so try to hand over anything we're holding.
+    mesh_custody_deliver(mn_send_custody_packet);
 }
 
 static bool
@@ -340,7 +933,7 @@ mn_packet_next_step(struct mesh_data_packet *packet) {
     uint8_t *my_address;
 
     if (packet->dest == our_node_id) {
-        if (packet->type == (PT_NODE_CONNECTED_RESP)) {
+        if (packet->type == PT_NODE_CONNECTED_RESP || packet->type == PT_NODE_LEASE_RENEW_RESP) {
             // We have a connected response, but it may not be for us. We need to check the address in data
             // matches our address. If it does, we need to process it.
             my_address = mesh_node_get_node_addr();
@@ -358,6 +951,7 @@ mn_packet_next_step(struct mesh_data_packet *packet) {
             return PACKET_DECISION_PROCESS;
         }
     } else if (packet->type == PT_GO_TO_SLEEP) {
+        // Processing passes it on down the tree, see mesh_shutdown.h.
         return PACKET_DECISION_PROCESS;
     } else if (packet->ttl == 0) {
         return PACKET_DECISION_TERMINATE;
@@ -366,90 +960,215 @@ mn_packet_next_step(struct mesh_data_packet *packet) {
     }
 }
 
+/**
+ * Takes custody of an upstream packet, acks it back to the hop it came from and passes it on. If there is no other
+ * peer to pass it to yet, it waits in the custody queue until one shows up. Every send out of custody takes the time
+ * since the packet reached us off its deadline, however long it waited.
+ */
+static void
+mn_forward_upstream(uint16_t conn_handle, struct mesh_data_packet *packet, TickType_t received_at) {
+    int rc;
+
+    if (mn_forwarded_recently(packet)) {
+        // Another copy already went through us, only let the sender know it can stop retrying.
+        LOGD("Merging duplicate of packet from %d with key %d", packet->source, packet->idempotency_key);
+        mn_send_custody_ack(conn_handle, packet);
+        return;
+    }
+
+    rc = mn_take_custody(packet, conn_handle, received_at);
+    if (rc == 0 || rc == BLE_HS_EALREADY) {
+        mn_send_custody_ack(conn_handle, packet);
+    }
+
+    if (rc == 0) {
+        mesh_custody_deliver_packet(packet->source, packet->idempotency_key, mn_send_custody_packet);
+    } else if (rc != BLE_HS_EALREADY) {
+        // No room to take custody, pass it on as is and leave retrying to the previous hop.
+        if (mdp_age_deadline(packet, (xTaskGetTickCount() - received_at) * portTICK_PERIOD_MS,
+                             DEADLINE_MIN_HOP_BUDGET_MS)) {
+            mn_send_custody_packet(packet, conn_handle);
+        }
+    }
+}
+
 static int
 mn_receive_data(uint16_t conn_handle, uint16_t attr_handle,
                 struct ble_gatt_access_ctxt *ctxt,
                 void *arg) {
     const ble_uuid_t *uuid;
     uint8_t packed_data[DATA_PACKET_MAX_SIZE] = {0};
-    struct mesh_data_packet data_packet;
+    uint16_t packed_len;
     int rc = 0;
 
     uuid = ctxt->chr->uuid;
     if (ble_uuid_cmp(uuid, &gatt_chr_w_data_uuid.u) == 0) {
         assert(ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR);
-        rc = mn_write_data_to_buf(ctxt->om, (void *) packed_data);
+        rc = mn_write_data_to_buf(ctxt->om, (void *) packed_data, &packed_len);
         if (rc != 0) {
             LOGE("Error while writing data from om buffer to packed data buffer; rc=%d", rc);
             return rc;
         }
 
-        mdp_unpack(packed_data, &data_packet);
-        mdp_print_packet(&data_packet);
+        mesh_transport_received(conn_handle, packed_data, packed_len);
+    }
+    return rc;
+}
 
-        switch(mn_packet_next_step(&data_packet)) {
-            case PACKET_DECISION_FORWARD:
-                LOGD("Forwarding packet...");
-                // Decrement ttl so that the packet will eventually stop flooding the network.
-                data_packet.ttl -= 1;
-                mesh_peer_exec_for_each(mn_forward_packet, &data_packet);
+/**
+ * Handles a packed packet that arrived from a peer, whichever transport carried it.
+ */
+static void
+mn_receive_packed(uint16_t conn_handle, uint8_t *packed_data, uint16_t packed_len) {
+    struct mesh_data_packet data_packet;
+    TickType_t received_at;
+
+    received_at = xTaskGetTickCount();
+    if (packed_len < DATA_PACKET_MIN_SIZE || packed_len > DATA_PACKET_MAX_SIZE) {
+        LOGE("Dropping packet with invalid length %d", packed_len);
+        return;
+    }
+
+    mdp_unpack(packed_data, packed_len, &data_packet);
+    mdp_print_packet(&data_packet);
+
+    mn_learn_hops_to_hub(conn_handle, &data_packet);
+
+    if (data_packet.type == PT_CUSTODY_ACK) {
+        if (data_packet.data_length < 2 * SOB) {
+            LOGW("Dropping custody ack with only %d bytes of data", data_packet.data_length);
+            goto done;
+        }
+        // The next hop has our packet, so we no longer need to retry it. Only a parent we handed it to can say so.
+        mesh_custody_release(data_packet.data[0], data_packet.data[1], conn_handle);
+        goto done;
+    }
+
+    if (data_packet.type == PT_GO_TO_SLEEP_ACK) {
+        mesh_shutdown_ack_received(conn_handle, &data_packet);
+        goto done;
+    }
+
+    if (data_packet.type == PT_SUBTREE_ASLEEP) {
+        mesh_shutdown_report_received(conn_handle, &data_packet);
+        goto done;
+    }
+
+    if (data_packet.type == PT_GO_TO_SLEEP && !mesh_shutdown_received(conn_handle, &data_packet)) {
+        // We're already shutting down, the copy only needed acking.
+        goto done;
+    }
+
+    switch(mn_packet_next_step(&data_packet)) {
+        case PACKET_DECISION_FORWARD:
+            LOGD("Forwarding packet...");
+            // Decrement ttl so that the packet will eventually stop flooding the network.
+            data_packet.ttl -= 1;
+            if (data_packet.dest == HUB_NODE_ID) {
+                // Custody ages the deadline whenever it sends the packet on.
+                mn_forward_upstream(conn_handle, &data_packet, received_at);
                 break;
-            case PACKET_DECISION_PROCESS:
-                LOGD("Processing packet...");
-                mn_process_packet(&data_packet);
+            }
+            // Take the time the packet spent with us off its deadline and drop it if it can no longer make it.
+            if (!mdp_age_deadline(&data_packet, (xTaskGetTickCount() - received_at) * portTICK_PERIOD_MS,
+                                  DEADLINE_MIN_HOP_BUDGET_MS)) {
+                LOGD("Dropping packet that can't make its deadline.");
                 break;
-            case PACKET_DECISION_TERMINATE:
-                LOGD("Terminating packet.");
-                // Do nothing as the packet stops here without being processed.
+            }
+            if (mn_forwarded_recently(&data_packet)) {
+                // A second parent passed us the same packet, our children already have it.
                 break;
-        }
-        mesh_node_resend_packets_if_needed();
-        return rc;
-
+            }
+            mdp_age_mesh_time(&data_packet, (xTaskGetTickCount() - received_at) * portTICK_PERIOD_MS);
+            mn_send_downstream(&data_packet, conn_handle);
+            break;
+        case PACKET_DECISION_PROCESS:
+            LOGD("Processing packet...");
+            mn_process_packet(&data_packet);
+            break;
+        case PACKET_DECISION_TERMINATE:
+            LOGD("Terminating packet.");
+            // Do nothing as the packet stops here without being processed.
+            break;
     }
-    return rc;
+    mesh_node_resend_packets_if_needed();
+
+done:
+    // Handlers and custody keep copies of their own, the data mdp_unpack allocated is ours to free.
+    free(data_packet.data);
 }
 
-static int
-mn_on_forward_packet(uint16_t conn_handle,
-                     const struct ble_gatt_error *error,
-                     struct ble_gatt_attr *attr,
-                     void *arg) {
-    return 0;
+static void
+mn_on_transport_done(uint16_t conn_handle, int status) {
+    struct mesh_peer *peer;
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer == NULL) {
+        return;
+    }
+
+    mesh_peer_link_record(peer, status == 0);
+
+    if (status == BLE_HS_ATT_ERR(BLE_ATT_ERR_INVALID_HANDLE)) {
+        // The handle we cached for this neighbor is stale. Drop the link so it's rediscovered when we reconnect.
+        LOGW("Write to peer with conn handle %d used a stale handle", conn_handle);
+        mesh_neighbor_forget(&peer->addr);
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
 }
 
 void
 mn_forward_packet(struct mesh_peer *peer, void *packet) {
+    const struct mesh_transport *transport;
     struct mesh_data_packet *data_packet;
-    uint8_t *packed_data;
+    uint8_t packed_data[DATA_PACKET_MAX_SIZE];
     uint8_t packed_data_len;
-    const struct mesh_peer_chr *chr;
-    struct os_mbuf *om;
-    int rc;
+    bool attempted = false;
+    bool oversized = false;
+    int rc = BLE_HS_ENOTCONN;
 
     data_packet = (struct mesh_data_packet *)packet;
 
-    packed_data = calloc(DATA_PACKET_MAX_SIZE, SOB);
-
     mdp_pack(packed_data, &packed_data_len, DATA_PACKET_MAX_SIZE, data_packet);
     LOGD("Packed data length when forwarding is %d, conn handle is %d", packed_data_len, peer->conn_handle);
 
-    chr = mesh_peer_chr_find_uuid(peer,
-                                  BLE_UUID16_DECLARE(GATT_SVR_SVC_DATA_UUID),
-                                  BLE_UUID16_DECLARE(GATT_CHR_W_DATA_UUID));
-    // All nodes have the data write characteristic. Only the hub does not, so we send the data through notification.
-    if (chr == NULL) {
-        om = ble_hs_mbuf_from_flat(packed_data, packed_data_len);
-        rc = ble_gattc_notify_custom(peer->conn_handle, dp_value_handle, om);
-        if (rc != 0) { LOGE("Error sending notification to hub, rc=%d", rc); }
-    } else {
-        rc = ble_gattc_write_flat(peer->conn_handle, chr->chr.val_handle,
-                                  packed_data, packed_data_len, mn_on_forward_packet, NULL);
-        if (rc != 0) {
-            LOGE("Error: Failed to write characteristic; rc=%d\n", rc);
+    // No transport while the peer is still being discovered, it isn't ready to take packets.
+    for (transport = mesh_transport_for_peer(peer); transport != NULL; transport = transport->fallback) {
+        if (packed_data_len > transport->mtu(peer)) {
+            LOGD("Packet of %d bytes doesn't fit %s to peer with handle %d yet",
+                 packed_data_len, transport->name, peer->conn_handle);
+            oversized = true;
+            continue;
         }
+
+        attempted = true;
+        rc = transport->send(peer, packed_data, packed_data_len);
+        if (rc == 0) {
+            break;
+        }
+    }
+
+    if (!attempted && oversized) {
+        // Only notifications to the hub before the MTU exchange has finished. Custody resends the upstream packets it
+        // holds, anything else is lost.
+        oversized_drops++;
+        LOGW("Dropped packet with type %d of %d bytes to peer with handle %d; oversized drops=%" PRIu32,
+             data_packet->type, packed_data_len, peer->conn_handle, oversized_drops);
+    }
+
+    // Transports that confirm sends feed the link estimate from their completion instead.
+    if (attempted && rc != 0) {
+        mesh_peer_link_record(peer, false);
+    } else if (rc == 0 && !transport->confirms) {
+        mesh_peer_link_record(peer, true);
+    }
+
+    if (rc == 0 && data_packet->dest == HUB_NODE_ID &&
+        mesh_custody_handed_to(data_packet->source, data_packet->idempotency_key, peer->conn_handle) == 0 &&
+        peer->role == MESH_PEER_ROLE_HUB) {
+        // The hub doesn't ack custody, handing the packet to it is as far as custody goes.
+        mesh_custody_release(data_packet->source, data_packet->idempotency_key, peer->conn_handle);
     }
-    free(packed_data);
 }
 
 void
@@ -546,5 +1265,14 @@ mesh_node_init() {
         return rc;
     }
 
+    mesh_transport_set_handlers(mn_receive_packed, mn_on_transport_done);
+    ble_npl_callout_init(&ack_flush_callout, nimble_port_get_dflt_eventq(), mn_flush_acks_ev, NULL);
+
+    mn_load_node_id();
+    mn_load_idempotency_key();
+    mesh_custody_init();
+    mesh_shutdown_init();
+    memset(forwarded_packets, 0xff, sizeof forwarded_packets);
+
     return 0;
 }
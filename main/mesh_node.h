@@ -1,6 +1,7 @@
 #include "mesh_sensor_constants.h"
 #include "mesh_peer.h"
 #include "host/ble_hs.h"
+#include "freertos/FreeRTOS.h"
 
 #ifndef MESH_NODE_H
 #define MESH_NODE_H
@@ -8,6 +9,18 @@
 #define MAX_PACKETS 50
 #define PACKET_RESEND_CADENCE_IN_MS 10000
 
+/* How long an ack may wait for a packet to ride on before it is sent on its own. */
+#define ACK_FLUSH_DEADLINE_IN_MS 500
+
+/* Packets with less time than this left on their deadline are not worth another hop. */
+#define DEADLINE_MIN_HOP_BUDGET_MS 100
+
+/* Packets recently forwarded either way, remembered so copies arriving over a second path are merged. */
+#define FORWARD_DEDUP_SIZE 16
+
+/* Idempotency keys handed out between writes of the counter to NVS. */
+#define IDEMPOTENCY_KEY_STORE_EVERY 32
+
 /* Reserved node ids */
 #define HUB_NODE_ID 0
 #define PROVISIONAL_NODE_ID 1
@@ -37,6 +50,15 @@ mesh_node_disconnect(struct mesh_peer *peer, void *data);
 void
 mesh_node_send_packet(struct mesh_data_packet *packet, bool await_response);
 
+void
+mesh_node_send_packet_to_peer(struct mesh_peer *peer, struct mesh_data_packet *packet);
+
+void
+mesh_node_send_packet_multipath(struct mesh_data_packet *packet, bool await_response);
+
+uint8_t
+mesh_node_get_hop_depth();
+
 void
 mesh_node_resend_packets_if_needed();
 
@@ -46,6 +68,15 @@ mesh_node_next_idempotency_key();
 void
 mesh_node_send_empty_packet(uint8_t packet_type, bool await_response);
 
+void
+mesh_node_set_sleep_deadline(TickType_t sleep_at);
+
+void
+mesh_node_queue_ack(uint8_t ack_pt);
+
+void
+mesh_node_flush_acks();
+
 void
 mesh_node_packet_response_received(struct mesh_data_packet *packet);
 
@@ -18,40 +18,21 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "host/ble_hs.h"
 #include "mesh_peer.h"
 #include "mesh_sensor_constants.h"
 #include "mesh_sensor.h"
 
-static void *peer_svc_mem;
-static struct os_mempool peer_svc_pool;
-
-static void *peer_chr_mem;
-static struct os_mempool peer_chr_pool;
-
-static void *peer_dsc_mem;
-static struct os_mempool peer_dsc_pool;
-
-static void *peer_mem;
-static struct os_mempool peer_pool;
-static SLIST_HEAD(, mesh_peer) peers;
-
-static struct mesh_peer_svc *
-peer_svc_find_range(struct mesh_peer *peer, uint16_t attr_handle);
-static struct mesh_peer_svc *
-peer_svc_find(struct mesh_peer *peer, uint16_t svc_start_handle,
-              struct mesh_peer_svc **out_prev);
-int
-peer_svc_is_empty(const struct mesh_peer_svc *svc);
+/**
+ * Peers live in a fixed table. A peer's slot is found starting from its connection handle, and a small bucket index
+ * maps addresses to slots, so neither lookup walks a list.
+ */
+static struct mesh_peer *peer_table;
+static int peer_table_size;
+static uint8_t peer_addr_buckets[MESH_PEER_ADDR_BUCKETS];
 
-uint16_t
-chr_end_handle(const struct mesh_peer_svc *svc, const struct mesh_peer_chr *chr);
-int
-chr_is_empty(const struct mesh_peer_svc *svc, const struct mesh_peer_chr *chr);
-static struct mesh_peer_chr *
-peer_chr_find(const struct mesh_peer_svc *svc, uint16_t chr_val_handle,
-              struct mesh_peer_chr **out_prev);
 static void
 peer_disc_chrs(struct mesh_peer *peer);
 
@@ -63,9 +44,12 @@ peer_dsc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
 struct mesh_peer * mesh_peer_find(uint16_t conn_handle)
 {
     struct mesh_peer *peer;
+    int i;
 
-    SLIST_FOREACH(peer, &peers, next) {
-        if (peer->conn_handle == conn_handle) {
+    /* Connection handles are small and handed out in order, so the first probe almost always hits. */
+    for (i = 0; i < peer_table_size; i++) {
+        peer = &peer_table[(conn_handle + i) % peer_table_size];
+        if (peer->in_use && peer->conn_handle == conn_handle) {
             return peer;
         }
     }
@@ -73,12 +57,20 @@ struct mesh_peer * mesh_peer_find(uint16_t conn_handle)
     return NULL;
 }
 
+static uint8_t
+peer_addr_bucket(const ble_addr_t *addr)
+{
+    return (addr->val[0] ^ addr->val[1] ^ addr->val[2] ^ addr->type) % MESH_PEER_ADDR_BUCKETS;
+}
+
 struct mesh_peer *mesh_peer_find_by_addr(const ble_addr_t *addr) {
 
     struct mesh_peer *peer;
+    uint8_t slot;
 
-    SLIST_FOREACH(peer, &peers, next) {
-        if (ble_addr_cmp(peer->addr, addr) == 0) {
+    for (slot = peer_addr_buckets[peer_addr_bucket(addr)]; slot != 0; slot = peer->addr_next) {
+        peer = &peer_table[slot - 1];
+        if (ble_addr_cmp(&peer->addr, addr) == 0) {
             return peer;
         }
     }
@@ -86,69 +78,181 @@ struct mesh_peer *mesh_peer_find_by_addr(const ble_addr_t *addr) {
     return NULL;
 }
 
+static void
+peer_addr_index_remove(struct mesh_peer *peer)
+{
+    uint8_t *link;
+    uint8_t slot;
+
+    slot = peer - peer_table + 1;
+    for (link = &peer_addr_buckets[peer_addr_bucket(&peer->addr)]; *link != 0;
+         link = &peer_table[*link - 1].addr_next) {
+        if (*link == slot) {
+            *link = peer->addr_next;
+            return;
+        }
+    }
+}
+
+/**
+ * Caches what the forward path needs to know about the peer once discovery has finished.
+ */
+static void
+peer_cache_data_path(struct mesh_peer *peer)
+{
+    const struct mesh_peer_attr *chr;
+
+    chr = mesh_peer_chr_find_uuid(peer,
+                                  BLE_UUID16_DECLARE(GATT_SVR_SVC_DATA_UUID),
+                                  BLE_UUID16_DECLARE(GATT_CHR_W_DATA_UUID));
+    /* All nodes have the data write characteristic. Only the hub does not. */
+    if (chr == NULL) {
+        peer->role = MESH_PEER_ROLE_HUB;
+        peer->data_val_handle = 0;
+    } else {
+        peer->role = MESH_PEER_ROLE_NODE;
+        peer->data_val_handle = chr->val_handle;
+    }
+}
+
 static void peer_disc_complete(struct mesh_peer *peer, int rc)
 {
     peer->disc_prev_chr_val = 0;
 
+    if (rc == 0) {
+        peer_cache_data_path(peer);
+    }
+
+    LOGI("%s discovery of peer with handle %d finished in %d ms; rc=%d",
+         peer->disc_skip_dscs ? "Mesh service" : "Full", peer->conn_handle,
+         (int) ble_npl_time_ticks_to_ms32(ble_npl_time_get() - peer->disc_started_at), rc);
+
     /* Notify caller that discovery has completed. */
     if (peer->disc_cb != NULL) {
         peer->disc_cb(peer, rc, peer->disc_cb_arg);
     }
 }
 
-static struct mesh_peer_dsc *
-peer_dsc_find_prev(const struct mesh_peer_chr *chr, uint16_t dsc_handle)
+/**
+ * Returns the index of the attribute with the handle, or where it would be inserted if there is none.
+ */
+static int
+peer_attr_lower_bound(const struct mesh_peer *peer, uint16_t handle)
 {
-    struct mesh_peer_dsc *prev;
-    struct mesh_peer_dsc *dsc;
-
-    prev = NULL;
-    SLIST_FOREACH(dsc, &chr->dscs, next) {
-        if (dsc->dsc.handle >= dsc_handle) {
-            break;
+    int lo;
+    int hi;
+    int mid;
+
+    lo = 0;
+    hi = peer->attr_count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (peer->attrs[mid].handle < handle) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+
+    return lo;
+}
+
+/**
+ * Finds a discovered attribute by its handle: a service by its start handle, a characteristic by its definition
+ * handle or a descriptor by its handle.
+ */
+const struct mesh_peer_attr *
+mesh_peer_attr_find(const struct mesh_peer *peer, uint16_t handle)
+{
+    int i;
 
-        prev = dsc;
+    i = peer_attr_lower_bound(peer, handle);
+    if (i < peer->attr_count && peer->attrs[i].handle == handle) {
+        return &peer->attrs[i];
     }
 
-    return prev;
+    return NULL;
 }
 
-static struct mesh_peer_dsc *
-peer_dsc_find(const struct mesh_peer_chr *chr, uint16_t dsc_handle,
-              struct mesh_peer_dsc **out_prev)
+/**
+ * Returns the service whose handle range contains the handle. Services are never nested, so it's the closest
+ * service at or before the handle.
+ */
+static const struct mesh_peer_attr *
+peer_svc_find_range(const struct mesh_peer *peer, uint16_t attr_handle)
 {
-    struct mesh_peer_dsc *prev;
-    struct mesh_peer_dsc *dsc;
+    const struct mesh_peer_attr *attr;
+    int i;
 
-    prev = peer_dsc_find_prev(chr, dsc_handle);
-    if (prev == NULL) {
-        dsc = SLIST_FIRST(&chr->dscs);
-    } else {
-        dsc = SLIST_NEXT(prev, next);
+    i = peer_attr_lower_bound(peer, attr_handle);
+    if (i == peer->attr_count || peer->attrs[i].handle != attr_handle) {
+        i--;
     }
 
-    if (dsc != NULL && dsc->dsc.handle != dsc_handle) {
-        dsc = NULL;
+    for (; i >= 0; i--) {
+        attr = &peer->attrs[i];
+        if (attr->type == MESH_PEER_ATTR_SVC) {
+            return attr->end_handle >= attr_handle ? attr : NULL;
+        }
     }
 
-    if (out_prev != NULL) {
-        *out_prev = prev;
+    return NULL;
+}
+
+static int
+peer_attr_add(struct mesh_peer *peer, const struct mesh_peer_attr *attr)
+{
+    int i;
+
+    i = peer_attr_lower_bound(peer, attr->handle);
+    if (i < peer->attr_count && peer->attrs[i].handle == attr->handle) {
+        /* Attribute already discovered. */
+        return 0;
+    }
+
+    if (peer->attr_count == MESH_PEER_MAX_ATTRS) {
+        /* Out of memory. */
+        return BLE_HS_ENOMEM;
+    }
+
+    memmove(&peer->attrs[i + 1], &peer->attrs[i], (peer->attr_count - i) * sizeof peer->attrs[0]);
+    peer->attrs[i] = *attr;
+    peer->attr_count++;
+
+    return 0;
+}
+
+/**
+ * Returns the last handle belonging to the characteristic at index i: the handle before the next characteristic,
+ * or the end of its service.
+ */
+static uint16_t
+peer_chr_end_handle(const struct mesh_peer *peer, int i)
+{
+    const struct mesh_peer_attr *svc;
+    int j;
+
+    svc = peer_svc_find_range(peer, peer->attrs[i].handle);
+
+    for (j = i + 1; j < peer->attr_count; j++) {
+        if (peer->attrs[j].type == MESH_PEER_ATTR_CHR) {
+            return peer->attrs[j].handle - 1;
+        }
+        if (peer->attrs[j].type == MESH_PEER_ATTR_SVC) {
+            break;
+        }
     }
-    return dsc;
+
+    return svc != NULL ? svc->end_handle : peer->attrs[i].val_handle;
 }
 
 static int
 peer_dsc_add(struct mesh_peer *peer, uint16_t chr_val_handle,
              const struct ble_gatt_dsc *gatt_dsc)
 {
-    struct mesh_peer_dsc *prev;
-    struct mesh_peer_dsc *dsc;
-    struct mesh_peer_svc *svc;
-    struct mesh_peer_chr *chr;
+    struct mesh_peer_attr attr;
 
-    svc = peer_svc_find_range(peer, chr_val_handle);
-    if (svc == NULL) {
+    if (peer_svc_find_range(peer, chr_val_handle) == NULL) {
         /* Can't find service for discovered descriptor; this shouldn't
          * happen.
          */
@@ -156,68 +260,45 @@ peer_dsc_add(struct mesh_peer *peer, uint16_t chr_val_handle,
         return BLE_HS_EUNKNOWN;
     }
 
-    chr = peer_chr_find(svc, chr_val_handle, NULL);
-    if (chr == NULL) {
-        /* Can't find characteristic for discovered descriptor; this shouldn't
-         * happen.
-         */
-        assert(0);
-        return BLE_HS_EUNKNOWN;
-    }
-
-    dsc = peer_dsc_find(chr, gatt_dsc->handle, &prev);
-    if (dsc != NULL) {
-        /* Descriptor already discovered. */
-        return 0;
-    }
-
-    dsc = os_memblock_get(&peer_dsc_pool);
-    if (dsc == NULL) {
-        /* Out of memory. */
-        return BLE_HS_ENOMEM;
-    }
-    memset(dsc, 0, sizeof * dsc);
-
-    dsc->dsc = *gatt_dsc;
+    memset(&attr, 0, sizeof attr);
+    attr.type = MESH_PEER_ATTR_DSC;
+    attr.handle = gatt_dsc->handle;
+    attr.uuid = gatt_dsc->uuid;
 
-    if (prev == NULL) {
-        SLIST_INSERT_HEAD(&chr->dscs, dsc, next);
-    } else {
-        SLIST_NEXT(prev, next) = dsc;
-    }
-
-    return 0;
+    return peer_attr_add(peer, &attr);
 }
 
 static void
 peer_disc_dscs(struct mesh_peer *peer)
 {
-    struct mesh_peer_chr *chr;
-    struct mesh_peer_svc *svc;
+    const struct mesh_peer_attr *chr;
+    uint16_t end_handle;
     int rc;
+    int i;
 
-    /* Search through the list of discovered characteristics for the first
-     * characteristic that contains undiscovered descriptors.  Then, discover
-     * all descriptors belonging to that characteristic.
+    /* Search through the discovered characteristics for the first one that
+     * contains undiscovered descriptors.  Then, discover all descriptors
+     * belonging to that characteristic.
      */
-    SLIST_FOREACH(svc, &peer->svcs, next) {
-        SLIST_FOREACH(chr, &svc->chrs, next) {
-            if (!chr_is_empty(svc, chr) &&
-                    SLIST_EMPTY(&chr->dscs) &&
-                    peer->disc_prev_chr_val <= chr->chr.def_handle) {
-
-                rc = ble_gattc_disc_all_dscs(peer->conn_handle,
-                                             chr->chr.val_handle,
-                                             chr_end_handle(svc, chr),
-                                             peer_dsc_disced, peer);
-                if (rc != 0) {
-                    peer_disc_complete(peer, rc);
-                }
-
-                peer->disc_prev_chr_val = chr->chr.val_handle;
-                return;
-            }
+    for (i = 0; i < peer->attr_count; i++) {
+        chr = &peer->attrs[i];
+        if (chr->type != MESH_PEER_ATTR_CHR || peer->disc_prev_chr_val > chr->handle) {
+            continue;
+        }
+
+        end_handle = peer_chr_end_handle(peer, i);
+        if (end_handle <= chr->val_handle ||
+                (i + 1 < peer->attr_count && peer->attrs[i + 1].type == MESH_PEER_ATTR_DSC)) {
+            continue;
         }
+
+        peer->disc_prev_chr_val = chr->val_handle;
+        rc = ble_gattc_disc_all_dscs(peer->conn_handle, chr->val_handle, end_handle,
+                                     peer_dsc_disced, peer);
+        if (rc != 0) {
+            peer_disc_complete(peer, rc);
+        }
+        return;
     }
 
     /* All descriptors discovered. */
@@ -264,90 +345,12 @@ peer_dsc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
     return rc;
 }
 
-uint16_t
-chr_end_handle(const struct mesh_peer_svc *svc, const struct mesh_peer_chr *chr)
-{
-    const struct mesh_peer_chr *next_chr;
-
-    next_chr = SLIST_NEXT(chr, next);
-    if (next_chr != NULL) {
-        return next_chr->chr.def_handle - 1;
-    } else {
-        return svc->svc.end_handle;
-    }
-}
-
-int
-chr_is_empty(const struct mesh_peer_svc *svc, const struct mesh_peer_chr *chr)
-{
-    return chr_end_handle(svc, chr) <= chr->chr.val_handle;
-}
-
-static struct mesh_peer_chr *
-peer_chr_find_prev(const struct mesh_peer_svc *svc, uint16_t chr_val_handle)
-{
-    struct mesh_peer_chr *prev;
-    struct mesh_peer_chr *chr;
-
-    prev = NULL;
-    SLIST_FOREACH(chr, &svc->chrs, next) {
-        if (chr->chr.val_handle >= chr_val_handle) {
-            break;
-        }
-
-        prev = chr;
-    }
-
-    return prev;
-}
-
-static struct mesh_peer_chr *
-peer_chr_find(const struct mesh_peer_svc *svc, uint16_t chr_val_handle,
-              struct mesh_peer_chr **out_prev)
-{
-    struct mesh_peer_chr *prev;
-    struct mesh_peer_chr *chr;
-
-    prev = peer_chr_find_prev(svc, chr_val_handle);
-    if (prev == NULL) {
-        chr = SLIST_FIRST(&svc->chrs);
-    } else {
-        chr = SLIST_NEXT(prev, next);
-    }
-
-    if (chr != NULL && chr->chr.val_handle != chr_val_handle) {
-        chr = NULL;
-    }
-
-    if (out_prev != NULL) {
-        *out_prev = prev;
-    }
-    return chr;
-}
-
-static void
-peer_chr_delete(struct mesh_peer_chr *chr)
-{
-    struct mesh_peer_dsc *dsc;
-
-    while ((dsc = SLIST_FIRST(&chr->dscs)) != NULL) {
-        SLIST_REMOVE_HEAD(&chr->dscs, next);
-        os_memblock_put(&peer_dsc_pool, dsc);
-    }
-
-    os_memblock_put(&peer_chr_pool, chr);
-}
-
 static int
-peer_chr_add(struct mesh_peer *peer, uint16_t svc_start_handle,
-             const struct ble_gatt_chr *gatt_chr)
+peer_chr_add(struct mesh_peer *peer, const struct ble_gatt_chr *gatt_chr)
 {
-    struct mesh_peer_chr *prev;
-    struct mesh_peer_chr *chr;
-    struct mesh_peer_svc *svc;
+    struct mesh_peer_attr attr;
 
-    svc = peer_svc_find(peer, svc_start_handle, NULL);
-    if (svc == NULL) {
+    if (peer_svc_find_range(peer, gatt_chr->def_handle) == NULL) {
         /* Can't find service for discovered characteristic; this shouldn't
          * happen.
          */
@@ -355,28 +358,14 @@ peer_chr_add(struct mesh_peer *peer, uint16_t svc_start_handle,
         return BLE_HS_EUNKNOWN;
     }
 
-    chr = peer_chr_find(svc, gatt_chr->def_handle, &prev);
-    if (chr != NULL) {
-        /* Characteristic already discovered. */
-        return 0;
-    }
-
-    chr = os_memblock_get(&peer_chr_pool);
-    if (chr == NULL) {
-        /* Out of memory. */
-        return BLE_HS_ENOMEM;
-    }
-    memset(chr, 0, sizeof * chr);
-
-    chr->chr = *gatt_chr;
-
-    if (prev == NULL) {
-        SLIST_INSERT_HEAD(&svc->chrs, chr, next);
-    } else {
-        SLIST_NEXT(prev, next) = chr;
-    }
+    memset(&attr, 0, sizeof attr);
+    attr.type = MESH_PEER_ATTR_CHR;
+    attr.handle = gatt_chr->def_handle;
+    attr.val_handle = gatt_chr->val_handle;
+    attr.properties = gatt_chr->properties;
+    attr.uuid = gatt_chr->uuid;
 
-    return 0;
+    return peer_attr_add(peer, &attr);
 }
 
 static int
@@ -391,7 +380,7 @@ peer_chr_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
 
     switch (error->status) {
     case 0:
-        rc = peer_chr_add(peer, peer->cur_svc->svc.start_handle, chr);
+        rc = peer_chr_add(peer, chr);
         break;
 
     case BLE_HS_EDONE:
@@ -420,115 +409,77 @@ peer_chr_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
 static void
 peer_disc_chrs(struct mesh_peer *peer)
 {
-    struct mesh_peer_svc *svc;
+    const struct mesh_peer_attr *svc;
     int rc;
+    int i;
 
-    /* Search through the list of discovered service for the first service that
-     * contains undiscovered characteristics.  Then, discover all
-     * characteristics belonging to that service.
+    /* Walk the discovered services in handle order, discovering the
+     * characteristics of each service we haven't been through yet.
      */
-    SLIST_FOREACH(svc, &peer->svcs, next) {
-        if (!peer_svc_is_empty(svc) && SLIST_EMPTY(&svc->chrs)) {
-            peer->cur_svc = svc;
-            rc = ble_gattc_disc_all_chrs(peer->conn_handle,
-                                         svc->svc.start_handle,
-                                         svc->svc.end_handle,
-                                         peer_chr_disced, peer);
-            if (rc != 0) {
-                peer_disc_complete(peer, rc);
-            }
-            return;
+    for (i = 0; i < peer->attr_count; i++) {
+        svc = &peer->attrs[i];
+        if (svc->type != MESH_PEER_ATTR_SVC || svc->handle <= peer->disc_prev_svc ||
+                svc->end_handle <= svc->handle) {
+            continue;
         }
-    }
-
-    /* All characteristics discovered. */
-    peer_disc_dscs(peer);
-}
-
-int
-peer_svc_is_empty(const struct mesh_peer_svc *svc)
-{
-    return svc->svc.end_handle <= svc->svc.start_handle;
-}
-
-static struct mesh_peer_svc *
-peer_svc_find_prev(struct mesh_peer *peer, uint16_t svc_start_handle)
-{
-    struct mesh_peer_svc *prev;
-    struct mesh_peer_svc *svc;
 
-    prev = NULL;
-    SLIST_FOREACH(svc, &peer->svcs, next) {
-        if (svc->svc.start_handle >= svc_start_handle) {
-            break;
+        peer->disc_prev_svc = svc->handle;
+        rc = ble_gattc_disc_all_chrs(peer->conn_handle, svc->handle, svc->end_handle,
+                                     peer_chr_disced, peer);
+        if (rc != 0) {
+            peer_disc_complete(peer, rc);
         }
-
-        prev = svc;
+        return;
     }
 
-    return prev;
-}
-
-static struct mesh_peer_svc *
-peer_svc_find(struct mesh_peer *peer, uint16_t svc_start_handle,
-              struct mesh_peer_svc **out_prev)
-{
-    struct mesh_peer_svc *prev;
-    struct mesh_peer_svc *svc;
-
-    prev = peer_svc_find_prev(peer, svc_start_handle);
-    if (prev == NULL) {
-        svc = SLIST_FIRST(&peer->svcs);
+    /* All characteristics discovered. */
+    if (peer->disc_skip_dscs) {
+        peer_disc_complete(peer, 0);
     } else {
-        svc = SLIST_NEXT(prev, next);
-    }
-
-    if (svc != NULL && svc->svc.start_handle != svc_start_handle) {
-        svc = NULL;
-    }
-
-    if (out_prev != NULL) {
-        *out_prev = prev;
+        peer_disc_dscs(peer);
     }
-    return svc;
 }
 
-static struct mesh_peer_svc *
-peer_svc_find_range(struct mesh_peer *peer, uint16_t attr_handle)
+const struct mesh_peer_attr *
+mesh_peer_svc_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *uuid)
 {
-    struct mesh_peer_svc *svc;
-
-    SLIST_FOREACH(svc, &peer->svcs, next) {
-        if (svc->svc.start_handle <= attr_handle &&
-                svc->svc.end_handle >= attr_handle) {
+    const struct mesh_peer_attr *attr;
+    int i;
 
-            return svc;
+    for (i = 0; i < peer->attr_count; i++) {
+        attr = &peer->attrs[i];
+        if (attr->type == MESH_PEER_ATTR_SVC && ble_uuid_cmp(&attr->uuid.u, uuid) == 0) {
+            return attr;
         }
     }
 
     return NULL;
 }
 
-const struct mesh_peer_svc *
-mesh_peer_svc_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *uuid)
+/**
+ * Returns the first attribute of the given type and UUID that follows the parent and lies within its handle range,
+ * which ends at end_handle.
+ */
+static const struct mesh_peer_attr *
+peer_attr_find_child(const struct mesh_peer *peer, const struct mesh_peer_attr *parent, uint16_t end_handle,
+                     uint8_t type, const ble_uuid_t *uuid)
 {
-    const struct mesh_peer_svc *svc;
+    const struct mesh_peer_attr *attr;
 
-    SLIST_FOREACH(svc, &peer->svcs, next) {
-        if (ble_uuid_cmp(&svc->svc.uuid.u, uuid) == 0) {
-            return svc;
+    for (attr = parent + 1; attr < peer->attrs + peer->attr_count && attr->handle <= end_handle; attr++) {
+        if (attr->type == type && ble_uuid_cmp(&attr->uuid.u, uuid) == 0) {
+            return attr;
         }
     }
 
     return NULL;
 }
 
-const struct mesh_peer_chr *
+const struct mesh_peer_attr *
 mesh_peer_chr_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *svc_uuid,
                         const ble_uuid_t *chr_uuid)
 {
-    const struct mesh_peer_svc *svc;
-    const struct mesh_peer_chr *chr;
+    const struct mesh_peer_attr *svc;
 
     LOGD_("Searching through peers for svc with uuid ");
     mesh_print_uuid(svc_uuid);
@@ -539,88 +490,131 @@ mesh_peer_chr_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *svc_uuid
     svc = mesh_peer_svc_find_uuid(peer, svc_uuid);
     if (svc == NULL) {
         LOGD_("Could not find svc uuid in peer with handle %d, printing peer addr:", peer->conn_handle);
-        mesh_print_ble_addr(peer->addr);
+        mesh_print_ble_addr(&peer->addr);
         LOGD__("\n");
         return NULL;
     }
 
-    SLIST_FOREACH(chr, &svc->chrs, next) {
-        if (ble_uuid_cmp(&chr->chr.uuid.u, chr_uuid) == 0) {
-            return chr;
-        }
-    }
-
-    return NULL;
+    return peer_attr_find_child(peer, svc, svc->end_handle, MESH_PEER_ATTR_CHR, chr_uuid);
 }
 
-const struct mesh_peer_dsc *
+const struct mesh_peer_attr *
 mesh_peer_dsc_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *svc_uuid,
                         const ble_uuid_t *chr_uuid, const ble_uuid_t *dsc_uuid)
 {
-    const struct mesh_peer_chr *chr;
-    const struct mesh_peer_dsc *dsc;
+    const struct mesh_peer_attr *chr;
 
     chr = mesh_peer_chr_find_uuid(peer, svc_uuid, chr_uuid);
     if (chr == NULL) {
         return NULL;
     }
 
-    SLIST_FOREACH(dsc, &chr->dscs, next) {
-        if (ble_uuid_cmp(&dsc->dsc.uuid.u, dsc_uuid) == 0) {
-            return dsc;
-        }
-    }
-
-    return NULL;
+    return peer_attr_find_child(peer, chr, peer_chr_end_handle(peer, chr - peer->attrs),
+                                MESH_PEER_ATTR_DSC, dsc_uuid);
 }
 
 static int
 peer_svc_add(struct mesh_peer *peer, const struct ble_gatt_svc *gatt_svc)
 {
-    struct mesh_peer_svc *prev;
-    struct mesh_peer_svc *svc;
+    struct mesh_peer_attr attr;
 
-    svc = peer_svc_find(peer, gatt_svc->start_handle, &prev);
-    if (svc != NULL) {
-        /* Service already discovered. */
-        return 0;
+    memset(&attr, 0, sizeof attr);
+    attr.type = MESH_PEER_ATTR_SVC;
+    attr.handle = gatt_svc->start_handle;
+    attr.end_handle = gatt_svc->end_handle;
+    attr.uuid = gatt_svc->uuid;
+
+    return peer_attr_add(peer, &attr);
+}
+
+static int
+peer_svc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
+                const struct ble_gatt_svc *service, void *arg)
+{
+    struct mesh_peer *peer;
+    int rc;
+
+    peer = arg;
+    assert(peer->conn_handle == conn_handle);
+
+    switch (error->status) {
+    case 0:
+        rc = peer_svc_add(peer, service);
+        break;
+
+    case BLE_HS_EDONE:
+        /* All services discovered; start discovering characteristics. */
+        if (peer->disc_prev_chr_val > 0) {
+            peer_disc_chrs(peer);
+        }
+        rc = 0;
+        break;
+
+    default:
+        rc = error->status;
+        break;
     }
 
-    svc = os_memblock_get(&peer_svc_pool);
-    if (svc == NULL) {
-        /* Out of memory. */
-        return BLE_HS_ENOMEM;
+    if (rc != 0) {
+        /* Error; abort discovery. */
+        peer_disc_complete(peer, rc);
+    }
+
+    return rc;
+}
+
+
+int
+mesh_peer_disc_all(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb, void *disc_cb_arg)
+{
+    struct mesh_peer *peer;
+    int rc;
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer == NULL) {
+        return BLE_HS_ENOTCONN;
     }
-    memset(svc, 0, sizeof * svc);
 
-    svc->svc = *gatt_svc;
-    SLIST_INIT(&svc->chrs);
+    /* Undiscover everything first. */
+    peer->attr_count = 0;
 
-    if (prev == NULL) {
-        SLIST_INSERT_HEAD(&peer->svcs, svc, next);
-    } else {
-        SLIST_INSERT_AFTER(prev, svc, next);
+    peer->disc_prev_chr_val = 1;
+    peer->disc_prev_svc = 0;
+    peer->disc_skip_dscs = false;
+    peer->disc_started_at = ble_npl_time_get();
+    peer->disc_cb = disc_cb;
+    peer->disc_cb_arg = disc_cb_arg;
+
+    rc = ble_gattc_disc_all_svcs(conn_handle, peer_svc_disced, peer);
+    if (rc != 0) {
+        return rc;
     }
 
     return 0;
 }
 
+/**
+ * Falls back to walking every service, characteristic and descriptor of the peer.
+ */
 static void
-peer_svc_delete(struct mesh_peer_svc *svc)
+peer_disc_fallback(struct mesh_peer *peer)
 {
-    struct mesh_peer_chr *chr;
+    int rc;
 
-    while ((chr = SLIST_FIRST(&svc->chrs)) != NULL) {
-        SLIST_REMOVE_HEAD(&svc->chrs, next);
-        peer_chr_delete(chr);
-    }
+    LOGW("Mesh service discovery failed for peer with handle %d, discovering everything", peer->conn_handle);
+    peer->disc_skip_dscs = false;
+    peer->disc_prev_chr_val = 1;
+    peer->disc_prev_svc = 0;
 
-    os_memblock_put(&peer_svc_pool, svc);
+    rc = ble_gattc_disc_all_svcs(peer->conn_handle, peer_svc_disced, peer);
+    if (rc != 0) {
+        peer_disc_complete(peer, rc);
+    }
 }
 
 static int
-peer_svc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
-                const struct ble_gatt_svc *service, void *arg)
+peer_mesh_svc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
+                     const struct ble_gatt_svc *service, void *arg)
 {
     struct mesh_peer *peer;
     int rc;
@@ -634,16 +628,18 @@ peer_svc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
         break;
 
     case BLE_HS_EDONE:
-        /* All services discovered; start discovering characteristics. */
-        if (peer->disc_prev_chr_val > 0) {
+        if (peer->attr_count == 0) {
+            /* No mesh service; this is the hub, which we talk to through notifications. */
+            peer_disc_complete(peer, 0);
+        } else if (peer->disc_prev_chr_val > 0) {
             peer_disc_chrs(peer);
         }
         rc = 0;
         break;
 
     default:
-        rc = error->status;
-        break;
+        peer_disc_fallback(peer);
+        return 0;
     }
 
     if (rc != 0) {
@@ -654,11 +650,14 @@ peer_svc_disced(uint16_t conn_handle, const struct ble_gatt_error *error,
     return rc;
 }
 
-
+/**
+ * Discovers only the mesh data service and its characteristics, which is all the mesh needs to forward packets. This
+ * takes one service lookup by UUID and one characteristic walk instead of walking every service, characteristic and
+ * descriptor. If the lookup fails, discovery falls back to the full walk.
+ */
 int
-mesh_peer_disc_all(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb, void *disc_cb_arg)
+mesh_peer_disc_mesh_svc(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb, void *disc_cb_arg)
 {
-    struct mesh_peer_svc *svc;
     struct mesh_peer *peer;
     int rc;
 
@@ -668,16 +667,16 @@ mesh_peer_disc_all(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb, void *disc_
     }
 
     /* Undiscover everything first. */
-    while ((svc = SLIST_FIRST(&peer->svcs)) != NULL) {
-        SLIST_REMOVE_HEAD(&peer->svcs, next);
-        peer_svc_delete(svc);
-    }
+    peer->attr_count = 0;
 
     peer->disc_prev_chr_val = 1;
+    peer->disc_prev_svc = 0;
+    peer->disc_skip_dscs = true;
+    peer->disc_started_at = ble_npl_time_get();
     peer->disc_cb = disc_cb;
     peer->disc_cb_arg = disc_cb_arg;
 
-    rc = ble_gattc_disc_all_svcs(conn_handle, peer_svc_disced, peer);
+    rc = ble_gattc_disc_svc_by_uuid(conn_handle, &gatt_svr_svc_data_uuid.u, peer_mesh_svc_disced, peer);
     if (rc != 0) {
         return rc;
     }
@@ -688,28 +687,20 @@ mesh_peer_disc_all(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb, void *disc_
 int
 mesh_peer_delete(uint16_t conn_handle)
 {
-    struct mesh_peer_svc *svc;
     struct mesh_peer *peer;
-    int rc;
 
     peer = mesh_peer_find(conn_handle);
     if (peer == NULL) {
         return BLE_HS_ENOTCONN;
     }
 
-    free(peer->addr);
+    peer_addr_index_remove(peer);
 
-    SLIST_REMOVE(&peers, peer, mesh_peer, next);
-
-    while ((svc = SLIST_FIRST(&peer->svcs)) != NULL) {
-        SLIST_REMOVE_HEAD(&peer->svcs, next);
-        peer_svc_delete(svc);
+    if (peer->coc_tx_queue != NULL) {
+        os_mbuf_free_chain(peer->coc_tx_queue);
     }
 
-    rc = os_memblock_put(&peer_pool, peer);
-    if (rc != 0) {
-        return BLE_HS_EOS;
-    }
+    peer->in_use = false;
 
     return 0;
 }
@@ -718,6 +709,8 @@ int
 mesh_peer_add(uint16_t conn_handle, const ble_addr_t *peer_addr)
 {
     struct mesh_peer *peer;
+    uint8_t bucket;
+    int i;
 
     LOGD_("Adding peer with addr ");
     mesh_print_ble_addr(peer_addr);
@@ -729,18 +722,33 @@ mesh_peer_add(uint16_t conn_handle, const ble_addr_t *peer_addr)
         return BLE_HS_EALREADY;
     }
 
-    peer = os_memblock_get(&peer_pool);
-    if (peer == NULL) {
+    for (i = 0; i < peer_table_size; i++) {
+        peer = &peer_table[(conn_handle + i) % peer_table_size];
+        if (!peer->in_use) {
+            break;
+        }
+    }
+    if (i == peer_table_size) {
         /* Out of memory. */
         return BLE_HS_ENOMEM;
     }
 
     memset(peer, 0, sizeof * peer);
-    peer->addr = malloc(sizeof(ble_addr_t));
-    memcpy(peer->addr, peer_addr, sizeof(ble_addr_t));
+    peer->in_use = true;
+    peer->addr = *peer_addr;
     peer->conn_handle = conn_handle;
-
-    SLIST_INSERT_HEAD(&peers, peer, next);
+    peer->connected_at = ble_npl_time_get();
+    peer->hops_to_hub = MESH_PEER_HOPS_UNKNOWN;
+    peer->role = MESH_PEER_ROLE_UNKNOWN;
+    peer->mtu = BLE_ATT_MTU_DFLT;
+    peer->tx_octets = BLE_HCI_SUGG_DEF_DATALEN_TX_OCTETS_MIN;
+    /* New links are given the benefit of the doubt until sends tell otherwise. */
+    peer->link_success = MESH_PEER_LINK_SUCCESS_ONE;
+    peer->link_rssi = MESH_PEER_RSSI_UNKNOWN;
+
+    bucket = peer_addr_bucket(peer_addr);
+    peer->addr_next = peer_addr_buckets[bucket];
+    peer_addr_buckets[bucket] = peer - peer_table + 1;
 
     return 0;
 }
@@ -748,99 +756,276 @@ mesh_peer_add(uint16_t conn_handle, const ble_addr_t *peer_addr)
 static void
 peer_free_mem(void)
 {
-    free(peer_mem);
-    peer_mem = NULL;
+    free(peer_table);
+    peer_table = NULL;
+    peer_table_size = 0;
+    memset(peer_addr_buckets, 0, sizeof peer_addr_buckets);
+}
 
-    free(peer_svc_mem);
-    peer_svc_mem = NULL;
+/**
+ * Discovered attributes live in a fixed array inside each peer, so only the peer table itself is allocated.
+ */
+int
+mesh_peer_init(int max_peers)
+{
+    /* Free memory first in case this function gets called more than once. */
+    peer_free_mem();
 
-    free(peer_chr_mem);
-    peer_chr_mem = NULL;
+    peer_table = calloc(max_peers, sizeof (struct mesh_peer));
+    if (peer_table == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+    peer_table_size = max_peers;
 
-    free(peer_dsc_mem);
-    peer_dsc_mem = NULL;
+    return 0;
 }
 
-int
-mesh_peer_init(int max_peers, int max_svcs, int max_chrs, int max_dscs)
+void
+mesh_peer_exec_for_each(mesh_peer_exec_fn *exec_fn, void *data) {
+    int i;
+
+    /* Safe against exec_fn deleting the peer it is given. */
+    for (i = 0; i < peer_table_size; i++) {
+        if (peer_table[i].in_use) {
+            exec_fn(&peer_table[i], data);
+        }
+    }
+}
+
+void
+mesh_peer_set_mtu(uint16_t conn_handle, uint16_t mtu)
 {
-    int rc;
+    struct mesh_peer *peer;
 
-    /* Free memory first in case this function gets called more than once. */
-    peer_free_mem();
+    peer = mesh_peer_find(conn_handle);
+    if (peer != NULL) {
+        LOGI("MTU for peer with handle %d is now %d", conn_handle, mtu);
+        peer->mtu = mtu;
+    }
+}
 
-    peer_mem = malloc(
-                   OS_MEMPOOL_BYTES(max_peers, sizeof (struct mesh_peer)));
-    if (peer_mem == NULL) {
-        rc = BLE_HS_ENOMEM;
-        goto err;
+static int
+peer_mtu_exchanged(uint16_t conn_handle, const struct ble_gatt_error *error,
+                   uint16_t mtu, void *arg)
+{
+    if (error->status == 0) {
+        mesh_peer_set_mtu(conn_handle, mtu);
+    } else {
+        LOGW("MTU exchange with peer with handle %d failed; status=%d", conn_handle, error->status);
     }
+    return 0;
+}
+
+/**
+ * Asks for the largest ATT MTU and link layer payload on a new connection, so a packet goes out in a single
+ * connection event instead of being fragmented over several.
+ */
+void
+mesh_peer_negotiate_link(uint16_t conn_handle)
+{
+    struct mesh_peer *peer;
+    int rc;
 
-    rc = os_mempool_init(&peer_pool, max_peers,
-                         sizeof (struct mesh_peer), peer_mem,
-                         "peer_pool");
+    rc = ble_gattc_exchange_mtu(conn_handle, peer_mtu_exchanged, NULL);
     if (rc != 0) {
-        rc = BLE_HS_EOS;
-        goto err;
+        LOGW("Failed to start MTU exchange; rc=%d", rc);
     }
 
-    peer_svc_mem = malloc(
-                       OS_MEMPOOL_BYTES(max_svcs, sizeof (struct mesh_peer_svc)));
-    if (peer_svc_mem == NULL) {
-        rc = BLE_HS_ENOMEM;
-        goto err;
+    rc = ble_gap_set_data_len(conn_handle, MESH_PEER_PREFERRED_TX_OCTETS, MESH_PEER_PREFERRED_TX_TIME);
+    if (rc != 0) {
+        LOGW("Failed to set data length; rc=%d", rc);
+        return;
     }
 
-    rc = os_mempool_init(&peer_svc_pool, max_svcs,
-                         sizeof (struct mesh_peer_svc), peer_svc_mem,
-                         "peer_svc_pool");
-    if (rc != 0) {
-        rc = BLE_HS_EOS;
-        goto err;
+    peer = mesh_peer_find(conn_handle);
+    if (peer != NULL) {
+        peer->tx_octets = MESH_PEER_PREFERRED_TX_OCTETS;
     }
+}
+
+/**
+ * Returns the largest attribute value that fits in a single write or notification to the peer.
+ */
+uint16_t
+mesh_peer_max_write_len(const struct mesh_peer *peer)
+{
+    /* One byte of opcode and two of handle. */
+    return peer->mtu - 3;
+}
+
+/**
+ * Intervals are in units of 1.25 ms, supervision timeouts in units of 10 ms. The idle hold supervision timeout
+ * leaves room for the skipped events: (1 + latency) * itvl_max * 2 = 2 s.
+ */
+static const struct ble_gap_upd_params peer_conn_profiles[MESH_PEER_NUM_CONN_PROFILES] = {
+        [MESH_PEER_CONN_PROFILE_BURST] = {
+                .itvl_min = 6,      /* 7.5 ms */
+                .itvl_max = 12,     /* 15 ms */
+                .latency = 0,
+                .supervision_timeout = 400,
+        },
+        [MESH_PEER_CONN_PROFILE_IDLE] = {
+                .itvl_min = 80,     /* 100 ms */
+                .itvl_max = 160,    /* 200 ms */
+                .latency = 4,
+                .supervision_timeout = 400,
+        },
+};
+
+/**
+ * Fills the parameters new connections are opened with. Bringing up a link is an exchange of several round trips,
+ * so connections start out in the burst profile.
+ */
+void
+mesh_peer_fill_connect_params(struct ble_gap_conn_params *params)
+{
+    const struct ble_gap_upd_params *profile;
+
+    profile = &peer_conn_profiles[MESH_PEER_CONN_PROFILE_BURST];
+
+    memset(params, 0, sizeof *params);
+    params->scan_itvl = BLE_GAP_SCAN_FAST_INTERVAL_MIN;
+    params->scan_window = BLE_GAP_SCAN_FAST_WINDOW;
+    params->itvl_min = profile->itvl_min;
+    params->itvl_max = profile->itvl_max;
+    params->latency = profile->latency;
+    params->supervision_timeout = profile->supervision_timeout;
+}
+
+static bool
+peer_runs_conn_profile(const struct mesh_peer *peer, uint8_t profile)
+{
+    const struct ble_gap_upd_params *params = &peer_conn_profiles[profile];
 
-    peer_chr_mem = malloc(
-                       OS_MEMPOOL_BYTES(max_chrs, sizeof (struct mesh_peer_chr)));
-    if (peer_chr_mem == NULL) {
-        rc = BLE_HS_ENOMEM;
-        goto err;
+    return peer->conn_itvl >= params->itvl_min && peer->conn_itvl <= params->itvl_max &&
+           peer->conn_latency == params->latency;
+}
+
+/**
+ * Requests the connection to the peer to switch to a parameter profile. Nothing is sent if the link already runs at
+ * it, or if we are the connection's peripheral: the central owns the parameters, two ends asking for their own would
+ * only overwrite each other. Whether a request took is only known from the update event, see
+ * mesh_peer_set_conn_params, so an update that failed is asked for again on the next call.
+ */
+int
+mesh_peer_set_conn_profile(struct mesh_peer *peer, uint8_t profile)
+{
+    struct ble_gap_conn_desc desc;
+    int rc;
+
+    if (profile >= MESH_PEER_NUM_CONN_PROFILES) {
+        return BLE_HS_EINVAL;
     }
 
-    rc = os_mempool_init(&peer_chr_pool, max_chrs,
-                         sizeof (struct mesh_peer_chr), peer_chr_mem,
-                         "peer_chr_pool");
+    rc = ble_gap_conn_find(peer->conn_handle, &desc);
     if (rc != 0) {
-        rc = BLE_HS_EOS;
-        goto err;
+        return rc;
     }
 
-    peer_dsc_mem = malloc(
-                       OS_MEMPOOL_BYTES(max_dscs, sizeof (struct mesh_peer_dsc)));
-    if (peer_dsc_mem == NULL) {
-        rc = BLE_HS_ENOMEM;
-        goto err;
+    if (desc.role != BLE_GAP_ROLE_MASTER || peer_runs_conn_profile(peer, profile)) {
+        return 0;
     }
 
-    rc = os_mempool_init(&peer_dsc_pool, max_dscs,
-                         sizeof (struct mesh_peer_dsc), peer_dsc_mem,
-                         "peer_dsc_pool");
+    rc = ble_gap_update_params(peer->conn_handle, &peer_conn_profiles[profile]);
     if (rc != 0) {
-        rc = BLE_HS_EOS;
-        goto err;
+        /* Typically an update that is still in progress, the caller tries again on its next change. */
+        LOGD("Failed to update connection parameters of peer with handle %d; rc=%d", peer->conn_handle, rc);
+        return rc;
     }
 
+    LOGI("Switching peer with handle %d to connection profile %d", peer->conn_handle, profile);
     return 0;
+}
 
-err:
-    peer_free_mem();
-    return rc;
+void
+mesh_peer_set_conn_params(uint16_t conn_handle, uint16_t itvl, uint16_t latency)
+{
+    struct mesh_peer *peer;
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer != NULL) {
+        peer->conn_itvl = itvl;
+        peer->conn_latency = latency;
+    }
 }
 
 void
-mesh_peer_exec_for_each(mesh_peer_exec_fn *exec_fn, void *data) {
+mesh_peer_set_upstream(uint16_t conn_handle, bool upstream)
+{
     struct mesh_peer *peer;
 
-    SLIST_FOREACH(peer, &peers, next) {
-        exec_fn(peer, data);
+    peer = mesh_peer_find(conn_handle);
+    if (peer != NULL) {
+        peer->upstream = upstream;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Returns whether the peer leads towards the hub: it is one of our parents, or the hub itself, whichever end opened
+ * the connection.
+ */
+bool
+mesh_peer_is_upstream(const struct mesh_peer *peer)
+{
+    return peer->upstream || peer->role == MESH_PEER_ROLE_HUB;
+}
+
+/**
+ * Folds the outcome of a send to the peer into its success estimate.
+ */
+void
+mesh_peer_link_record(struct mesh_peer *peer, bool success)
+{
+    int32_t sample;
+
+    sample = success ? MESH_PEER_LINK_SUCCESS_ONE : 0;
+    peer->link_success += (sample - (int32_t) peer->link_success) >> MESH_PEER_LINK_EWMA_SHIFT;
+}
+
+void
+mesh_peer_link_sample_rssi(struct mesh_peer *peer)
+{
+    int8_t rssi;
+
+    if (ble_gap_conn_rssi(peer->conn_handle, &rssi) != 0) {
+        return;
+    }
+
+    if (peer->link_rssi == MESH_PEER_RSSI_UNKNOWN) {
+        peer->link_rssi = rssi;
+    } else {
+        peer->link_rssi = (3 * peer->link_rssi + rssi) / 4;
+    }
+}
+
+/**
+ * Returns how many transmissions a packet to the peer takes on average, which is one over the success rate.
+ */
+uint16_t
+mesh_peer_link_etx(const struct mesh_peer *peer)
+{
+    uint32_t etx;
+
+    if (peer->link_success == 0) {
+        return MESH_PEER_ETX_MAX;
+    }
+
+    etx = (uint32_t) MESH_PEER_ETX_ONE * MESH_PEER_LINK_SUCCESS_ONE / peer->link_success;
+    return etx > MESH_PEER_ETX_MAX ? MESH_PEER_ETX_MAX : etx;
+}
+
+/**
+ * Returns the cost of sending over the link to the peer: its ETX, plus half a transmission if the signal is weak
+ * enough that the success rate is likely to drop soon.
+ */
+uint16_t
+mesh_peer_link_cost(const struct mesh_peer *peer)
+{
+    uint16_t cost;
+
+    cost = mesh_peer_link_etx(peer);
+    if (peer->link_rssi != MESH_PEER_RSSI_UNKNOWN && peer->link_rssi < MESH_PEER_RSSI_WEAK) {
+        cost += MESH_PEER_ETX_ONE / 2;
+    }
+    return cost;
+}
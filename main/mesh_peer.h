@@ -3,31 +3,40 @@
 #define MESH_PEER_H
 
 #include "mesh_data_packet.h"
+#include "host/ble_gap.h"
 #include "host/ble_gatt.h"
 #include "nimble/ble.h"
-
-/** Peer. */
-struct mesh_peer_dsc {
-    SLIST_ENTRY(mesh_peer_dsc) next;
-    struct ble_gatt_dsc dsc;
-};
-SLIST_HEAD(peer_dsc_list, mesh_peer_dsc);
-
-struct mesh_peer_chr {
-    SLIST_ENTRY(mesh_peer_chr) next;
-    struct ble_gatt_chr chr;
-
-    struct peer_dsc_list dscs;
+#include "nimble/nimble_npl.h"
+
+/** Kinds of discovered attributes. */
+#define MESH_PEER_ATTR_SVC 0
+#define MESH_PEER_ATTR_CHR 1
+#define MESH_PEER_ATTR_DSC 2
+
+/**
+ * Discovered attributes kept per peer. The mesh service takes three, a full walk of a node about a dozen, the rest
+ * leaves room for the services of a hub.
+ */
+#define MESH_PEER_MAX_ATTRS 32
+
+/**
+ * A discovered service, characteristic or descriptor. A peer keeps them in one array sorted by handle, so each
+ * service is followed by its characteristics and each characteristic by its descriptors.
+ */
+struct mesh_peer_attr {
+    /** Service start handle, characteristic definition handle or descriptor handle. */
+    uint16_t handle;
+
+    /** Service only: last handle of the service. */
+    uint16_t end_handle;
+
+    /** Characteristic only: value handle and properties. */
+    uint16_t val_handle;
+    uint8_t properties;
+
+    uint8_t type;
+    ble_uuid_any_t uuid;
 };
-SLIST_HEAD(mesh_peer_chr_list, mesh_peer_chr);
-
-struct mesh_peer_svc {
-    SLIST_ENTRY(mesh_peer_svc) next;
-    struct ble_gatt_svc svc;
-
-    struct mesh_peer_chr_list chrs;
-};
-SLIST_HEAD(mesh_peer_svc_list, mesh_peer_svc);
 
 struct mesh_peer_subs {
     SLIST_ENTRY(mesh_peer_subs) next;
@@ -39,22 +48,106 @@ struct mesh_peer_subs {
 SLIST_HEAD(peer_subs_list, mesh_peer_subs);
 
 struct mesh_peer;
+struct ble_l2cap_chan;
+struct mesh_transport;
 typedef void mesh_peer_disc_fn(const struct mesh_peer *peer, int status, void *arg);
 typedef void mesh_peer_exec_fn(struct mesh_peer *peer, void *data);
 
+/** Hop count of a peer whose distance to the hub we haven't learned yet. */
+#define MESH_PEER_HOPS_UNKNOWN 0xff
+
+/** Number of buckets in the peer address index. */
+#define MESH_PEER_ADDR_BUCKETS 8
+
+/** Link layer payload we ask for on every connection, the largest LE data length extension allows. */
+#define MESH_PEER_PREFERRED_TX_OCTETS 251
+#define MESH_PEER_PREFERRED_TX_TIME 2120
+
+/**
+ * Connection parameter profiles. Burst keeps the interval short while packets are being exchanged, idle hold
+ * stretches it and lets the slave skip events while there is nothing to send. Only the central of a connection asks
+ * for them.
+ */
+#define MESH_PEER_CONN_PROFILE_BURST 0
+#define MESH_PEER_CONN_PROFILE_IDLE 1
+#define MESH_PEER_NUM_CONN_PROFILES 2
+
+/**
+ * Link estimator. Send success is an EWMA in units of 1/MESH_PEER_LINK_SUCCESS_ONE, and expected transmissions
+ * (ETX) are in units of 1/MESH_PEER_ETX_ONE, so a perfect link has an ETX of MESH_PEER_ETX_ONE.
+ */
+#define MESH_PEER_LINK_SUCCESS_ONE 256
+#define MESH_PEER_LINK_EWMA_SHIFT 3
+#define MESH_PEER_ETX_ONE 10
+#define MESH_PEER_ETX_MAX (10 * MESH_PEER_ETX_ONE)
+
+/** Links weaker than this are about to start dropping packets and cost an extra half transmission. */
+#define MESH_PEER_RSSI_WEAK -85
+#define MESH_PEER_RSSI_UNKNOWN 127
+
+/** What a peer is to us, known once discovery has finished. */
+#define MESH_PEER_ROLE_UNKNOWN 0
+#define MESH_PEER_ROLE_NODE 1
+#define MESH_PEER_ROLE_HUB 2
+
 struct mesh_peer {
-    SLIST_ENTRY(mesh_peer) next;
+    bool in_use;
 
-    ble_addr_t *addr;
+    ble_addr_t addr;
 
     uint16_t conn_handle;
+    ble_npl_time_t connected_at;
+
+    /** Next slot + 1 in the same address index bucket, 0 if this is the last one. */
+    uint8_t addr_next;
+
+    /**
+     * Resolved once discovery completes so the forward path needs no lookups. Nodes are written to through
+     * data_val_handle, the hub has no write characteristic and is notified instead.
+     */
+    uint8_t role;
+    uint16_t data_val_handle;
+
+    /**
+     * Where the link sits in the tree, see mesh_peer_is_upstream. Links we opened lead to our parents, links other
+     * nodes opened to us lead to our children.
+     */
+    bool upstream;
 
-    /** List of discovered GATT services. */
-    struct mesh_peer_svc_list svcs;
+    /** Negotiated ATT MTU, and the link layer payload size we asked the controller for. */
+    uint16_t mtu;
+    uint16_t tx_octets;
+
+    /** Interval and latency the link actually runs at, which tell the profile it is in. */
+    uint16_t conn_itvl;
+    uint16_t conn_latency;
+
+    /** Bearer opened on top of the connection, NULL if packets go over GATT. See mesh_transport_for_peer. */
+    const struct mesh_transport *transport;
+
+    /** Data channel to a node, see mesh_coc.c. */
+    struct ble_l2cap_chan *coc_chan;
+    struct os_mbuf *coc_tx_queue;
+    bool coc_stalled;
+
+    /** Link estimate: EWMA of send success and smoothed RSSI, see mesh_peer_link_cost. */
+    uint16_t link_success;
+    int8_t link_rssi;
+
+    /** Hops the latest packet from the hub took to reach us through this upstream peer, 0 if it is the hub. */
+    uint8_t hops_to_hub;
+
+    /** Discovered GATT attributes, sorted by handle. */
+    struct mesh_peer_attr attrs[MESH_PEER_MAX_ATTRS];
+    uint8_t attr_count;
 
     /** Keeps track of where we are in the service discovery process. */
     uint16_t disc_prev_chr_val;
-    struct mesh_peer_svc *cur_svc;
+    uint16_t disc_prev_svc;
+
+    /** Set when only the mesh service is being discovered, which needs no descriptors. */
+    bool disc_skip_dscs;
+    ble_npl_time_t disc_started_at;
 
     /** Callback that gets executed when service discovery completes. */
     mesh_peer_disc_fn *disc_cb;
@@ -65,17 +158,24 @@ int
 mesh_peer_disc_all(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb,
                    void *disc_cb_arg);
 
-const struct mesh_peer_dsc *
+int
+mesh_peer_disc_mesh_svc(uint16_t conn_handle, mesh_peer_disc_fn *disc_cb,
+                        void *disc_cb_arg);
+
+const struct mesh_peer_attr *
 mesh_peer_dsc_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *svc_uuid,
                         const ble_uuid_t *chr_uuid, const ble_uuid_t *dsc_uuid);
 
-const struct mesh_peer_chr *
+const struct mesh_peer_attr *
 mesh_peer_chr_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *svc_uuid,
                         const ble_uuid_t *chr_uuid);
 
-const struct mesh_peer_svc *
+const struct mesh_peer_attr *
 mesh_peer_svc_find_uuid(const struct mesh_peer *peer, const ble_uuid_t *uuid);
 
+const struct mesh_peer_attr *
+mesh_peer_attr_find(const struct mesh_peer *peer, uint16_t handle);
+
 int
 mesh_peer_delete(uint16_t conn_handle);
 
@@ -83,7 +183,7 @@ int
 mesh_peer_add(uint16_t conn_handle, const ble_addr_t *peer_addr);
 
 int
-mesh_peer_init(int max_peers, int max_svcs, int max_chrs, int max_dscs);
+mesh_peer_init(int max_peers);
 
 struct mesh_peer *
 mesh_peer_find(uint16_t conn_handle);
@@ -94,4 +194,40 @@ mesh_peer_find_by_addr(const ble_addr_t *addr);
 void
 mesh_peer_exec_for_each(mesh_peer_exec_fn *exec_fn, void *data);
 
+void
+mesh_peer_negotiate_link(uint16_t conn_handle);
+
+void
+mesh_peer_set_mtu(uint16_t conn_handle, uint16_t mtu);
+
+uint16_t
+mesh_peer_max_write_len(const struct mesh_peer *peer);
+
+void
+mesh_peer_fill_connect_params(struct ble_gap_conn_params *params);
+
+int
+mesh_peer_set_conn_profile(struct mesh_peer *peer, uint8_t profile);
+
+void
+mesh_peer_set_conn_params(uint16_t conn_handle, uint16_t itvl, uint16_t latency);
+
+void
+mesh_peer_set_upstream(uint16_t conn_handle, bool upstream);
+
+bool
+mesh_peer_is_upstream(const struct mesh_peer *peer);
+
+void
+mesh_peer_link_record(struct mesh_peer *peer, bool success);
+
+void
+mesh_peer_link_sample_rssi(struct mesh_peer *peer);
+
+uint16_t
+mesh_peer_link_etx(const struct mesh_peer *peer);
+
+uint16_t
+mesh_peer_link_cost(const struct mesh_peer *peer);
+
 #endif //MESH_PEER_H
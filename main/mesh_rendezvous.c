@@ -0,0 +1,72 @@
+#include "nimble/nimble_npl.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_rendezvous.h"
+
+/**
+ * Advertise/scan schedule. Each frame is a marker (RENDEZVOUS_MARKER_SLOTS advertise slots, then as many scan slots)
+ * followed by the seed Manchester coded: a 1 bit is an advertise slot then a scan slot, a 0 bit the other way round.
+ *
+ * The coded seed never has more than two equal slots in a row, so the marker only lines up with another node's
+ * marker, never with its seed. Two nodes with different seeds therefore have a slot where one advertises while the
+ * other scans in every frame, however their clocks are offset: either their markers don't line up, or they do and
+ * the differing seed bits do the job. A pair of neighbors meets within one frame instead of after however many
+ * random draws it takes.
+ *
+ * Seeds aren't unique though: nodes still waiting for an id derive theirs from their address, which can match another
+ * node's seed or id. With wakes aligned on mesh time, equal seeds would run the same schedule in lockstep and never
+ * meet. Each wake therefore enters the frame at a random phase. A frame contains only one marker, so no shift of it
+ * other than a whole frame reproduces it, and equal seeds meet as well unless their phases happen to line up.
+ */
+static uint8_t rdv_seed;
+static ble_npl_time_t rdv_started_at;
+
+static bool
+mr_slot_is_adv(int slot) {
+    int bit_slot;
+    bool bit;
+
+    if (slot < RENDEZVOUS_MARKER_SLOTS) {
+        return true;
+    }
+    if (slot < 2 * RENDEZVOUS_MARKER_SLOTS) {
+        return false;
+    }
+
+    bit_slot = slot - 2 * RENDEZVOUS_MARKER_SLOTS;
+    bit = (rdv_seed >> (bit_slot / 2)) & 1;
+    return (bit_slot % 2 == 0) == bit;
+}
+
+/**
+ * Starts the schedule phase_ms into its frame.
+ */
+void
+mesh_rendezvous_start(uint8_t seed, uint32_t phase_ms) {
+    phase_ms %= RENDEZVOUS_FRAME_MS;
+    LOGI("Starting advertise/scan schedule with seed 0x%02x at %u ms into the frame", seed, phase_ms);
+    rdv_seed = seed;
+    rdv_started_at = ble_npl_time_get() - ble_npl_time_ms_to_ticks32(phase_ms);
+}
+
+/**
+ * Returns whether we should be advertising (true) or scanning (false) right now, and how long until that changes.
+ */
+bool
+mesh_rendezvous_next(uint32_t *duration_ms) {
+    uint32_t elapsed_ms;
+    bool adv;
+    int slot;
+    int i;
+
+    elapsed_ms = ble_npl_time_ticks_to_ms32(ble_npl_time_get() - rdv_started_at);
+    slot = (elapsed_ms / RENDEZVOUS_SLOT_MS) % RENDEZVOUS_FRAME_SLOTS;
+    adv = mr_slot_is_adv(slot);
+
+    /* Run on through the following slots with the same role so we don't stop and restart for nothing. */
+    *duration_ms = RENDEZVOUS_SLOT_MS - elapsed_ms % RENDEZVOUS_SLOT_MS;
+    for (i = 1; i < RENDEZVOUS_FRAME_SLOTS && mr_slot_is_adv((slot + i) % RENDEZVOUS_FRAME_SLOTS) == adv; i++) {
+        *duration_ms += RENDEZVOUS_SLOT_MS;
+    }
+
+    return adv;
+}
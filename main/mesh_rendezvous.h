@@ -0,0 +1,25 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef MESH_RENDEZVOUS_H
+#define MESH_RENDEZVOUS_H
+
+/* Length of one advertise or scan slot. */
+#define RENDEZVOUS_SLOT_MS 300
+
+/* Every frame opens with a run of advertise slots followed by a run of scan slots that the seed can't produce. */
+#define RENDEZVOUS_MARKER_SLOTS 3
+
+/* Bits of the seed, each takes two slots. */
+#define RENDEZVOUS_SEED_BITS 8
+
+#define RENDEZVOUS_FRAME_SLOTS (2 * RENDEZVOUS_MARKER_SLOTS + 2 * RENDEZVOUS_SEED_BITS)
+#define RENDEZVOUS_FRAME_MS (RENDEZVOUS_FRAME_SLOTS * RENDEZVOUS_SLOT_MS)
+
+void
+mesh_rendezvous_start(uint8_t seed, uint32_t phase_ms);
+
+bool
+mesh_rendezvous_next(uint32_t *duration_ms);
+
+#endif //MESH_RENDEZVOUS_H
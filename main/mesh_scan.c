@@ -0,0 +1,104 @@
+#include <string.h>
+#include "host/ble_hs.h"
+#include "nimble/nimble_npl.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_scan.h"
+#include "mesh_neighbor.h"
+
+/**
+ * Scan duty cycle. Scanning is what keeps the radio on longest while the mesh forms, so it only runs flat out while
+ * we look for a parent and the neighbors that could be one are most likely still advertising. The longer the search
+ * goes on the less likely a new neighbor shows up, and the search backs off by leaving out runs of rendezvous scan
+ * slots at random. The runs we do scan are scanned throughout: a duty thinned out inside the slots keeps its windows
+ * at the same place in every slot and can miss the slots a neighbor advertises in altogether. Once we have a parent
+ * we only listen for readings to relay, at half duty. On wakes nobody broadcasts readings on we only listen to the
+ * neighbors we know: the controller's filter accept list then keeps every other advertiser from waking the host at
+ * all. Readings can come from any node within ttl, so they are never scanned for through the list.
+ */
+static bool scan_searching;
+static ble_npl_time_t scan_search_started_at;
+
+/**
+ * Programs the cached neighbors into the controller's accept list and makes the scan use it. The list can't change
+ * while a scan uses it, so this is only called before one starts.
+ */
+static void
+ms_use_accept_list(struct ble_gap_disc_params *disc_params) {
+    ble_addr_t addrs[NEIGHBOR_CACHE_SIZE];
+    int count;
+    int rc;
+
+    count = mesh_neighbor_copy_addrs(addrs, NEIGHBOR_CACHE_SIZE);
+    if (count == 0) {
+        return;
+    }
+
+    rc = ble_gap_wl_set(addrs, count);
+    if (rc != 0) {
+        LOGW("Failed to set scan accept list; rc=%d", rc);
+        return;
+    }
+
+    disc_params->filter_policy = BLE_HCI_SCAN_FILT_USE_WL;
+}
+
+/**
+ * How many steps the search for a parent has backed off, counted from the first call since we last had a parent.
+ */
+static int
+ms_search_backoff() {
+    uint32_t searching_ms;
+    int backoff;
+
+    if (!scan_searching) {
+        scan_searching = true;
+        scan_search_started_at = ble_npl_time_get();
+    }
+
+    searching_ms = ble_npl_time_ticks_to_ms32(ble_npl_time_get() - scan_search_started_at);
+    backoff = searching_ms / SCAN_SEARCH_BACKOFF_STEP_MS;
+    return backoff > SCAN_SEARCH_MAX_BACKOFF ? SCAN_SEARCH_MAX_BACKOFF : backoff;
+}
+
+void
+mesh_scan_fill_params(struct ble_gap_disc_params *disc_params, bool needs_parent, bool readings_expected) {
+    memset(disc_params, 0, sizeof *disc_params);
+
+    /* Tell the controller to filter duplicates; we don't want to process
+     * repeated advertisements from the same device. The filter is keyed on
+     * address and data (CONFIG_BTDM_SCAN_DUPL_TYPE_DATA_DEVICE), a relay
+     * advertising the next reading changes only the data.
+     */
+    disc_params->filter_duplicates = 1;
+
+    /* Everything we need is in the advertising data, scan requests would only cost airtime. */
+    disc_params->passive = 1;
+
+    if (!needs_parent) {
+        scan_searching = false;
+        disc_params->itvl = SCAN_CONNECTED_ITVL;
+        disc_params->window = SCAN_CONNECTED_WINDOW;
+        if (!readings_expected) {
+            ms_use_accept_list(disc_params);
+        }
+        return;
+    }
+
+    /* Continuous, see mesh_scan_slots_active for how the search backs off. */
+    disc_params->itvl = SCAN_WINDOW;
+    disc_params->window = SCAN_WINDOW;
+    LOGD("Scanning for a parent; backoff=%d", ms_search_backoff());
+}
+
+/**
+ * Whether to scan through the coming run of rendezvous scan slots, draw being a random number. While we look for a
+ * parent one run in two to the power of the backoff is scanned, the others leave the radio off.
+ */
+bool
+mesh_scan_slots_active(bool needs_parent, uint32_t draw) {
+    if (!needs_parent) {
+        return true;
+    }
+
+    return draw % (1u << ms_search_backoff()) == 0;
+}
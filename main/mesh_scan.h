@@ -0,0 +1,29 @@
+#include <stdbool.h>
+#include "host/ble_gap.h"
+#include "mesh_adv_bearer.h"
+
+#ifndef MESH_SCAN_H
+#define MESH_SCAN_H
+
+/* Our connectable advertising interval, 30-60 ms in 0.625 ms units. */
+#define SCAN_ADV_ITVL_MIN 48
+#define SCAN_ADV_ITVL_MAX 96
+
+/* A window one advertising interval plus an advertising event (~10 ms) long catches at least one advertisement. */
+#define SCAN_WINDOW (SCAN_ADV_ITVL_MAX + 16)
+
+/* While looking for a parent the share of rendezvous scan slots we scan halves every step, down to a floor of half. */
+#define SCAN_SEARCH_BACKOFF_STEP_MS 5000
+#define SCAN_SEARCH_MAX_BACKOFF 1
+
+/* Once we have a parent we only scan for readings to relay, whose bursts a half duty catches nearly every time. */
+#define SCAN_CONNECTED_WINDOW (ADV_BEARER_ITVL + 16)
+#define SCAN_CONNECTED_ITVL (2 * SCAN_CONNECTED_WINDOW)
+
+void
+mesh_scan_fill_params(struct ble_gap_disc_params *disc_params, bool needs_parent, bool readings_expected);
+
+bool
+mesh_scan_slots_active(bool needs_parent, uint32_t draw);
+
+#endif //MESH_SCAN_H
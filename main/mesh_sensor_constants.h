@@ -27,6 +27,8 @@ static const uint32_t firmware_version = 2;
 #define SENSOR_HV_STORE_KEY "sensor_hv"
 #define SENSOR_LV_STORE_KEY "sensor_lv"
 #define SLEEP_DURATION_STORE_KEY "sleep_duration"
+#define NODE_ID_STORE_KEY "node_id"
+#define IDEMPOTENCY_KEY_STORE_KEY "idem_key"
 
 #define PACKET_DECISION_FORWARD 1
 #define PACKET_DECISION_PROCESS 2
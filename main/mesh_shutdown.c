@@ -0,0 +1,345 @@
+#include <string.h>
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_shutdown.h"
+#include "mesh_node.h"
+#include "mesh_peer.h"
+
+#define MSD_STATE_IDLE 0
+#define MSD_STATE_RECEIVED 1
+#define MSD_STATE_WAITING 2
+#define MSD_STATE_LINGERING 3
+
+#define MSD_CHILD_WAIT_ACK 0
+#define MSD_CHILD_WAIT_REPORT 1
+#define MSD_CHILD_DONE 2
+
+struct msd_child {
+    uint16_t conn_handle;
+    uint8_t state;
+    uint8_t sends;
+};
+
+static uint8_t shutdown_state = MSD_STATE_IDLE;
+
+/* The peer the command first reached us from, our report goes back to it. */
+static uint16_t shutdown_parent = BLE_HS_CONN_HANDLE_NONE;
+
+/* Kept to resend the command to children that haven't acked it. */
+static struct mesh_data_packet *shutdown_packet;
+
+/* When the first copy reached us, the time it spends with us is added to the mesh time it carries on every send. */
+static ble_npl_time_t shutdown_received_at;
+static mesh_shutdown_done_fn *shutdown_done_fn;
+static ble_npl_time_t shutdown_started_at;
+
+static struct msd_child children[SHUTDOWN_MAX_CHILDREN];
+static uint8_t child_count;
+
+/* Summed over our own node and the reports of our children. */
+static uint8_t subtree_asleep;
+static uint8_t subtree_missing;
+
+static struct ble_npl_callout shutdown_callout;
+
+static uint8_t
+msd_add_saturated(uint8_t a, uint8_t b) {
+    return a > UINT8_MAX - b ? UINT8_MAX : a + b;
+}
+
+static void
+msd_send_hop(uint16_t conn_handle, uint8_t type, const uint8_t *data, uint8_t data_length) {
+    struct mesh_data_packet *packet;
+    struct mesh_peer *peer;
+
+    peer = mesh_peer_find(conn_handle);
+    if (peer == NULL) {
+        return;
+    }
+
+    // Only meant for the next hop, so nobody forwards it.
+    packet = mdp_alloc(data_length);
+    packet->type = type;
+    packet->source = mesh_node_get_node_id();
+    packet->dest = HUB_NODE_ID;
+    packet->ttl = 0;
+    packet->idempotency_key = mesh_node_next_idempotency_key();
+    packet->data_length = data_length;
+    memcpy(packet->data, data, data_length);
+
+    mesh_node_send_packet_to_peer(peer, packet);
+    mdp_free(packet);
+}
+
+static struct msd_child *
+msd_find_child(uint16_t conn_handle) {
+    int i;
+
+    for (i = 0; i < child_count; i++) {
+        if (children[i].conn_handle == conn_handle) {
+            return &children[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+msd_add_child(struct mesh_peer *peer, void *arg) {
+    struct msd_child *child;
+
+    // The command only goes down the tree, and a peer still being discovered can't take packets yet.
+    if (peer->conn_handle == shutdown_parent || peer->role != MESH_PEER_ROLE_NODE || mesh_peer_is_upstream(peer)) {
+        return;
+    }
+
+    if (child_count >= SHUTDOWN_MAX_CHILDREN) {
+        LOGW("Too many peers to pass the shutdown to, skipping %d", peer->conn_handle);
+        return;
+    }
+
+    child = &children[child_count++];
+    child->conn_handle = peer->conn_handle;
+    child->state = MSD_CHILD_WAIT_ACK;
+    child->sends = 0;
+}
+
+static void
+msd_send_command(struct msd_child *child) {
+    struct mesh_peer *peer;
+    uint32_t mesh_time_ms;
+
+    peer = mesh_peer_find(child->conn_handle);
+    if (peer == NULL) {
+        return;
+    }
+
+    child->sends++;
+    mesh_time_ms = shutdown_packet->mesh_time_ms;
+    mdp_age_mesh_time(shutdown_packet, ble_npl_time_ticks_to_ms32(ble_npl_time_get() - shutdown_received_at));
+    mesh_node_send_packet_to_peer(peer, shutdown_packet);
+    shutdown_packet->mesh_time_ms = mesh_time_ms;
+}
+
+static void
+msd_child_done(struct msd_child *child, bool missing) {
+    if (child->state == MSD_CHILD_DONE) {
+        return;
+    }
+
+    child->state = MSD_CHILD_DONE;
+    if (missing) {
+        subtree_missing = msd_add_saturated(subtree_missing, 1);
+    }
+}
+
+/**
+ * Reports our subtree to the parent and gives the report a moment to leave before handing over to the done callback.
+ */
+static void
+msd_finish() {
+    uint8_t report[SHUTDOWN_REPORT_SIZE];
+    int i;
+
+    for (i = 0; i < child_count; i++) {
+        msd_child_done(&children[i], true);
+    }
+
+    LOGI("Subtree asleep; asleep=%d missing=%d", subtree_asleep, subtree_missing);
+
+    report[SHUTDOWN_REPORT_ASLEEP_IDX] = subtree_asleep;
+    report[SHUTDOWN_REPORT_MISSING_IDX] = subtree_missing;
+    msd_send_hop(shutdown_parent, PT_SUBTREE_ASLEEP, report, sizeof report);
+
+    mdp_free(shutdown_packet);
+    shutdown_packet = NULL;
+
+    shutdown_state = MSD_STATE_LINGERING;
+    ble_npl_callout_reset(&shutdown_callout, ble_npl_time_ms_to_ticks32(SHUTDOWN_LINGER_IN_MS));
+}
+
+static bool
+msd_children_done() {
+    int i;
+
+    for (i = 0; i < child_count; i++) {
+        if (children[i].state != MSD_CHILD_DONE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+msd_finish_if_done() {
+    if (shutdown_state == MSD_STATE_WAITING && msd_children_done()) {
+        msd_finish();
+    }
+}
+
+static void
+msd_tick(struct ble_npl_event *ev) {
+    struct msd_child *child;
+    int i;
+
+    if (shutdown_state == MSD_STATE_LINGERING) {
+        shutdown_done_fn();
+        return;
+    }
+
+    if (shutdown_state != MSD_STATE_WAITING) {
+        return;
+    }
+
+    if (ble_npl_time_get() - shutdown_started_at >= ble_npl_time_ms_to_ticks32(SHUTDOWN_SUBTREE_TIMEOUT_IN_MS)) {
+        LOGW("Timed out waiting for the subtree to go to sleep");
+        msd_finish();
+        return;
+    }
+
+    for (i = 0; i < child_count; i++) {
+        child = &children[i];
+        if (child->state != MSD_CHILD_WAIT_ACK) {
+            continue;
+        }
+
+        if (child->sends >= SHUTDOWN_MAX_SENDS) {
+            // Never heard the command, it will sleep on its own forced sleep timer.
+            LOGW("Peer with conn handle %d never acked the shutdown", child->conn_handle);
+            msd_child_done(child, true);
+        } else {
+            msd_send_command(child);
+        }
+    }
+
+    if (msd_children_done()) {
+        msd_finish();
+    } else {
+        ble_npl_callout_reset(&shutdown_callout, ble_npl_time_ms_to_ticks32(SHUTDOWN_ACK_TIMEOUT_IN_MS));
+    }
+}
+
+/**
+ * Acks a go to sleep command back to the peer it came from.
+ *
+ * @return true for the first copy, which starts the shutdown. Later copies, whether resends or over another path, were
+ *         only acked.
+ */
+bool
+mesh_shutdown_received(uint16_t conn_handle, struct mesh_data_packet *packet) {
+    uint8_t ack[SHUTDOWN_ACK_SIZE];
+    bool first;
+
+    first = shutdown_state == MSD_STATE_IDLE;
+    if (first) {
+        shutdown_state = MSD_STATE_RECEIVED;
+        shutdown_parent = conn_handle;
+        shutdown_received_at = ble_npl_time_get();
+    }
+
+    ack[SHUTDOWN_ACK_REPORT_FOLLOWS_IDX] = conn_handle == shutdown_parent;
+    msd_send_hop(conn_handle, PT_GO_TO_SLEEP_ACK, ack, sizeof ack);
+
+    return first;
+}
+
+/**
+ * Passes the command on once to every node peer but the one it came from, and calls done_fn once they have all
+ * reported back or given up on.
+ */
+void
+mesh_shutdown_start(struct mesh_data_packet *packet, mesh_shutdown_done_fn *done_fn) {
+    int i;
+
+    if (shutdown_state != MSD_STATE_RECEIVED) {
+        return;
+    }
+
+    shutdown_state = MSD_STATE_WAITING;
+    shutdown_done_fn = done_fn;
+    shutdown_started_at = ble_npl_time_get();
+    subtree_asleep = 1;
+    subtree_missing = 0;
+
+    shutdown_packet = mdp_copy_packet(packet);
+    if (shutdown_packet->ttl > 0) {
+        shutdown_packet->ttl -= 1;
+    }
+
+    child_count = 0;
+    mesh_peer_exec_for_each(msd_add_child, NULL);
+    LOGI("Passing shutdown on to %d peers", child_count);
+
+    for (i = 0; i < child_count; i++) {
+        msd_send_command(&children[i]);
+    }
+
+    if (msd_children_done()) {
+        msd_finish();
+    } else {
+        ble_npl_callout_reset(&shutdown_callout, ble_npl_time_ms_to_ticks32(SHUTDOWN_ACK_TIMEOUT_IN_MS));
+    }
+}
+
+bool
+mesh_shutdown_in_progress() {
+    return shutdown_state != MSD_STATE_IDLE;
+}
+
+void
+mesh_shutdown_ack_received(uint16_t conn_handle, struct mesh_data_packet *packet) {
+    struct msd_child *child;
+
+    child = msd_find_child(conn_handle);
+    if (shutdown_state != MSD_STATE_WAITING || child == NULL || child->state != MSD_CHILD_WAIT_ACK) {
+        return;
+    }
+
+    if (packet->data_length >= SHUTDOWN_ACK_SIZE && packet->data[SHUTDOWN_ACK_REPORT_FOLLOWS_IDX]) {
+        child->state = MSD_CHILD_WAIT_REPORT;
+    } else {
+        // It had the command from someone else already and reports its subtree there.
+        msd_child_done(child, false);
+        msd_finish_if_done();
+    }
+}
+
+void
+mesh_shutdown_report_received(uint16_t conn_handle, struct mesh_data_packet *packet) {
+    struct msd_child *child;
+
+    child = msd_find_child(conn_handle);
+    if (shutdown_state != MSD_STATE_WAITING || child == NULL || child->state == MSD_CHILD_DONE ||
+        packet->data_length < SHUTDOWN_REPORT_SIZE) {
+        return;
+    }
+
+    subtree_asleep = msd_add_saturated(subtree_asleep, packet->data[SHUTDOWN_REPORT_ASLEEP_IDX]);
+    subtree_missing = msd_add_saturated(subtree_missing, packet->data[SHUTDOWN_REPORT_MISSING_IDX]);
+    msd_child_done(child, false);
+    msd_finish_if_done();
+}
+
+void
+mesh_shutdown_peer_disconnected(uint16_t conn_handle) {
+    struct msd_child *child;
+
+    if (shutdown_state != MSD_STATE_WAITING) {
+        return;
+    }
+
+    child = msd_find_child(conn_handle);
+    if (child != NULL) {
+        msd_child_done(child, true);
+        msd_finish_if_done();
+    }
+}
+
+void
+mesh_shutdown_init() {
+    shutdown_state = MSD_STATE_IDLE;
+    child_count = 0;
+    ble_npl_callout_init(&shutdown_callout, nimble_port_get_dflt_eventq(), msd_tick, NULL);
+}
@@ -0,0 +1,58 @@
+#include "mesh_data_packet.h"
+
+#ifndef MESH_SHUTDOWN_H
+#define MESH_SHUTDOWN_H
+
+/**
+ * Coordinated shutdown. The go to sleep command is forwarded once down the tree and acked back hop by hop. A node
+ * only goes to sleep once every child it passed the command to has reported its subtree asleep, or once
+ * SHUTDOWN_SUBTREE_TIMEOUT_IN_MS has passed. Reports are summed on the way up, so the hub learns when the whole tree
+ * is asleep.
+ */
+
+/* How long a child gets to ack the command before it is sent again, and how often it is sent at most. */
+#define SHUTDOWN_ACK_TIMEOUT_IN_MS 500
+#define SHUTDOWN_MAX_SENDS 3
+
+/* How long we wait for our children's reports before going to sleep without them. */
+#define SHUTDOWN_SUBTREE_TIMEOUT_IN_MS 3000
+
+/* Time our own report gets to leave before the links are torn down. */
+#define SHUTDOWN_LINGER_IN_MS 100
+
+/* Peers we pass the command on to. */
+#define SHUTDOWN_MAX_CHILDREN 8
+
+/* PT_GO_TO_SLEEP_ACK data: 1 if the sender is our parent for the shutdown and will get our report, 0 otherwise. */
+#define SHUTDOWN_ACK_REPORT_FOLLOWS_IDX 0
+#define SHUTDOWN_ACK_SIZE 1
+
+/* PT_SUBTREE_ASLEEP data: nodes going to sleep in the subtree and children that never reported. */
+#define SHUTDOWN_REPORT_ASLEEP_IDX 0
+#define SHUTDOWN_REPORT_MISSING_IDX 1
+#define SHUTDOWN_REPORT_SIZE 2
+
+typedef void mesh_shutdown_done_fn(void);
+
+void
+mesh_shutdown_init();
+
+bool
+mesh_shutdown_received(uint16_t conn_handle, struct mesh_data_packet *packet);
+
+void
+mesh_shutdown_start(struct mesh_data_packet *packet, mesh_shutdown_done_fn *done_fn);
+
+bool
+mesh_shutdown_in_progress();
+
+void
+mesh_shutdown_ack_received(uint16_t conn_handle, struct mesh_data_packet *packet);
+
+void
+mesh_shutdown_report_received(uint16_t conn_handle, struct mesh_data_packet *packet);
+
+void
+mesh_shutdown_peer_disconnected(uint16_t conn_handle);
+
+#endif //MESH_SHUTDOWN_H
@@ -0,0 +1,160 @@
+#include <inttypes.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_time.h"
+#include "mesh_peer.h"
+
+/**
+ * Mesh time is the hub's clock in milliseconds, wrapping at 32 bits. The hub stamps it on the packets that reach
+ * every node anyway (provisioning responses and the go to sleep command), and each node maps it onto its own RTC,
+ * which keeps running through deep sleep. Comparing how far the two clocks moved between syncs gives the RTC's
+ * drift, which is applied when we sleep until a point in mesh time, so nodes wake together rather than spreading
+ * apart by a little more every cycle.
+ */
+RTC_DATA_ATTR static bool time_synced;
+RTC_DATA_ATTR static uint32_t time_sync_mesh_ms;
+RTC_DATA_ATTR static int64_t time_sync_local_us;
+
+/** Parts per million our RTC runs fast (positive) or slow against mesh time. */
+RTC_DATA_ATTR static int32_t time_drift_ppm;
+
+/**
+ * The sync drift is measured from. It stays put across the syncs of several wakes until at least
+ * MESH_TIME_MIN_DRIFT_SPAN_MS of mesh time has passed.
+ */
+RTC_DATA_ATTR static uint32_t time_drift_mesh_ms;
+RTC_DATA_ATTR static int64_t time_drift_local_us;
+
+/**
+ * Wake schedule from the last go to sleep command. The base is only good for the wake it was sent for, the per hop
+ * offset is kept for the wakes we plan ourselves.
+ */
+static bool time_wake_base_valid;
+static uint32_t time_wake_base_ms;
+RTC_DATA_ATTR static uint16_t time_wake_hop_offset_ms;
+
+/** Our depth the last time we knew it, nodes asleep between wakes can't tell. */
+RTC_DATA_ATTR static uint8_t time_last_hop_depth;
+
+static int64_t
+mtime_local_us() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Converts an elapsed time on our RTC into elapsed mesh time.
+ */
+static int64_t
+mtime_local_to_mesh_us(int64_t local_us) {
+    return local_us * 1000000 / (1000000 + time_drift_ppm);
+}
+
+static int64_t
+mtime_mesh_to_local_us(int64_t mesh_us) {
+    return mesh_us * (1000000 + time_drift_ppm) / 1000000;
+}
+
+/**
+ * Records a mesh time received from the hub, updating the drift estimate once the sync it is measured from is far
+ * enough back.
+ */
+void
+mesh_time_sync(uint32_t mesh_time_ms) {
+    int64_t local_us = mtime_local_us();
+    int64_t local_elapsed_us;
+    uint32_t mesh_elapsed_ms;
+    int64_t measured_ppm;
+
+    mesh_elapsed_ms = mesh_time_ms - time_drift_mesh_ms;
+    if (!time_synced || mesh_elapsed_ms >= MESH_TIME_MAX_SYNC_AGE_MS) {
+        // Too far back to tell drift from the time we lost track, start measuring over.
+        time_drift_mesh_ms = mesh_time_ms;
+        time_drift_local_us = local_us;
+    } else if (mesh_elapsed_ms >= MESH_TIME_MIN_DRIFT_SPAN_MS) {
+        local_elapsed_us = local_us - time_drift_local_us;
+        measured_ppm = (local_elapsed_us - (int64_t) mesh_elapsed_ms * 1000) * 1000 / mesh_elapsed_ms;
+        if (measured_ppm > -MESH_TIME_MAX_DRIFT_PPM && measured_ppm < MESH_TIME_MAX_DRIFT_PPM) {
+            time_drift_ppm += (int32_t) ((measured_ppm - time_drift_ppm) >> MESH_TIME_DRIFT_EWMA_SHIFT);
+            LOGD("RTC drift measured %" PRId64 " ppm, estimate now %d ppm", measured_ppm, time_drift_ppm);
+        } else {
+            LOGW("Ignoring implausible RTC drift of %" PRId64 " ppm", measured_ppm);
+        }
+        time_drift_mesh_ms = mesh_time_ms;
+        time_drift_local_us = local_us;
+    }
+
+    time_sync_mesh_ms = mesh_time_ms;
+    time_sync_local_us = local_us;
+    time_synced = true;
+}
+
+/**
+ * Returns whether our clock was synced recently enough to plan wakes by it.
+ */
+bool
+mesh_time_synced() {
+    return time_synced && mtime_local_us() - time_sync_local_us < (int64_t) MESH_TIME_MAX_SYNC_AGE_MS * 1000;
+}
+
+uint32_t
+mesh_time_now_ms() {
+    return time_sync_mesh_ms + (uint32_t) (mtime_local_to_mesh_us(mtime_local_us() - time_sync_local_us) / 1000);
+}
+
+/**
+ * Returns how long to sleep on our RTC to wake at the given mesh time, 0 if it has passed.
+ */
+uint64_t
+mesh_time_sleep_us_until(uint32_t mesh_time_ms) {
+    int32_t remaining_ms = (int32_t) (mesh_time_ms - mesh_time_now_ms());
+
+    if (remaining_ms <= 0) {
+        return 0;
+    }
+
+    return mtime_mesh_to_local_us((int64_t) remaining_ms * 1000);
+}
+
+void
+mesh_time_set_wake_schedule(uint32_t base_ms, uint16_t hop_offset_ms) {
+    LOGI("Next mesh wake at %u ms, %d ms later per hop", base_ms, hop_offset_ms);
+    time_wake_base_ms = base_ms;
+    time_wake_base_valid = true;
+    time_wake_hop_offset_ms = hop_offset_ms;
+}
+
+/**
+ * Returns how long to sleep until our next wake. That is the wake the hub scheduled if it did, otherwise the next
+ * multiple of the period in mesh time, which every synced node with the same period agrees on. Either is staggered
+ * by hop depth: the hub's children wake first and each hop further out a little later, so relays are up and
+ * accepting children by the time the leaves below them start scanning.
+ */
+uint64_t
+mesh_time_sleep_us_until_wake(uint32_t period_ms, uint8_t hop_depth) {
+    uint32_t now_ms = mesh_time_now_ms();
+    uint32_t wake_ms;
+
+    if (hop_depth == MESH_PEER_HOPS_UNKNOWN) {
+        hop_depth = time_last_hop_depth != 0 ? time_last_hop_depth : MESH_TIME_STAGGER_MAX_HOPS;
+    } else if (hop_depth > MESH_TIME_STAGGER_MAX_HOPS) {
+        hop_depth = MESH_TIME_STAGGER_MAX_HOPS;
+    }
+    time_last_hop_depth = hop_depth;
+
+    if (time_wake_base_valid && (int32_t) (time_wake_base_ms - now_ms) > 0) {
+        wake_ms = time_wake_base_ms;
+    } else {
+        wake_ms = (now_ms / period_ms + 1) * period_ms;
+    }
+    wake_ms += (hop_depth - 1) * time_wake_hop_offset_ms;
+
+    if (wake_ms - now_ms < MESH_TIME_MIN_SLEEP_MS) {
+        wake_ms += period_ms;
+    }
+
+    return mesh_time_sleep_us_until(wake_ms);
+}
@@ -0,0 +1,52 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef MESH_TIME_H
+#define MESH_TIME_H
+
+/*
+ * Syncs closer together than this are too short to tell drift from the jitter of carrying the time over the mesh. Each
+ * hop adds the time a stamp spent with it, what's left is link latency, up to a few hundred ms over a deep mesh. Over
+ * half an hour that is a couple of hundred ppm, well inside the drift of the RTC's RC oscillator.
+ */
+#define MESH_TIME_MIN_DRIFT_SPAN_MS (30 * 60 * 1000)
+
+/* Weight of a new drift measurement, as a right shift. */
+#define MESH_TIME_DRIFT_EWMA_SHIFT 2
+
+/* The RTC's RC oscillator is specified within a few percent, anything beyond is a bad measurement. */
+#define MESH_TIME_MAX_DRIFT_PPM 50000
+
+/* How long we trust our clock to stay aligned with the mesh after a sync. */
+#define MESH_TIME_MAX_SYNC_AGE_MS (6 * 60 * 60 * 1000)
+
+/* Aligned wakes closer than this are skipped, we were just awake. */
+#define MESH_TIME_MIN_SLEEP_MS 5000
+
+/* Deepest hop depth the wake stagger distinguishes, deeper and unknown depths wake with it. */
+#define MESH_TIME_STAGGER_MAX_HOPS 6
+
+/* Go to sleep payload: the mesh time the hub's children wake at, then the delay for each further hop. */
+#define MESH_TIME_WAKE_BASE_IDX 0
+#define MESH_TIME_WAKE_HOP_OFFSET_IDX (MESH_TIME_WAKE_BASE_IDX + sizeof(uint32_t))
+#define MESH_TIME_WAKE_SCHEDULE_SIZE (MESH_TIME_WAKE_HOP_OFFSET_IDX + sizeof(uint16_t))
+
+void
+mesh_time_sync(uint32_t mesh_time_ms);
+
+bool
+mesh_time_synced();
+
+uint32_t
+mesh_time_now_ms();
+
+uint64_t
+mesh_time_sleep_us_until(uint32_t mesh_time_ms);
+
+void
+mesh_time_set_wake_schedule(uint32_t base_ms, uint16_t hop_offset_ms);
+
+uint64_t
+mesh_time_sleep_us_until_wake(uint32_t period_ms, uint8_t hop_depth);
+
+#endif //MESH_TIME_H
@@ -0,0 +1,221 @@
+#include <string.h>
+#include "host/ble_hs.h"
+#include "mesh_sensor_constants.h"
+#include "mesh_transport.h"
+#include "mesh_node.h"
+
+static mesh_transport_receive_fn *transport_receive_fn;
+static mesh_transport_done_fn *transport_done_fn;
+
+void
+mesh_transport_set_handlers(mesh_transport_receive_fn *receive_fn, mesh_transport_done_fn *done_fn) {
+    transport_receive_fn = receive_fn;
+    transport_done_fn = done_fn;
+}
+
+void
+mesh_transport_received(uint16_t conn_handle, uint8_t *packed_data, uint16_t packed_len) {
+    if (transport_receive_fn != NULL) {
+        transport_receive_fn(conn_handle, packed_data, packed_len);
+    }
+}
+
+void
+mesh_transport_done(uint16_t conn_handle, int status) {
+    if (transport_done_fn != NULL) {
+        transport_done_fn(conn_handle, status);
+    }
+}
+
+/**
+ * Picks the transport to reach a peer. A bearer the peer opened on top of the connection wins, otherwise nodes are
+ * written to and the hub, which has no write characteristic, is notified. Peers still being discovered have none.
+ */
+const struct mesh_transport *
+mesh_transport_for_peer(const struct mesh_peer *peer) {
+    if (peer->transport != NULL) {
+        return peer->transport;
+    }
+
+    switch (peer->role) {
+        case MESH_PEER_ROLE_NODE:
+            return &mesh_transport_gatt_write;
+        case MESH_PEER_ROLE_HUB:
+            return &mesh_transport_gatt_notify;
+        default:
+            return NULL;
+    }
+}
+
+static uint16_t
+mt_gatt_mtu(const struct mesh_peer *peer) {
+    return mesh_peer_max_write_len(peer);
+}
+
+/**
+ * A long write takes any packet, however small the MTU still is.
+ */
+static uint16_t
+mt_gatt_write_mtu(const struct mesh_peer *peer) {
+    return DATA_PACKET_MAX_SIZE;
+}
+
+static int
+mt_on_gatt_write(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg) {
+    mesh_transport_done(conn_handle, error->status);
+    return 0;
+}
+
+/**
+ * Writes the packet in a single request if it fits the MTU. Before the MTU exchange has finished it may not, and a
+ * long write then carries it in pieces over a few more round trips.
+ */
+static int
+mt_gatt_write(struct mesh_peer *peer, const uint8_t *packed_data, uint16_t packed_len) {
+    struct os_mbuf *om;
+    int rc;
+
+    if (packed_len <= mesh_peer_max_write_len(peer)) {
+        rc = ble_gattc_write_flat(peer->conn_handle, peer->data_val_handle,
+                                  packed_data, packed_len, mt_on_gatt_write, NULL);
+    } else {
+        om = ble_hs_mbuf_from_flat(packed_data, packed_len);
+        if (om == NULL) {
+            return BLE_HS_ENOMEM;
+        }
+        rc = ble_gattc_write_long(peer->conn_handle, peer->data_val_handle, 0, om, mt_on_gatt_write, NULL);
+    }
+    if (rc != 0) {
+        LOGE("Error: Failed to write characteristic; rc=%d\n", rc);
+    }
+    return rc;
+}
+
+static int
+mt_gatt_notify(struct mesh_peer *peer, const uint8_t *packed_data, uint16_t packed_len) {
+    struct os_mbuf *om;
+    int rc;
+
+    om = ble_hs_mbuf_from_flat(packed_data, packed_len);
+    if (om == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+
+    rc = ble_gattc_notify_custom(peer->conn_handle, dp_value_handle, om);
+    if (rc != 0) {
+        LOGE("Error sending notification to hub, rc=%d", rc);
+    }
+    return rc;
+}
+
+const struct mesh_transport mesh_transport_gatt_write = {
+        .name = "gatt-write",
+        .send = mt_gatt_write,
+        .mtu = mt_gatt_write_mtu,
+        .confirms = true,
+};
+
+const struct mesh_transport mesh_transport_gatt_notify = {
+        .name = "gatt-notify",
+        .send = mt_gatt_notify,
+        .mtu = mt_gatt_mtu,
+};
+
+/**
+ * In-process loopback, so routing, dedup and queueing can run and be measured without a radio. Packets sent to a peer
+ * on it go to the wire function, which stands in for whatever is at the far end of the link, and packets the far end
+ * injects come in through mesh_transport_received as if the peer had sent them. Both directions are deferred to
+ * mesh_transport_loopback_run so a flood doesn't recurse through the receive path.
+ */
+struct mt_loopback_frame {
+    bool inbound;
+    uint16_t conn_handle;
+    uint16_t packed_len;
+    uint8_t packed_data[DATA_PACKET_MAX_SIZE];
+};
+
+static struct mt_loopback_frame loopback_frames[TRANSPORT_LOOPBACK_QUEUE_SIZE];
+static uint8_t loopback_head;
+static uint8_t loopback_count;
+static mesh_transport_loopback_wire_fn *loopback_wire_fn;
+
+static int
+mt_loopback_queue(bool inbound, uint16_t conn_handle, const uint8_t *packed_data, uint16_t packed_len) {
+    struct mt_loopback_frame *frame;
+
+    if (loopback_count == TRANSPORT_LOOPBACK_QUEUE_SIZE) {
+        return BLE_HS_ENOMEM;
+    }
+    if (packed_len > DATA_PACKET_MAX_SIZE) {
+        return BLE_HS_EMSGSIZE;
+    }
+
+    frame = &loopback_frames[(loopback_head + loopback_count) % TRANSPORT_LOOPBACK_QUEUE_SIZE];
+    frame->inbound = inbound;
+    frame->conn_handle = conn_handle;
+    frame->packed_len = packed_len;
+    memcpy(frame->packed_data, packed_data, packed_len);
+    loopback_count++;
+
+    return 0;
+}
+
+static uint16_t
+mt_loopback_mtu(const struct mesh_peer *peer) {
+    return DATA_PACKET_MAX_SIZE;
+}
+
+static int
+mt_loopback_send(struct mesh_peer *peer, const uint8_t *packed_data, uint16_t packed_len) {
+    return mt_loopback_queue(false, peer->conn_handle, packed_data, packed_len);
+}
+
+void
+mesh_transport_loopback_init(mesh_transport_loopback_wire_fn *wire_fn) {
+    loopback_wire_fn = wire_fn;
+    loopback_head = 0;
+    loopback_count = 0;
+}
+
+/**
+ * Queues a packet from the far end of the link with the given connection handle.
+ */
+int
+mesh_transport_loopback_inject(uint16_t conn_handle, const uint8_t *packed_data, uint16_t packed_len) {
+    return mt_loopback_queue(true, conn_handle, packed_data, packed_len);
+}
+
+/**
+ * Delivers the queued frames in order, including those queued while delivering. Returns how many were delivered.
+ */
+int
+mesh_transport_loopback_run() {
+    struct mt_loopback_frame frame;
+    int delivered = 0;
+
+    while (loopback_count > 0) {
+        // Copy the frame out, delivering it may queue new ones into its slot.
+        frame = loopback_frames[loopback_head];
+        loopback_head = (loopback_head + 1) % TRANSPORT_LOOPBACK_QUEUE_SIZE;
+        loopback_count--;
+
+        if (frame.inbound) {
+            mesh_transport_received(frame.conn_handle, frame.packed_data, frame.packed_len);
+        } else {
+            if (loopback_wire_fn != NULL) {
+                loopback_wire_fn(frame.conn_handle, frame.packed_data, frame.packed_len);
+            }
+            mesh_transport_done(frame.conn_handle, 0);
+        }
+        delivered++;
+    }
+
+    return delivered;
+}
+
+const struct mesh_transport mesh_transport_loopback = {
+        .name = "loopback",
+        .send = mt_loopback_send,
+        .mtu = mt_loopback_mtu,
+        .confirms = true,
+};
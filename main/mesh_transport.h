@@ -0,0 +1,63 @@
+#include "mesh_peer.h"
+
+#ifndef MESH_TRANSPORT_H
+#define MESH_TRANSPORT_H
+
+/* Frames the loopback transport holds until they are delivered, in both directions together. */
+#define TRANSPORT_LOOPBACK_QUEUE_SIZE 16
+
+/**
+ * Carries packed packets to a peer. The routing code in mesh_node only talks to transports, so bearers can be added
+ * or swapped without touching the forwarding logic.
+ */
+struct mesh_transport {
+    const char *name;
+
+    /** Queues a packed packet for the peer. Returns 0 if the transport took it. */
+    int (*send)(struct mesh_peer *peer, const uint8_t *packed_data, uint16_t packed_len);
+
+    /** Largest packed packet the transport can carry to the peer right now. */
+    uint16_t (*mtu)(const struct mesh_peer *peer);
+
+    /** Set if the outcome of every accepted send is reported through mesh_transport_done. */
+    bool confirms;
+
+    /** Tried next when this transport can't take a packet, NULL if there is nothing else. */
+    const struct mesh_transport *fallback;
+};
+
+/** Upcall for every packed packet a transport receives. */
+typedef void mesh_transport_receive_fn(uint16_t conn_handle, uint8_t *packed_data, uint16_t packed_len);
+
+/** Called when a send that completes asynchronously has finished, status 0 means the peer has the packet. */
+typedef void mesh_transport_done_fn(uint16_t conn_handle, int status);
+
+/** Far end of the loopback transport, gets every packed packet sent to a peer on it. */
+typedef void mesh_transport_loopback_wire_fn(uint16_t conn_handle, const uint8_t *packed_data, uint16_t packed_len);
+
+extern const struct mesh_transport mesh_transport_gatt_write;
+extern const struct mesh_transport mesh_transport_gatt_notify;
+extern const struct mesh_transport mesh_transport_loopback;
+
+void
+mesh_transport_set_handlers(mesh_transport_receive_fn *receive_fn, mesh_transport_done_fn *done_fn);
+
+const struct mesh_transport *
+mesh_transport_for_peer(const struct mesh_peer *peer);
+
+void
+mesh_transport_received(uint16_t conn_handle, uint8_t *packed_data, uint16_t packed_len);
+
+void
+mesh_transport_done(uint16_t conn_handle, int status);
+
+void
+mesh_transport_loopback_init(mesh_transport_loopback_wire_fn *wire_fn);
+
+int
+mesh_transport_loopback_inject(uint16_t conn_handle, const uint8_t *packed_data, uint16_t packed_len);
+
+int
+mesh_transport_loopback_run();
+
+#endif //MESH_TRANSPORT_H